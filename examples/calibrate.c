@@ -36,18 +36,8 @@
 #include <stdlib.h>
 
 #define PIN_BASE 300
-#define MAX_PWM 4096
 #define HERTZ 50
 
-/**
- * Calculate the number of ticks the signal should be high for the required amount of time
- */
-int calcTicks(float impulseMs, int hertz)
-{
-	float cycleMs = 1000.0f / hertz;
-	return (int)(MAX_PWM * impulseMs / cycleMs + 0.5f);
-}
-
 
 int main(void)
 {
@@ -65,7 +55,7 @@ int main(void)
 	}
 
 	pca9685PWMReset(fd);
-	printf("Frequency is set to %d hertz\n", HERTZ);
+	printf("Frequency is set to %d hertz, the period is %d us\n", HERTZ, pca9685Period(fd) / 1000);
 
 
 	int i, j = 1;
@@ -82,7 +72,7 @@ int main(void)
 			millis = 1.5f;
 			i = 1;
 
-			pwmWrite(PIN_BASE + pin, calcTicks(millis, HERTZ));
+			pca9685WriteMicros(fd, pin, (int)(millis * 1000));
 			printf("Servo %d is centered at %1.2f ms\n", pin, millis);
 
 			while (i)
@@ -92,7 +82,7 @@ int main(void)
 
 				if (millis > 0 && millis <= 3)
 				{
-					pwmWrite(PIN_BASE + pin, calcTicks(millis, HERTZ));
+					pca9685WriteMicros(fd, pin, (int)(millis * 1000));
 					delay(1000);
 				}
 				else
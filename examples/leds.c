@@ -36,11 +36,52 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #define PIN_BASE 300
-#define MAX_PWM 4096
+#define PIXELS 16
 #define HERTZ 50
 
+// Frames per second of the animation and the parts of one cycle in frames
+#define FPS 60
+#define FADE 60				// Up or down
+#define CHASE 2				// Per pixel
+#define PAUSE 30
+#define CYCLE (5 * 2 * FADE + PAUSE + 5 * 2 * PIXELS * CHASE + PAUSE)
+
+
+/**
+ * Renders the frame of the animation the scheduler asks for. Frames that are skipped
+ * because the bus is too slow don't slow down the animation.
+ */
+static int effect(unsigned long frame, void *arg)
+{
+	unsigned char pixels[PIXELS];
+	int t = frame % CYCLE;
+	int i;
+
+	memset(pixels, 0, sizeof(pixels));
+
+	// All pins fade up and down five times. The default curve (gamma 2.2) makes it look even to the eye.
+	if (t < 5 * 2 * FADE)
+	{
+		int step = t % (2 * FADE);
+		int level = step < FADE ? step : 2 * FADE - step;
+
+		memset(pixels, level * 255 / FADE, sizeof(pixels));
+	}
+
+	// Then the pins light up one after another and go dark in the same order, five times
+	else if ((t -= 5 * 2 * FADE + PAUSE) >= 0 && t < 5 * 2 * PIXELS * CHASE)
+	{
+		int step = (t / CHASE) % (2 * PIXELS);
+
+		for (i = 0; i < PIXELS; i++)
+			pixels[i] = step < PIXELS ? (i <= step ? 255 : 0) : (i > step - PIXELS ? 255 : 0);
+	}
+
+	return pca9685PixelShow8(pixels) < 0 ? -1 : 0;
+}
 
 
 int main(void)
@@ -59,48 +100,16 @@ int main(void)
 
 	pca9685PWMReset(fd);
 
-	int i, j;
-	int active = 1;
+	// Every pin is a pixel of its own
+	pca9685PixelLayout(PIXELS, 1);
 
-	while (active)
-	{
-		for (j = 0; j < 5; j++)
-		{
-			for (i = 0; i < MAX_PWM; i += 32)
-			{
-				pwmWrite(PIN_BASE + 16, i);
-				delay(4);
-			}
-
-			for (i = 0; i < MAX_PWM; i += 32)
-			{
-				pwmWrite(PIN_BASE + 16, MAX_PWM - i);
-				delay(4);
-			}
-		}
-
-		pwmWrite(PIN_BASE + 16, 0);
-		delay(500);
-
-		for (j = 0; j < 5; j++)
-		{
-			for (i = 0; i < 16; i++)
-			{
-				pwmWrite(PIN_BASE + i, MAX_PWM);
-				delay(20);
-			}
-
-			for (i = 0; i < 16; i++)
-			{
-				pwmWrite(PIN_BASE + i, 0);
-				delay(20);
-			}
-		}
-
-		pwmWrite(PIN_BASE + 16, 0);
-		delay(500);
-	}
+	int i;
+	for (i = 0; i < PIXELS; i++)
+		pca9685PixelAssign(i, fd, i);
 
+	// Runs until the program is killed
+	pca9685SchedAdd(effect, 0);
+	pca9685SchedRun(FPS, 0);
 
 	return 0;
 }
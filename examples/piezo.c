@@ -47,92 +47,83 @@
 #include <wiringPi.h>
 #include <wiringPiI2C.h>
 
-#include <math.h>
 #include <stdio.h>
 
 #define PIN_BASE 300
-#define SCALE_SIZE 35
-#define MEASURE_TIME 2000
+#define PIN 16
+#define TEMPO 120
 #define A4 440
 
-// The length of a beat
-#define _4_4 1.0f
-#define _3_4 0.75f
-#define _1_2 0.5f
-#define _3_8 0.375f
-#define _1_4 0.25f
-#define _1_8 0.125f
-#define _1_16 0.0625f
-#define _0 0.01f
+// The length of a note in beats (quarter notes)
+#define _4_4 4.0f
+#define _3_4 3.0f
+#define _1_2 2.0f
+#define _3_8 1.5f
+#define _1_4 1.0f
+#define _1_8 0.5f
+#define _1_16 0.25f
+#define _0 0.04f
 
 /**
- * The notes of the scale
+ * The notes of the scale as MIDI note numbers, starting at piano key 6
  * (This is the german type annotation)
  */
 
 typedef enum
 {
-	_ = -1, D1, Dis1, E1, F1, Fis1, G1, Gis1, A1, B1, H1,
+	_ = -1, D1 = 26, Dis1, E1, F1, Fis1, G1, Gis1, A1, B1, H1,
 	C, Cis,	D, Dis, E, F, Fis, G, Gis, A, B, H,
 	c, cis,	d, dis, e, f, fis, g, gis, a, b, h,
 	c1
 } Note;
 
 
-float scale[SCALE_SIZE];
 int fd;
-int playing = 0;
-
 
 /**
- * http://en.wikipedia.org/wiki/Piano_key_frequencies
+ * A tune. Who can guess which one?
  */
-float getFrequency(float a4, int key)
+const struct pca9685Note tune[] =
 {
-	float freq = a4 * pow(2, (key - 49.0f) / 12.0f);
-	return freq;
-}
+	{ G, _3_8 },	{ D, _1_8 },	{ G, _3_8 },	{ D, _1_8 },
+	{ G, _1_8 },	{ D, _1_8 },	{ G, _1_8 },	{ H, _1_8 },	{ d, _1_2 },	{ _, _0 },
+	{ c, _3_8 },	{ A, _1_8 },	{ c, _3_8 },	{ A, _1_8 },
+	{ c, _1_8 },	{ A, _1_8 },	{ Fis, _1_8 },	{ A, _1_8 },	{ D, _1_2 },	{ _, _0 },
+
+	{ G, _1_4 },	{ G, _3_8 },	{ H, _1_8 },	{ A, _1_8 },	{ G, _1_8 },
+	{ G, _1_8 },	{ Fis, _1_8 },	{ Fis, _3_8 },	{ A, _1_8 },	{ c, _1_8 },	{ Fis, _1_8 },
+	{ A, _1_8 },	{ G, _1_8 },	{ G, _3_8 },	{ H, _1_8 },	{ A, _1_8 },	{ G, _1_8 },
+	{ G, _1_8 },	{ Fis, _1_8 },	{ Fis, _3_8 },	{ A, _1_8 },	{ c, _1_8 },	{ Fis, _1_8 },
+	{ G, _1_8 },	{ G, _1_8 },	{ G, _1_16 },	{ Fis, _1_16 },	{ E, _1_16 },	{ Fis, _1_16 },
+	{ G, _1_8 },	{ G, _1_8 },	{ H, _1_16 },	{ A, _1_16 },	{ G, _1_16 },	{ A, _1_16 },
+	{ H, _1_8 },	{ H, _1_8 },	{ d, _1_16 },	{ c, _1_16 },	{ H, _1_16 },	{ c, _1_16 },		{ d, _1_2 },	{ _, _0 },
+
+	{ d, _1_2 },	{ e, _1_2 },
+	{ d, _1_8 },	{ c, _1_8 },	{ c, _1_8 },	{ c, _1_8 },	{ c, _1_8 },	{ H, _1_8 },	{ H, _1_8 },	{ H, _1_8 },
+	{ H, _1_8 },	{ A, _1_8 },	{ A, _1_8 },	{ A, _1_8 },	{ G, _1_8 },	{ Fis, _1_8 },	{ E, _1_8 },	{ Fis, _1_8 },
+	{ G, _1_4 },	{ A, _1_4 },	{ H, _1_2 },	{ _, _0 },
+
+	{ d, _1_2 },	{ e, _1_2 },
+	{ d, _1_8 },	{ c, _1_8 },	{ c, _1_8 },	{ c, _1_8 },	{ c, _1_8 },	{ H, _1_8 },	{ H, _1_8 },	{ H, _1_8 },
+	{ H, _1_8 },	{ A, _1_8 },	{ A, _1_8 },	{ A, _1_8 },	{ G, _1_8 },	{ Fis, _1_8 },	{ E, _1_8 },	{ Fis, _1_8 },
+	{ G, _1_4 },	{ H, _1_4 },	{ G, _1_4 },	{ _, _0 },
+};
 
-/**
- * Generate frequencies and start at piano key 6
-*/
-void generateScale(float a4)
-{
-	int i;
-	for (i = 0; i < SCALE_SIZE; i++)
-	{
-		scale[i] = getFrequency(a4, i + 6);
-//		printPrescale(scale[i]);
-	}
-}
 
 /**
- * Plays a note.
- * Turns off PWM if note is silent or
- * plays a rectangular wave when there is a note
+ * Shows how far each note of the scale is off, the prescale only gets close to most of them
  */
-void playNote(Note note, float beat)
+void printScale()
 {
-	if (note == _)
-	{
-		if (playing)
-		{
-			pca9685FullOff(fd, 16, 1);
-			playing = 0;
-		}
-	}
-	else
-	{
-		if (!playing)
-		{
-			pca9685PWMWrite(fd, 16, 0, 2048);
-			playing = 1;
-		}
+	struct pca9685Tone tone;
+	int note;
 
-		pca9685PWMFreq(fd, scale[note]);
+	for (note = D1; note <= c1; note++)
+	{
+		int ret = pca9685ToneInfo(fd, note, &tone);
+		printf("%3d: %7.2f Hz, prescale %3d, %7.2f Hz, %+5.1f cents%s\n", note, tone.freq, tone.prescale,
+			tone.achieved, tone.cents, ret ? " (out of reach)" : "");
 	}
-
-	delay(MEASURE_TIME * beat);
 }
 
 /**
@@ -140,45 +131,16 @@ void playNote(Note note, float beat)
  */
 void playScale()
 {
-	pca9685PWMWrite(fd, 16, 0, 2048);
-
+	struct pca9685Note scale[c1 - D1 + 1];
 	int i;
-	for (i = 0; i < SCALE_SIZE; i++)
+
+	for (i = 0; i <= c1 - D1; i++)
 	{
-		pca9685PWMFreq(fd, scale[i]);
-		delay(500);
+		scale[i].note = D1 + i;
+		scale[i].beats = _1_4;
 	}
 
-	pca9685FullOff(fd, 16, 1);
-}
-
-/**
- * Plays a tune. Who can guess which one?
- */
-void playTune()
-{
-	playNote(G, _3_8);	playNote(D, _1_8);	playNote(G, _3_8);	playNote(D, _1_8);
-	playNote(G, _1_8);	playNote(D, _1_8);	playNote(G, _1_8);	playNote(H, _1_8);	playNote(d, _1_2);	playNote(_, _0);
-	playNote(c, _3_8);	playNote(A, _1_8);	playNote(c, _3_8);	playNote(A, _1_8);
-	playNote(c, _1_8);	playNote(A, _1_8);	playNote(Fis, _1_8);	playNote(A, _1_8);	playNote(D, _1_2);	playNote(_, _0);
-
-	playNote(G, _1_4);	playNote(G, _3_8);	playNote(H, _1_8);	playNote(A, _1_8);	playNote(G, _1_8);
-	playNote(G, _1_8);	playNote(Fis, _1_8);	playNote(Fis, _3_8);	playNote(A, _1_8);	playNote(c, _1_8);	playNote(Fis, _1_8);
-	playNote(A, _1_8);	playNote(G, _1_8);	playNote(G, _3_8);	playNote(H, _1_8);	playNote(A, _1_8);	playNote(G, _1_8);
-	playNote(G, _1_8);	playNote(Fis, _1_8);	playNote(Fis, _3_8);	playNote(A, _1_8);	playNote(c, _1_8);	playNote(Fis, _1_8);
-	playNote(G, _1_8);	playNote(G, _1_8);	playNote(G, _1_16);	playNote(Fis, _1_16);	playNote(E, _1_16);	playNote(Fis, _1_16);
-	playNote(G, _1_8);	playNote(G, _1_8);	playNote(H, _1_16);	playNote(A, _1_16);	playNote(G, _1_16);	playNote(A, _1_16);
-	playNote(H, _1_8);	playNote(H, _1_8);	playNote(d, _1_16);	playNote(c, _1_16);	playNote(H, _1_16);	playNote(c, _1_16);		playNote(d, _1_2);	playNote(_, _0);
-
-	playNote(d, _1_2);	playNote(e, _1_2);
-	playNote(d, _1_8);	playNote(c, _1_8);	playNote(c, _1_8);	playNote(c, _1_8);	playNote(c, _1_8);	playNote(H, _1_8);	playNote(H, _1_8);	playNote(H, _1_8);
-	playNote(H, _1_8);	playNote(A, _1_8);	playNote(A, _1_8);	playNote(A, _1_8);	playNote(G, _1_8);	playNote(Fis, _1_8);	playNote(E, _1_8);	playNote(Fis, _1_8);
-	playNote(G, _1_4);	playNote(A, _1_4);	playNote(H, _1_2);	playNote(_, _0);
-
-	playNote(d, _1_2);	playNote(e, _1_2);
-	playNote(d, _1_8);	playNote(c, _1_8);	playNote(c, _1_8);	playNote(c, _1_8);	playNote(c, _1_8);	playNote(H, _1_8);	playNote(H, _1_8);	playNote(H, _1_8);
-	playNote(H, _1_8);	playNote(A, _1_8);	playNote(A, _1_8);	playNote(A, _1_8);	playNote(G, _1_8);	playNote(Fis, _1_8);	playNote(E, _1_8);	playNote(Fis, _1_8);
-	playNote(G, _1_4);	playNote(H, _1_4);	playNote(G, _1_4);	playNote(_, _0);
+	pca9685TonePlay(fd, scale, c1 - D1 + 1, TEMPO);
 }
 
 int main(void)
@@ -196,9 +158,12 @@ int main(void)
 	}
 	pca9685PWMReset(fd);
 
-	generateScale(A4);
+	// Works out the prescale of every note once
+	pca9685ToneSetup(fd, PIN, A4);
+	printScale();
+
 //	playScale();
-	playTune();
+	pca9685TonePlay(fd, tune, sizeof(tune) / sizeof(tune[0]), TEMPO);
 
 	return 0;
 }
@@ -36,19 +36,9 @@
 #include <stdlib.h>
 
 #define PIN_BASE 300
-#define MAX_PWM 4096
 #define HERTZ 50
 
 
-/**
- * Calculate the number of ticks the signal should be high for the required amount of time
- */
-int calcTicks(float impulseMs, int hertz)
-{
-	float cycleMs = 1000.0f / hertz;
-	return (int)(MAX_PWM * impulseMs / cycleMs + 0.5f);
-}
-
 /**
  * input is [0..1]
  * output is [min..max]
@@ -81,9 +71,7 @@ int main(void)
 
 	// Set servo to neutral position at 1.5 milliseconds
 	// (View http://en.wikipedia.org/wiki/Servo_control#Pulse_duration)
-	float millis = 1.5;
-	int tick = calcTicks(millis, HERTZ);
-	pwmWrite(PIN_BASE + 16, tick);
+	pca9685WriteMicros(fd, 16, 1500);
 	delay(2000);
 
 
@@ -95,10 +83,7 @@ int main(void)
 		while (r > 1)
 			r /= 10;
 
-		millis = map(r, 1, 2);
-		tick = calcTicks(millis, HERTZ);
-
-		pwmWrite(PIN_BASE + 16, tick);
+		pca9685WriteMicros(fd, 16, (int)map(r, 1000, 2000));
 		delay(1000);
 	}
 
@@ -24,121 +24,331 @@
  **************************************************************************
  */
 
-#include <wiringPi.h>
-#include <wiringPiI2C.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
 
 #include "pca9685.h"
+#include "pca9685dev.h"
 
-// Setup registers
-#define PCA9685_MODE1 0x0
-#define PCA9685_PRESCALE 0xFE
+struct pca9685Dev *_Atomic pca9685Devices = 0;
 
-// Define first LED and all LED. We calculate the rest
-#define LED0_ON_L 0x6
-#define LEDALL_ON_L 0xFA
+static struct pca9685Bus *_Atomic buses = 0;
 
-#define PIN_ALL 16
+// Guards adding to the lists above. Lookups don't need it: entries are never removed and new
+// ones are set up completely before they're published at the head with a release store.
+static pthread_mutex_t registry = PTHREAD_MUTEX_INITIALIZER;
 
 
 // Declare
-static void myPwmWrite(struct wiringPiNodeStruct *node, int pin, int value);
-static void myOnOffWrite(struct wiringPiNodeStruct *node, int pin, int value);
-static int myOffRead(struct wiringPiNodeStruct *node, int pin);
-static int myOnRead(struct wiringPiNodeStruct *node, int pin);
+static int readReg8(struct pca9685Dev *dev, int reg);
+static int readRegisters(struct pca9685Dev *dev, unsigned char *regs, int *prescale);
+static int loadRegisters(struct pca9685Dev *dev, unsigned char *mode, unsigned char *led);
+static int writeReg8(struct pca9685Dev *dev, int reg, int value);
+static void updatePeriod(struct pca9685Dev *dev);
+static int finishRetune(struct pca9685Dev *dev, int wait);
+static int writeBlock(struct pca9685Dev *dev, int reg, const unsigned char *data, int len);
+static unsigned char *stagePin(struct pca9685Dev *dev, int pin);
+static void stageFull(struct pca9685Dev *dev, int pin, int index, int tf);
+static int fullWrite(struct pca9685Dev *dev, int pin, int index, int tf, int *ret);
+static struct pca9685Dev *lockWrite(int fd);
+static int resync(struct pca9685Dev *dev);
 int baseReg(int pin);
 
 
 /**
- * Setup a PCA9685 device with wiringPi.
- *  
- * pinBase: 	Use a pinBase > 64, eg. 300
- * i2cAddress:	The default address is 0x40
- * freq:		Frequency will be capped to range [40..1000] Hertz. Try 50 for servos
+ * Sets the frequency of PWM signals.
+ * The prescale range 3..255 limits it to about [24..1526] Hertz with the internal oscillator. Try 50 for servos.
+ * Returns 0 on success or -1 on error.
  */
-int pca9685Setup(const int pinBase, const int i2cAddress, float freq)
+int pca9685PWMFreq(int fd, float freq)
 {
-	// Create a node with 16 pins [0..15] + [16] for all
-	struct wiringPiNodeStruct *node = wiringPiNewNode(pinBase, PIN_ALL + 1);
+	return pca9685Frequency(fd, freq, 0) < 0 ? -1 : 0;
+}
 
-	// Check if pinBase is available
-	if (!node)
-		return -1;
+/**
+ * Picks the prescale which comes closest to freq with the oscillator of the device and programs it.
+ * Returns the frequency actually achieved or -1 on error. If error is given, it receives
+ * the difference to the requested frequency in Hertz.
+ */
+float pca9685Frequency(int fd, float freq, float *error)
+{
+	float achieved = pca9685Retune(fd, freq, PCA9685_RETUNE_RESTART);
 
-	// Check i2c address
-	int fd = wiringPiI2CSetup(i2cAddress);
-	if (fd < 0)
-		return fd;
+	if (error && achieved > 0)
+		*error = achieved - freq;
 
-	// Setup the chip. Enable auto-increment of registers.
-	int settings = wiringPiI2CReadReg8(fd, PCA9685_MODE1) & 0x7F;
-	int autoInc = settings | 0x20;
+	return achieved;
+}
 
-	wiringPiI2CWriteReg8(fd, PCA9685_MODE1, autoInc);
-	
-	// Set frequency of PWM signals. Also ends sleep mode and starts PWM output.
-	if (freq > 0)
-		pca9685PWMFreq(fd, freq);
-	
+/**
+ * Programs the prescale closest to freq with as little delay as possible. Sleep, prescale and
+ * wake go out in a single transaction, based on the cached MODE1. If the prescale doesn't change,
+ * nothing is written at all.
+ * PCA9685_RETUNE_RESTART resumes the outputs with their old values, which the chip only accepts
+ * 500 us after waking up. Without it, the outputs stay off until the next write to a pin.
+ * PCA9685_RETUNE_NOWAIT returns without waiting for that, pca9685RetuneFinish does the restart later.
+ * Returns the frequency actually achieved or -1 on error.
+ */
+float pca9685Retune(int fd, float freq, int flags)
+{
+	if (freq <= 0)
+		return -1;
+
+	struct pca9685Dev *dev = lockWrite(fd);
+	if (!dev)
+		return -1;
 
-	node->fd			= fd;
-	node->pwmWrite		= myPwmWrite;
-	node->digitalWrite	= myOnOffWrite;
-	node->digitalRead	= myOffRead;
-	node->analogRead	= myOnRead;
+	int prescale = pca9685DevPrescale(dev, freq);
+	float achieved = pca9685DevRetune(dev, prescale, flags) < 0 ? -1 : dev->osc / (4096.0 * (prescale + 1));
 
-	return fd;
+	pca9685DevUnlock(dev);
+	return achieved;
 }
 
 /**
- * Sets the frequency of PWM signals.
- * Frequency will be capped to range [40..1000] Hertz. Try 50 for servos.
+ * Programs a prescale like pca9685Retune, with the device locked.
+ * Returns 0 on success or -1 on error.
  */
-void pca9685PWMFreq(int fd, float freq)
+int pca9685DevRetune(struct pca9685Dev *dev, int prescale, int flags)
 {
-	// Cap at min and max
-	freq = (freq > 1000 ? 1000 : (freq < 40 ? 40 : freq));
+	unsigned long long start = pca9685Now();
 
-	// To set pwm frequency we have to set the prescale register. The formula is:
-	// prescale = round(osc_clock / (4096 * frequency))) - 1 where osc_clock = 25 MHz
-	// Further info here: http://www.nxp.com/documents/data_sheet/PCA9685.pdf Page 24
-	int prescale = (int)(25000000.0f / (4096 * freq) - 0.5f);
+	// Same prescale and running already, there's nothing to do
+	if (prescale == dev->prescale && !(dev->mode1 & 0x10) && !dev->settle)
+	{
+		dev->retune.skipped++;
+		pca9685DevTime(dev, PCA9685_OP_PWMFREQ, start);
+		return 0;
+	}
 
 	// Get settings and calc bytes for the different states.
-	int settings = wiringPiI2CReadReg8(fd, PCA9685_MODE1) & 0x7F;	// Set restart bit to 0
-	int sleep	= settings | 0x10;									// Set sleep bit to 1
-	int wake 	= settings & 0xEF;									// Set sleep bit to 0
-	int restart = wake | 0x80;										// Set restart bit to 1
+	int settings = dev->mode1 & 0x7F;				// Set restart bit to 0
+	unsigned char data[3] =
+	{
+		settings | 0x10,							// Set sleep bit to 1
+		prescale,
+		settings & 0xEF								// Set sleep bit to 0
+	};
+
+	// Go to sleep, set prescale and wake up again. PRESCALE can only be written during sleep.
+	struct pca9685Block blocks[3] =
+	{
+		{ PCA9685_MODE1,	1, data		},
+		{ PCA9685_PRESCALE, 1, data + 1 },
+		{ PCA9685_MODE1,	1, data + 2 }
+	};
+
+	if (pca9685DevWrite(dev, blocks, 3) < 0)
+	{
+		pca9685DevTime(dev, PCA9685_OP_PWMFREQ, start);
+		return -1;
+	}
+
+	// The oscillator needs 500 us to stabilize before PWM can be restarted
+	dev->retuneStart = start;
+	dev->settle = pca9685Now() + 500000;
+	dev->restart = flags & PCA9685_RETUNE_RESTART;
+
+	int ret = finishRetune(dev, !(flags & PCA9685_RETUNE_NOWAIT)) < 0 ? -1 : 0;
+
+	pca9685DevTime(dev, PCA9685_OP_PWMFREQ, start);
+	return ret;
+}
+
+/**
+ * Finishes a retune that was started with PCA9685_RETUNE_NOWAIT. If wait is set, it waits for
+ * the oscillator, otherwise it returns 1 if it isn't ready yet.
+ * Returns 0 when done (or if nothing was pending) or -1 on error.
+ */
+int pca9685RetuneFinish(int fd, int wait)
+{
+	struct pca9685Dev *dev = pca9685DevLock(fd);
+	if (!dev)
+		return -1;
+
+	int ret = finishRetune(dev, wait);
+
+	pca9685DevUnlock(dev);
+	return ret;
+}
+
+/**
+ * Copies the retune statistics of a device: how many retunes were done or skipped
+ * and how long they took from the call until the outputs ran again.
+ * If reset is set, the statistics start over. Returns 0 on success or -1 on error.
+ */
+int pca9685RetuneStats(int fd, struct pca9685RetuneStats *stats, int reset)
+{
+	struct pca9685Dev *dev = pca9685DevLock(fd);
+	if (!dev)
+		return -1;
+
+	if (stats)
+		*stats = dev->retune;
+
+	if (reset)
+	{
+		struct pca9685RetuneStats zero = { 0 };
+		dev->retune = zero;
+	}
+
+	pca9685DevUnlock(dev);
+	return 0;
+}
+
+/**
+ * Tells the library the frequency of the oscillator in Hertz, eg. a calibrated value of the
+ * internal 25 MHz oscillator. If external is set, the chip is switched to the clock on the
+ * EXTCLK pin. That only works while it sleeps and only a power cycle switches it back, so
+ * external = 0 fails once EXTCLK is on. Set the frequency again afterwards.
+ * hz may be 1 to 50 MHz. Returns 0 on success or -1 on error.
+ */
+int pca9685Oscillator(int fd, int hz, int external)
+{
+	if (hz < OSC_MIN || hz > OSC_MAX)
+		return -1;
+
+	struct pca9685Dev *dev = lockWrite(fd);
+	if (!dev)
+		return -1;
+
+	int settings = dev->mode1 & 0x7F;
 
-	// Go to sleep, set prescale and wake up again.
-	wiringPiI2CWriteReg8(fd, PCA9685_MODE1, sleep);
-	wiringPiI2CWriteReg8(fd, PCA9685_PRESCALE, prescale);
-	wiringPiI2CWriteReg8(fd, PCA9685_MODE1, wake);
+	if (!external && (settings & 0x40))
+	{
+		pca9685DevUnlock(dev);
+		return -1;
+	}
+
+	if (external && !(settings & 0x40))
+	{
+		// Datasheet sequence: sleep first, which stops the internal oscillator,
+		// then write sleep and EXTCLK together. Wake up like it was before.
+		int ret = writeReg8(dev, PCA9685_MODE1, settings | 0x10);
+		if (ret == 0)
+			ret = writeReg8(dev, PCA9685_MODE1, settings | 0x50);
+
+		if (ret == 0 && !(settings & 0x10))
+		{
+			ret = writeReg8(dev, PCA9685_MODE1, settings | 0x40);
+
+			unsigned long long awake = pca9685Now() + 1000000;
+			struct timespec ts = { awake / 1000000000ull, awake % 1000000000ull };
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0) == EINTR)
+				;
 
-	// Now wait a millisecond until oscillator finished stabilizing and restart PWM.
-	delay(1);
-	wiringPiI2CWriteReg8(fd, PCA9685_MODE1, restart);
+			if (ret == 0)
+				ret = writeReg8(dev, PCA9685_MODE1, settings | 0xC0);
+		}
+
+		if (ret < 0)
+		{
+			pca9685DevUnlock(dev);
+			return -1;
+		}
+	}
+
+	dev->osc = hz;
+	updatePeriod(dev);
+
+	pca9685DevUnlock(dev);
+	return 0;
 }
 
 /**
  * Set all leds back to default values (: fullOff = 1)
+ * Returns 0 on success or -1 on error.
  */
-void pca9685PWMReset(int fd)
+int pca9685PWMReset(int fd)
 {
-	wiringPiI2CWriteReg16(fd, LEDALL_ON_L	 , 0x0);
-	wiringPiI2CWriteReg16(fd, LEDALL_ON_L + 2, 0x1000);
+	struct pca9685Dev *dev = lockWrite(fd);
+	if (!dev)
+		return -1;
+
+	unsigned long long start = pca9685Now();
+	unsigned char data[4] = { 0x00, 0x00, 0x00, 0x10 };
+	int ret = writeBlock(dev, LEDALL_ON_L, data, 4);
+
+	pca9685AsyncDrop(dev, (1 << PIN_ALL) - 1);
+
+	pca9685DevTime(dev, PCA9685_OP_RESET, start);
+	pca9685DevUnlock(dev);
+	return ret;
 }
 
 /**
  * Write on and off ticks manually to a pin
  * (Deactivates any full-on and full-off)
+ * In async mode, the values are posted to the writer thread.
+ * Returns 0 on success or -1 on error.
+ */
+int pca9685PWMWrite(int fd, int pin, int on, int off)
+{
+	if (pin < 0 || pin > PIN_ALL)
+		return -1;
+
+	// In async mode, the writer thread sends it
+	if (pca9685AsyncWrite(fd, pin, on, off) == 0)
+		return 0;
+
+	struct pca9685Dev *dev = lockWrite(fd);
+	if (!dev)
+		return -1;
+
+	unsigned long long start = pca9685Now();
+
+	// Mask the 12 lowest bits of data to overwrite full-on and off
+	on  &= 0x0FFF;
+	off &= 0x0FFF;
+
+	// Write on and off registers at once
+	unsigned char data[4] = { on & 0xFF, on >> 8, off & 0xFF, off >> 8 };
+	int ret = writeBlock(dev, baseReg(pin), data, 4);
+
+	pca9685DevTime(dev, PCA9685_OP_PWMWRITE, start);
+	pca9685DevUnlock(dev);
+	return ret;
+}
+
+/**
+ * Write on and off values of several consecutive pins in a single transaction.
+ * Values are 16 bit of data, just like pca9685PWMRead returns them:
+ * Bits [0..11] are the PWM ticks, bit 12 enables full-on or full-off.
+ * The ALL_LED pin can only be written with count = 1.
+ * Returns 0 on success or -1 on error.
  */
-void pca9685PWMWrite(int fd, int pin, int on, int off)
+int pca9685PWMWriteRange(int fd, int pin, int count, const int *on, const int *off)
 {
-	int reg = baseReg(pin);
+	if (pin < 0 || count < 1 || (pin >= PIN_ALL ? count > 1 : pin + count > PIN_ALL))
+		return -1;
+
+	struct pca9685Dev *dev = lockWrite(fd);
+	if (!dev)
+		return -1;
+
+	unsigned char data[LED_REGS];
+	int i;
 
-	// Write to on and off registers and mask the 12 lowest bits of data to overwrite full-on and off
-	wiringPiI2CWriteReg16(fd, reg	 , on  & 0x0FFF);
-	wiringPiI2CWriteReg16(fd, reg + 2, off & 0x0FFF);
+	for (i = 0; i < count; i++)
+	{
+		data[4 * i]		= on[i] & 0xFF;
+		data[4 * i + 1] = (on[i] >> 8) & 0x1F;
+		data[4 * i + 2] = off[i] & 0xFF;
+		data[4 * i + 3] = (off[i] >> 8) & 0x1F;
+	}
+
+	int ret = writeBlock(dev, baseReg(pin), data, 4 * count);
+
+	pca9685AsyncDrop(dev, pin >= PIN_ALL ? (1 << PIN_ALL) - 1 : ((1 << count) - 1) << pin);
+
+	pca9685DevUnlock(dev);
+	return ret;
 }
 
 /**
@@ -146,51 +356,374 @@ void pca9685PWMWrite(int fd, int pin, int on, int off)
  * To get PWM: mask each value with 0xFFF
  * To get full-on or off bit: mask with 0x1000
  * Note: ALL_LED pin will always return 0
+ * Note: Values come from the register cache. Use pca9685Verify() to check the chip.
+ * Returns 0 on success or -1 on error.
  */
-void pca9685PWMRead(int fd, int pin, int *on, int *off)
+int pca9685PWMRead(int fd, int pin, int *on, int *off)
 {
-	int reg = baseReg(pin);
+	struct pca9685Dev *dev = pca9685DevLock(fd);
+	unsigned char *led = 0;
+
+	// The chip reads LEDALL registers as 0, so do we
+	if (dev && pin >= 0 && pin < PIN_ALL)
+		led = dev->led + 4 * pin;
 
 	if (on)
-		*on  = wiringPiI2CReadReg16(fd, reg);
+		*on  = led ? led[0] | (led[1] << 8) : 0;
 	if (off)
-		*off = wiringPiI2CReadReg16(fd, reg + 2);
+		*off = led ? led[2] | (led[3] << 8) : 0;
+
+	if (!dev)
+		return -1;
+
+	pca9685DevUnlock(dev);
+	return 0;
 }
 
 /**
  * Enables or deactivates full-on
  * tf = true: full-on
  * tf = false: according to PWM
+ * Returns 0 on success or -1 on error.
  */
-void pca9685FullOn(int fd, int pin, int tf)
+int pca9685FullOn(int fd, int pin, int tf)
 {
-	int reg = baseReg(pin) + 1;		// LEDX_ON_H
-	int state = wiringPiI2CReadReg8(fd, reg);
+	if (pin < 0 || pin > PIN_ALL)
+		return -1;
+
+	struct pca9685Dev *dev = lockWrite(fd);
+	if (!dev)
+		return -1;
+
+	unsigned long long start = pca9685Now();
+	int ret;
+
+	pca9685AsyncDrop(dev, pca9685PinMask(pin));
 
-	// Set bit 4 to 1 or 0 accordingly
+	if (fullWrite(dev, pin, 1, tf, &ret))
+	{
+		pca9685DevTime(dev, PCA9685_OP_FULLON, start);
+		pca9685DevUnlock(dev);
+		return ret;
+	}
+
+	int on, off;
+	pca9685PWMRead(fd, pin, &on, &off);
+
+	// Set bit 4 of LEDX_ON_H to 1 or 0 accordingly
+	int state = on >> 8;
 	state = tf ? (state | 0x10) : (state & 0xEF);
 
-	wiringPiI2CWriteReg8(fd, reg, state);
+	ret = writeReg8(dev, baseReg(pin) + 1, state);
 
-	// For simplicity, we set full-off to 0 because it has priority over full-on
-	if (tf)
-		pca9685FullOff(fd, pin, 0);
+	// For simplicity, we set full-off to 0 because it has priority over full-on.
+	// Thanks to the cache we can skip this if full-off isn't set anyway.
+	if (ret == 0 && tf && (pin >= PIN_ALL || off & 0x1000))
+		ret = pca9685FullOff(fd, pin, 0);
+
+	pca9685DevTime(dev, PCA9685_OP_FULLON, start);
+	pca9685DevUnlock(dev);
+	return ret;
 }
 
 /**
  * Enables or deactivates full-off
  * tf = true: full-off
  * tf = false: according to PWM or full-on
+ * Returns 0 on success or -1 on error.
  */
-void pca9685FullOff(int fd, int pin, int tf)
+int pca9685FullOff(int fd, int pin, int tf)
 {
-	int reg = baseReg(pin) + 3;		// LEDX_OFF_H
-	int state = wiringPiI2CReadReg8(fd, reg);
+	if (pin < 0 || pin > PIN_ALL)
+		return -1;
+
+	struct pca9685Dev *dev = lockWrite(fd);
+	if (!dev)
+		return -1;
+
+	unsigned long long start = pca9685Now();
+	int ret;
+
+	pca9685AsyncDrop(dev, pca9685PinMask(pin));
 
-	// Set bit 4 to 1 or 0 accordingly
+	if (fullWrite(dev, pin, 3, tf, &ret))
+	{
+		pca9685DevTime(dev, PCA9685_OP_FULLOFF, start);
+		pca9685DevUnlock(dev);
+		return ret;
+	}
+
+	int off;
+	pca9685PWMRead(fd, pin, 0, &off);
+
+	// Set bit 4 of LEDX_OFF_H to 1 or 0 accordingly
+	int state = off >> 8;
 	state = tf ? (state | 0x10) : (state & 0xEF);
 
-	wiringPiI2CWriteReg8(fd, reg, state);
+	ret = writeReg8(dev, baseReg(pin) + 3, state);
+
+	pca9685DevTime(dev, PCA9685_OP_FULLOFF, start);
+	pca9685DevUnlock(dev);
+	return ret;
+}
+
+/**
+ * In output change on ACK mode, a pin only changes once all four of its registers are written.
+ * Full-on and full-off then go through the frame path, which writes whole pins.
+ * Returns 1 if it took care of the write, ret gets its status then.
+ */
+static int fullWrite(struct pca9685Dev *dev, int pin, int index, int tf, int *ret)
+{
+	int mask = pca9685PinMask(pin);
+	int i;
+
+	if (!(dev->mode2 & MODE2_OCH) || !mask)
+		return 0;
+
+	for (i = 0; i < PIN_ALL; i++)
+		if (mask & (1 << i))
+			stageFull(dev, i, index, tf);
+
+	*ret = pca9685DevCommit(dev, mask) < 0 ? -1 : 0;
+	return 1;
+}
+
+/**
+ * Sets MODE2: output inversion, when outputs change, output driver and what the pins do
+ * while OE is high. Returns 0 on success or -1 on error.
+ */
+int pca9685Mode2Set(int fd, const struct pca9685Mode2 *mode)
+{
+	if (!mode || mode->disabled < PCA9685_OE_LOW || mode->disabled > PCA9685_OE_HIGHZ)
+		return -1;
+
+	struct pca9685Dev *dev = lockWrite(fd);
+	if (!dev)
+		return -1;
+
+	unsigned char mode2 = (mode->invert ? 0x10 : 0) | (mode->onAck ? MODE2_OCH : 0) |
+						  (mode->totemPole ? 0x04 : 0) | mode->disabled;
+
+	dev->latch = -1;
+
+	int ret = mode2 == dev->mode2 ? 0 : writeBlock(dev, PCA9685_MODE2, &mode2, 1);
+
+	pca9685DevUnlock(dev);
+	return ret;
+}
+
+/**
+ * Gets MODE2 from the register cache. Returns 0 on success or -1 on error.
+ */
+int pca9685Mode2Get(int fd, struct pca9685Mode2 *mode)
+{
+	struct pca9685Dev *dev = pca9685DevLock(fd);
+	if (!dev || !mode)
+	{
+		if (dev)
+			pca9685DevUnlock(dev);
+		return -1;
+	}
+
+	mode->invert	= (dev->mode2 & 0x10) != 0;
+	mode->onAck		= (dev->mode2 & MODE2_OCH) != 0;
+	mode->totemPole	= (dev->mode2 & 0x04) != 0;
+	mode->disabled	= dev->mode2 & 0x03;
+
+	pca9685DevUnlock(dev);
+	return 0;
+}
+
+/**
+ * Returns the true PWM period in nanoseconds, from the programmed prescale and the oscillator,
+ * or -1 on error
+ */
+int pca9685Period(int fd)
+{
+	struct pca9685Dev *dev = pca9685DevLock(fd);
+	if (!dev)
+		return -1;
+
+	int period = dev->period;
+
+	pca9685DevUnlock(dev);
+	return period;
+}
+
+/**
+ * Sets a pin high for us microseconds per period, like pwmWrite with the ticks that come closest.
+ * 0 enables full-off, a whole period (or more) full-on. No floating point involved.
+ * Returns 0 on success or -1 on error.
+ */
+int pca9685WriteMicros(int fd, int pin, int us)
+{
+	if (!pca9685PinMask(pin))
+		return -1;
+
+	struct pca9685Dev *dev = pca9685DevLock(fd);
+	if (!dev)
+		return -1;
+
+	int value = pca9685DevTicks(dev, us);
+	int ret = 0;
+
+	// In async mode, the writer thread sends it
+	if (pca9685AsyncPWM(fd, pin, value) < 0)
+		ret = pca9685DevPWM(dev, pin, value);
+
+	pca9685DevUnlock(dev);
+	return ret;
+}
+
+/**
+ * Compares the register cache with the chip.
+ * Returns the number of registers that differ or -1 if the chip couldn't be read.
+ * The cache is left untouched, call pca9685Resync() to adopt the chip's state.
+ */
+int pca9685Verify(int fd)
+{
+	struct pca9685Dev *dev = pca9685DevLock(fd);
+	if (!dev)
+		return -1;
+
+	unsigned char mode[MODE_REGS], led[LED_REGS];
+	if (loadRegisters(dev, mode, led) < 0)
+	{
+		pca9685DevUnlock(dev);
+		return -1;
+	}
+
+	int i, diff = 0;
+	diff += (mode[0] != dev->mode1);
+	diff += (mode[1] != dev->mode2);
+	diff += (mode[2] != dev->prescale);
+
+	for (i = 0; i < 4; i++)
+		diff += (mode[3 + i] != dev->subadr[i]);
+
+	for (i = 0; i < LED_REGS; i++)
+		diff += (led[i] != dev->led[i]);
+
+	pca9685DevUnlock(dev);
+	return diff;
+}
+
+/**
+ * Reloads the register cache from the chip.
+ * Returns 0 on success or -1 if the chip couldn't be read.
+ */
+int pca9685Resync(int fd)
+{
+	struct pca9685Dev *dev = pca9685DevLock(fd);
+	if (!dev)
+		return -1;
+
+	int ret = resync(dev);
+
+	pca9685DevUnlock(dev);
+	return ret;
+}
+
+/**
+ * Returns 1 if a transaction of the device failed for good and it wasn't resynced since,
+ * 0 if it's fine or -1 on error. The next write (or pca9685Resync) resyncs it.
+ */
+int pca9685Degraded(int fd)
+{
+	struct pca9685Dev *dev = pca9685DevLock(fd);
+	if (!dev)
+		return -1;
+
+	int degraded = dev->degraded;
+
+	pca9685DevUnlock(dev);
+	return degraded;
+}
+
+/**
+ * Reads all pins from the chip at once, bypassing the register cache.
+ * pins must hold 16 entries. mode1, mode2 and prescale are optional.
+ * Returns 0 on success or -1 on error.
+ */
+int pca9685ReadAll(int fd, struct pca9685Pin *pins, int *mode1, int *mode2, int *prescale)
+{
+	struct pca9685Dev *dev = pca9685DevLock(fd);
+	if (!dev)
+		return -1;
+
+	unsigned char regs[FRONT_REGS];
+	int ret = readRegisters(dev, regs, prescale);
+
+	pca9685DevUnlock(dev);
+
+	if (ret < 0)
+		return -1;
+
+	if (mode1)
+		*mode1 = regs[PCA9685_MODE1];
+	if (mode2)
+		*mode2 = regs[PCA9685_MODE2];
+
+	int i;
+	for (i = 0; pins && i < PIN_ALL; i++)
+	{
+		unsigned char *led = regs + LED0_ON_L + 4 * i;
+
+		pins[i].on		= led[0] | ((led[1] & 0x0F) << 8);
+		pins[i].off		= led[2] | ((led[3] & 0x0F) << 8);
+		pins[i].fullOn	= (led[1] & 0x10) != 0;
+		pins[i].fullOff	= (led[3] & 0x10) != 0;
+	}
+
+	return 0;
+}
+
+/**
+ * Lets the device listen to a group address.
+ * group = 1..3: SUBADR1..3, group = 0: ALLCALLADR
+ * All chips listen to ALLCALL at 0x70 after power-on.
+ * Returns 0 on success or -1 on error.
+ */
+int pca9685GroupJoin(int fd, int group, int i2cAddress)
+{
+	if (group < 0 || group > 3 || i2cAddress < 0 || i2cAddress > 0x7F)
+		return -1;
+
+	struct pca9685Dev *dev = lockWrite(fd);
+	if (!dev)
+		return -1;
+
+	// The address register holds the address in bits [1..7]
+	int reg = group ? PCA9685_SUBADR1 + group - 1 : PCA9685_ALLCALLADR;
+	int ret = 0;
+	if (dev->subadr[reg - PCA9685_SUBADR1] != i2cAddress << 1)
+		ret = writeReg8(dev, reg, i2cAddress << 1);
+
+	int mode1 = dev->mode1 | GROUP_BIT(group);
+	if (ret == 0 && mode1 != dev->mode1)
+		ret = writeReg8(dev, PCA9685_MODE1, mode1);
+
+	pca9685DevUnlock(dev);
+	return ret;
+}
+
+/**
+ * Stops the device from listening to a group address (see pca9685GroupJoin)
+ */
+int pca9685GroupLeave(int fd, int group)
+{
+	if (group < 0 || group > 3)
+		return -1;
+
+	struct pca9685Dev *dev = lockWrite(fd);
+	if (!dev)
+		return -1;
+
+	int mode1 = dev->mode1 & ~GROUP_BIT(group);
+	int ret = mode1 == dev->mode1 ? 0 : writeReg8(dev, PCA9685_MODE1, mode1);
+
+	pca9685DevUnlock(dev);
+	return ret;
 }
 
 /**
@@ -206,7 +739,7 @@ int baseReg(int pin)
 
 //------------------------------------------------------------------------------------------------------------------
 //
-//	WiringPi functions
+//	Register cache
 //
 //------------------------------------------------------------------------------------------------------------------
 
@@ -214,76 +747,1052 @@ int baseReg(int pin)
 
 
 /**
- * Simple PWM control which sets on-tick to 0 and off-tick to value.
- * If value is <= 0, full-off will be enabled
- * If value is >= 4096, full-on will be enabled
- * Every value in between enables PWM output
+ * Returns the bus of a file descriptor (or fake bus handle), creating it if necessary.
+ * File descriptors get reused after close, so we always ask the adapter again.
  */
-static void myPwmWrite(struct wiringPiNodeStruct *node, int pin, int value)
+struct pca9685Bus *pca9685BusAttach(int fd, const struct pca9685Ops *ops)
 {
-	int fd   = node->fd;
-	int ipin = pin - node->pinBase;
+	struct pca9685Bus *bus;
 
-	if (value >= 4096)
-		pca9685FullOn(fd, ipin, 1);
-	else if (value > 0)
-		pca9685PWMWrite(fd, ipin, 0, value);	// (Deactivates full-on and off by itself)
-	else
-		pca9685FullOff(fd, ipin, 1);
+	pthread_mutex_lock(&registry);
+
+	for (bus = atomic_load_explicit(&buses, memory_order_relaxed); bus; bus = bus->next)
+		if (bus->fd == fd)
+			break;
+
+	if (bus)
+	{
+		// Find out which kind of block transfers the adapter supports
+		bus->ops = ops;
+		bus->funcs = ops->funcs(bus);
+		bus->slave = -1;
+
+		pthread_mutex_unlock(&registry);
+		return bus;
+	}
+
+	bus = calloc(1, sizeof(struct pca9685Bus));
+	if (!bus)
+	{
+		pthread_mutex_unlock(&registry);
+		return 0;
+	}
+
+	// Operations call each other, so the lock must be recursive
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&bus->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	bus->fd = fd;
+	bus->ops = ops;
+	bus->funcs = ops->funcs(bus);
+	bus->slave = -1;
+	bus->next = atomic_load_explicit(&buses, memory_order_relaxed);
+	atomic_store_explicit(&buses, bus, memory_order_release);
+
+	pthread_mutex_unlock(&registry);
+
+	return bus;
 }
 
 /**
- * Simple full-on and full-off control
- * If value is 0, full-off will be enabled
- * If value is not 0, full-on will be enabled
+ * Returns the bus of a file descriptor if it has one
  */
-static void myOnOffWrite(struct wiringPiNodeStruct *node, int pin, int value)
+struct pca9685Bus *pca9685BusGet(int fd)
 {
-	int fd   = node->fd;
-	int ipin = pin - node->pinBase;
+	struct pca9685Bus *bus;
 
-	if (value)
-		pca9685FullOn(fd, ipin, 1);
-	else
-		pca9685FullOff(fd, ipin, 1);
+	for (bus = atomic_load_explicit(&buses, memory_order_acquire); bus; bus = bus->next)
+		if (bus->fd == fd)
+			return bus;
+
+	return 0;
 }
 
 /**
- * Reads off registers as 16 bit of data
- * To get PWM: mask with 0xFFF
- * To get full-off bit: mask with 0x1000
- * Note: ALL_LED pin will always return 0
+ * Creates an empty register cache for a device or returns the existing one
+ * (file descriptors get reused after close).
  */
-static int myOffRead(struct wiringPiNodeStruct *node, int pin)
+struct pca9685Dev *pca9685DevAdd(int id, struct pca9685Bus *bus, int address)
 {
-	int fd   = node->fd;
-	int ipin = pin - node->pinBase;
+	struct pca9685Dev *dev;
 
-	int off;
-	pca9685PWMRead(fd, ipin, 0, &off);
+	pthread_mutex_lock(&registry);
+
+	for (dev = atomic_load_explicit(&pca9685Devices, memory_order_relaxed); dev; dev = dev->next)
+		if (dev->id == id)
+			break;
+
+	if (dev)
+	{
+		dev->bus = bus;
+		dev->address = address;
+		dev->staged = 0;
+
+		pthread_mutex_unlock(&registry);
+		return dev;
+	}
+
+	dev = calloc(1, sizeof(struct pca9685Dev));
+	if (!dev)
+	{
+		pthread_mutex_unlock(&registry);
+		return 0;
+	}
+
+	dev->id = id;
+	dev->bus = bus;
+	dev->address = address;
+	dev->osc = 25000000;
+	dev->latch = -1;
+	updatePeriod(dev);
+	dev->next = atomic_load_explicit(&pca9685Devices, memory_order_relaxed);
+	atomic_store_explicit(&pca9685Devices, dev, memory_order_release);
 
-	return off;
+	pthread_mutex_unlock(&registry);
+
+	return dev;
 }
 
 /**
- * Reads on registers as 16 bit of data
- * To get PWM: mask with 0xFFF
- * To get full-on bit: mask with 0x1000
- * Note: ALL_LED pin will always return 0
+ * Finds the register cache of a device.
+ * File descriptors that weren't created by a setup function are added and read from the chip once.
+ */
+struct pca9685Dev *pca9685DevGet(int id)
+{
+	struct pca9685Dev *dev;
+
+	for (dev = atomic_load_explicit(&pca9685Devices, memory_order_acquire); dev; dev = dev->next)
+		if (dev->id == id)
+			return dev;
+
+	if (id < 0 || id >= PCA9685_FAKE_BASE)
+		return 0;
+
+	// Keep the transport of buses we know already
+	struct pca9685Bus *bus = pca9685BusGet(id);
+	if (!bus && !(bus = pca9685BusAttach(id, &pca9685I2cOps)))
+		return 0;
+
+	dev = pca9685DevAdd(id, bus, -1);
+	if (dev)
+		pca9685Resync(id);
+
+	return dev;
+}
+
+/**
+ * Enables auto-increment, fills the register cache and sets the frequency (if freq > 0)
  */
-static int myOnRead(struct wiringPiNodeStruct *node, int pin)
+int pca9685DevInit(struct pca9685Dev *dev, float freq)
 {
-	int fd   = node->fd;
-	int ipin = pin - node->pinBase;
+	if (pca9685DevAdopt(dev) < 0)
+		return -1;
 
-	int on;
-	pca9685PWMRead(fd, ipin, &on, 0);
+	// Set frequency of PWM signals. Also ends sleep mode and starts PWM output.
+	if (freq > 0)
+		return pca9685PWMFreq(dev->id, freq);
 
-	return on;
+	return 0;
 }
 
+/**
+ * Takes over a chip as it is: fills the register cache and leaves the outputs alone.
+ * Auto-increment is enabled if it's off, that doesn't affect PWM.
+ */
+int pca9685DevAdopt(struct pca9685Dev *dev)
+{
+	int settings = readReg8(dev, PCA9685_MODE1);
+	if (settings < 0)
+		return -1;
 
+	if (!(settings & 0x20) && writeReg8(dev, PCA9685_MODE1, (settings & 0x7F) | 0x20) < 0)
+		return -1;
 
+	// Fill the register cache. From now on we don't need to read from the chip anymore.
+	return pca9685Resync(dev->id);
+}
 
+/**
+ * Reads a single register
+ */
+static int readReg8(struct pca9685Dev *dev, int reg)
+{
+	struct pca9685Bus *bus = dev->bus;
+	unsigned char out = reg, in;
 
+	if ((bus->funcs & I2C_FUNC_I2C) && dev->address >= 0)
+	{
+		struct i2c_msg msgs[2] =
+		{
+			{ dev->address, 0,		  1, &out },
+			{ dev->address, I2C_M_RD, 1, &in  }
+		};
 
+		return pca9685Transfer(bus, msgs, 2) < 0 ? -1 : in;
+	}
+
+	return pca9685Read(bus, dev->address, reg, &in, 1) < 0 ? -1 : in;
+}
+
+/**
+ * Reads all registers from MODE1 up to the last LED and optionally PRESCALE.
+ * If possible, this is a single combined transfer with repeated starts.
+ * Otherwise the transport reads blocks with auto-increment or single registers without it.
+ */
+static int readRegisters(struct pca9685Dev *dev, unsigned char *regs, int *prescale)
+{
+	struct pca9685Bus *bus = dev->bus;
+	int i;
+
+	if ((bus->funcs & I2C_FUNC_I2C) && dev->address >= 0)
+	{
+		unsigned char front = PCA9685_MODE1, pre = PCA9685_PRESCALE, value;
+		struct i2c_msg msgs[4] =
+		{
+			{ dev->address, 0,		  1,		  &front },
+			{ dev->address, I2C_M_RD, FRONT_REGS, regs	 },
+			{ dev->address, 0,		  1,		  &pre	 },
+			{ dev->address, I2C_M_RD, 1,		  &value }
+		};
+
+		if (pca9685Transfer(bus, msgs, prescale ? 4 : 2) < 0)
+			return -1;
+
+		if (prescale)
+			*prescale = value;
+
+		// Without auto-increment we got MODE1 over and over again
+		if (regs[0] & 0x20)
+			return 0;
+	}
+
+	int mode1 = readReg8(dev, PCA9685_MODE1);
+	if (mode1 < 0)
+		return -1;
+
+	if (mode1 & 0x20)
+	{
+		if (pca9685Read(bus, dev->address, PCA9685_MODE1, regs, FRONT_REGS) < 0)
+			return -1;
+	}
+	else
+	{
+		for (i = 0; i < FRONT_REGS; i++)
+			if (pca9685Read(bus, dev->address, i, regs + i, 1) < 0)
+				return -1;
+	}
+
+	if (prescale && (*prescale = readReg8(dev, PCA9685_PRESCALE)) < 0)
+		return -1;
+
+	return 0;
+}
+
+/**
+ * Reads MODE1, MODE2, PRESCALE, SUBADR1..3, ALLCALLADR and all LED registers from the chip.
+ */
+static int loadRegisters(struct pca9685Dev *dev, unsigned char *mode, unsigned char *led)
+{
+	unsigned char regs[FRONT_REGS];
+	int i, prescale;
+
+	if (readRegisters(dev, regs, &prescale) < 0)
+		return -1;
+
+	// Restart bit clears itself, don't compare it
+	mode[0] = regs[PCA9685_MODE1] & 0x7F;
+	mode[1] = regs[PCA9685_MODE2];
+	mode[2] = prescale;
+
+	for (i = 0; i < 4; i++)
+		mode[3 + i] = regs[PCA9685_SUBADR1 + i];
+
+	for (i = 0; i < LED_REGS; i++)
+		led[i] = regs[LED0_ON_L + i];
+
+	return 0;
+}
+
+/**
+ * Reloads the register cache of a device from the chip, which ends degraded mode.
+ * Returns 0 on success or -1 if the chip couldn't be read.
+ */
+static int resync(struct pca9685Dev *dev)
+{
+	unsigned char mode[MODE_REGS], led[LED_REGS];
+	if (loadRegisters(dev, mode, led) < 0)
+		return -1;
+
+	dev->mode1 = mode[0];
+	dev->mode2 = mode[1];
+	dev->prescale = mode[2];
+	updatePeriod(dev);
+
+	int i;
+	for (i = 0; i < 4; i++)
+		dev->subadr[i] = mode[3 + i];
+
+	for (i = 0; i < LED_REGS; i++)
+		dev->led[i] = led[i];
+
+	dev->degraded = 0;
+	return 0;
+}
+
+/**
+ * After a transaction failed for good, the cache holds values the chip may never have got.
+ * Resyncs a degraded device so the next write is planned against what the chip really has.
+ * Returns 0 if the device is fine (again) or -1 if it still doesn't answer.
+ */
+int pca9685DevRecover(struct pca9685Dev *dev)
+{
+	return dev->degraded ? resync(dev) : 0;
+}
+
+/**
+ * Finds a device and takes the lock of its bus for an operation which writes to the chip.
+ * A degraded device is recovered first. Returns 0 (without locking) if there is no such
+ * device or it still doesn't answer.
+ */
+static struct pca9685Dev *lockWrite(int fd)
+{
+	struct pca9685Dev *dev = pca9685DevLock(fd);
+
+	if (dev && pca9685DevRecover(dev) < 0)
+	{
+		pca9685DevUnlock(dev);
+		return 0;
+	}
+
+	return dev;
+}
+
+/**
+ * Stores a register value in the cache.
+ * Writes to LEDALL are stored in every LED.
+ */
+static void cacheReg(struct pca9685Dev *dev, int reg, int value)
+{
+	int i;
+
+	if (reg == PCA9685_MODE1)
+		dev->mode1 = value & 0x7F;
+	else if (reg == PCA9685_MODE2)
+		dev->mode2 = value & 0xFF;
+	else if (reg == PCA9685_PRESCALE)
+	{
+		dev->prescale = value & 0xFF;
+		updatePeriod(dev);
+	}
+	else if (reg >= PCA9685_SUBADR1 && reg <= PCA9685_ALLCALLADR)
+		dev->subadr[reg - PCA9685_SUBADR1] = value & 0xFF;
+	else if (reg >= LEDALL_ON_L && reg < LEDALL_ON_L + 4)
+		for (i = reg - LEDALL_ON_L; i < LED_REGS; i += 4)
+			dev->led[i] = value & 0xFF;
+	else if (reg >= LED0_ON_L && reg < LED0_ON_L + LED_REGS)
+		dev->led[reg - LED0_ON_L] = value & 0xFF;
+}
+
+/**
+ * Returns the time of the monotonic clock in nanoseconds
+ */
+unsigned long long pca9685Now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * Returns the prescale (3..255) which comes closest to freq with the oscillator of a device
+ */
+int pca9685DevPrescale(struct pca9685Dev *dev, float freq)
+{
+	// Each tick lasts prescale + 1 oscillator cycles, a period has 4096 ticks:
+	// freq = osc_clock / (4096 * (prescale + 1))
+	// Further info here: http://www.nxp.com/documents/data_sheet/PCA9685.pdf Page 25
+	// The exact prescale is somewhere between two integers, take the one that comes closer in frequency.
+	double cycles = dev->osc / (4096.0 * freq);
+	int prescale = (int)cycles - 1;
+
+	if (fabs(dev->osc / (4096.0 * (prescale + 2)) - freq) < fabs(dev->osc / (4096.0 * (prescale + 1)) - freq))
+		prescale++;
+
+	return prescale > 255 ? 255 : (prescale < 3 ? 3 : prescale);
+}
+
+/**
+ * Restarts PWM after a retune once the oscillator is stable, if that was requested.
+ * Returns 1 if we shouldn't wait and it isn't stable yet, 0 when done or -1 on error.
+ */
+static int finishRetune(struct pca9685Dev *dev, int wait)
+{
+	if (!dev->settle)
+		return 0;
+
+	if (dev->restart)
+	{
+		if (pca9685Now() < dev->settle)
+		{
+			if (!wait)
+				return 1;
+
+			struct timespec ts = { dev->settle / 1000000000ull, dev->settle % 1000000000ull };
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0) == EINTR)
+				;
+		}
+
+		if (writeReg8(dev, PCA9685_MODE1, dev->mode1 | 0x80) < 0)
+			return -1;
+	}
+
+	unsigned long long took = pca9685Now() - dev->retuneStart;
+
+	dev->settle = 0;
+	dev->retune.retunes++;
+	dev->retune.lastNs = took;
+	dev->retune.totalNs += took;
+	dev->retune.maxNs = took > dev->retune.maxNs ? took : dev->retune.maxNs;
+
+	return 0;
+}
+
+/**
+ * Recalculates the timing of a device after its prescale or oscillator changed.
+ * Each tick lasts prescale + 1 oscillator cycles, a period has 4096 ticks.
+ */
+static void updatePeriod(struct pca9685Dev *dev)
+{
+	unsigned long long cycles = dev->prescale + 1;
+
+	dev->period = cycles * 4096 * 1000000000ull / dev->osc;
+	dev->usTicks = ((unsigned long long)dev->osc << 32) / (cycles * 1000000);
+}
+
+/**
+ * Converts a pulse width in microseconds to the closest number of ticks (0..4096)
+ * with the 32.32 fixed point factor of the device
+ */
+int pca9685DevTicks(struct pca9685Dev *dev, int us)
+{
+	if (us <= 0)
+		return 0;
+
+	if (us >= dev->period / 1000)
+		return 4096;
+
+	return (us * dev->usTicks + 0x80000000ull) >> 32;
+}
+
+/**
+ * Writes 8 bit to the chip and the cache. Returns 0 on success or -1 on error.
+ */
+static int writeReg8(struct pca9685Dev *dev, int reg, int value)
+{
+	unsigned char data = value;
+
+	return writeBlock(dev, reg, &data, 1);
+}
+
+/**
+ * Writes consecutive registers of the chip at address in a single I2C message, using auto-increment.
+ * An address of -1 uses the one the bus is set to.
+ * Transports without combined transfers split the data as they need.
+ */
+int pca9685BusWrite(struct pca9685Bus *bus, int address, int reg, const unsigned char *data, int len)
+{
+	int i;
+
+	if (len < 1 || len > LED_REGS)
+		return -1;
+
+	if (!(bus->funcs & I2C_FUNC_I2C) || address < 0)
+		return pca9685Write(bus, address, reg, data, len);
+
+	unsigned char buf[1 + LED_REGS];
+
+	buf[0] = reg;
+	for (i = 0; i < len; i++)
+		buf[i + 1] = data[i];
+
+	struct i2c_msg msg = { address, 0, len + 1, buf };
+
+	return pca9685Transfer(bus, &msg, 1);
+}
+
+/**
+ * Writes consecutive registers of a device in a single I2C message.
+ * Without auto-increment, we fall back to single writes.
+ */
+static int i2cWriteBlock(struct pca9685Dev *dev, int reg, const unsigned char *data, int len)
+{
+	int i;
+
+	if (len > 1 && !(dev->mode1 & 0x20))
+	{
+		for (i = 0; i < len; i++)
+			if (pca9685BusWrite(dev->bus, dev->address, reg + i, data + i, 1) < 0)
+				return -1;
+		return 0;
+	}
+
+	return pca9685BusWrite(dev->bus, dev->address, reg, data, len);
+}
+
+/**
+ * Writes several blocks of registers.
+ * If possible, every block becomes one message of a single combined transfer,
+ * so the chip sees only one STOP condition at the end.
+ */
+static int i2cWriteBlocks(struct pca9685Dev *dev, const struct pca9685Block *blocks, int count)
+{
+	int i, j;
+
+	if (count == 1 || !(dev->mode1 & 0x20) || !(dev->bus->funcs & I2C_FUNC_I2C) || dev->address < 0 || count > I2C_RDWR_IOCTL_MAX_MSGS)
+	{
+		for (i = 0; i < count; i++)
+			if (i2cWriteBlock(dev, blocks[i].reg, blocks[i].data, blocks[i].len) < 0)
+				return -1;
+		return 0;
+	}
+
+	// Each message needs the register byte in front of its data
+	unsigned char buf[I2C_RDWR_IOCTL_MAX_MSGS + LED_REGS];
+	struct i2c_msg msgs[I2C_RDWR_IOCTL_MAX_MSGS];
+	unsigned char *p = buf;
+
+	for (i = 0; i < count; i++)
+	{
+		if (p + 1 + blocks[i].len > buf + sizeof(buf))
+			return -1;
+
+		msgs[i].addr  = dev->address;
+		msgs[i].flags = 0;
+		msgs[i].len   = blocks[i].len + 1;
+		msgs[i].buf   = p;
+
+		*p++ = blocks[i].reg;
+		for (j = 0; j < blocks[i].len; j++)
+			*p++ = blocks[i].data[j];
+	}
+
+	return pca9685Transfer(dev->bus, msgs, count);
+}
+
+/**
+ * Writes consecutive registers to the chip in one transaction and to the cache
+ */
+static int writeBlock(struct pca9685Dev *dev, int reg, const unsigned char *data, int len)
+{
+	struct pca9685Block block = { reg, len, data };
+
+	return pca9685DevWrite(dev, &block, 1);
+}
+
+/**
+ * Writes several blocks of registers to the chip in one transaction and, if it got through, to the cache
+ */
+int pca9685DevWrite(struct pca9685Dev *dev, const struct pca9685Block *blocks, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		if (blocks[i].len < 1 || blocks[i].len > LED_REGS)
+			return -1;
+
+	int ret = i2cWriteBlocks(dev, blocks, count);
+
+	if (ret == 0)
+		pca9685DevCache(dev, blocks, count);
+
+	return ret;
+}
+
+/**
+ * Stores blocks of registers in the cache and tells the recorder which pins they touched
+ */
+void pca9685DevCache(struct pca9685Dev *dev, const struct pca9685Block *blocks, int count)
+{
+	int i, j, mask = 0;
+
+	for (i = 0; i < count; i++)
+		for (j = 0; j < blocks[i].len; j++)
+			cacheReg(dev, blocks[i].reg + j, blocks[i].data[j]);
+
+	if (!atomic_load_explicit(&pca9685Recording, memory_order_relaxed))
+		return;
+
+	for (i = 0; i < count; i++)
+	{
+		int reg = blocks[i].reg, end = reg + blocks[i].len;
+
+		if (end > LED0_ON_L && reg < LED0_ON_L + LED_REGS)
+			for (j = reg > LED0_ON_L ? reg : LED0_ON_L; j < end && j < LED0_ON_L + LED_REGS; j++)
+				mask |= 1 << ((j - LED0_ON_L) / 4);
+
+		if (end > LEDALL_ON_L && reg < LEDALL_ON_L + 4)
+			mask = (1 << PIN_ALL) - 1;
+	}
+
+	if (mask)
+		pca9685RecordCapture(dev, mask);
+}
+
+
+
+
+//------------------------------------------------------------------------------------------------------------------
+//
+//	Frames
+//
+//------------------------------------------------------------------------------------------------------------------
+
+
+
+
+/**
+ * Returns the back buffer registers of a pin.
+ * A pin which hasn't been staged yet starts with the values from the cache.
+ */
+static unsigned char *stagePin(struct pca9685Dev *dev, int pin)
+{
+	unsigned char *led = dev->frame + 4 * pin;
+
+	if (!(dev->staged & (1 << pin)))
+	{
+		int i;
+		for (i = 0; i < 4; i++)
+			led[i] = dev->led[4 * pin + i];
+
+		dev->staged |= 1 << pin;
+	}
+
+	return led;
+}
+
+/**
+ * Stages on and off values of a pin.
+ * Values are 16 bit of data, bit 12 is full-on or full-off.
+ */
+static void stageOnOff(struct pca9685Dev *dev, int pin, int on, int off)
+{
+	unsigned char *led = stagePin(dev, pin);
+
+	led[0] = on & 0xFF;
+	led[1] = (on >> 8) & 0x1F;
+	led[2] = off & 0xFF;
+	led[3] = (off >> 8) & 0x1F;
+}
+
+/**
+ * Stages the full-on (index 1) or full-off (index 3) bit of a pin.
+ * Setting full-on clears full-off because full-off has priority.
+ */
+static void stageFull(struct pca9685Dev *dev, int pin, int index, int tf)
+{
+	unsigned char *led = stagePin(dev, pin);
+
+	led[index] = tf ? (led[index] | 0x10) : (led[index] & 0xEF);
+
+	if (tf && index == 1)
+		led[3] &= 0xEF;
+}
+
+/**
+ * Stages a value with the same meaning as pwmWrite.
+ * In stagger mode, the pin goes high at its phase and the off-tick wraps around the period.
+ */
+void pca9685DevStage(struct pca9685Dev *dev, int pin, int value)
+{
+	int on = dev->stagger ? dev->phase[pin] : 0;
+
+	if (value >= 4096)
+		stageFull(dev, pin, 1, 1);
+	else if (value > 0)
+		stageOnOff(dev, pin, on, (on + value) & 0x0FFF);
+	else
+		stageFull(dev, pin, 3, 1);
+}
+
+/**
+ * Returns the mask of the pins a pin number refers to
+ */
+int pca9685PinMask(int pin)
+{
+	if (pin < 0 || pin > PIN_ALL)
+		return 0;
+
+	return pin == PIN_ALL ? (1 << PIN_ALL) - 1 : 1 << pin;
+}
+
+/**
+ * Plans writing all staged pins of the mask which differ from the cache.
+ * The outgoing values end up in target (LED_REGS bytes) and the blocks point into it.
+ * Pins outside the mask keep what they have staged in the back buffer.
+ * Changed registers are merged into as few messages as possible. If all pins end up
+ * with equal values, we write LEDALL instead. Nothing is unstaged, the caller does that
+ * with pca9685DevSent once the blocks got through (or clears staged if there are none).
+ * If outputs change on ACK, whole pins are written since a pin only changes after all four
+ * of its registers. A pending latch mode goes first, in the same transaction.
+ * Returns the number of blocks, pins receives the number of changed pins.
+ */
+int pca9685DevPlan(struct pca9685Dev *dev, int mask, unsigned char *target, struct pca9685Block *blocks, int *pins)
+{
+	int i, n = 0, cost = 0;
+	int colMin = 4, colMax = -1;
+	int onAck = dev->latch >= 0 ? dev->latch : (dev->mode2 & MODE2_OCH) != 0;
+
+	mask &= dev->staged;
+
+	for (i = 0; i < LED_REGS; i++)
+		target[i] = (mask & (1 << (i / 4))) ? dev->frame[i] : dev->led[i];
+
+	*pins = 0;
+
+	for (i = 0; i < LED_REGS; i++)
+	{
+		if (target[i] == dev->led[i])
+			continue;
+
+		struct pca9685Block *last = n ? &blocks[n - 1] : 0;
+		int end = last ? last->reg - LED0_ON_L + last->len : 0;
+		int first = onAck ? i & ~3 : i;
+
+		// On ACK, take the whole pin and go on after it
+		if (onAck)
+			i |= 3;
+
+		if (last && first - end <= MERGE_GAP)
+			last->len = i - (last->reg - LED0_ON_L) + 1;
+		else
+		{
+			blocks[n].reg  = LED0_ON_L + first;
+			blocks[n].len  = i - first + 1;
+			blocks[n].data = target + first;
+			n++;
+		}
+
+		colMin = (first % 4 < colMin) ? first % 4 : colMin;
+		colMax = (i % 4 > colMax) ? i % 4 : colMax;
+	}
+
+	if (!n)
+		return 0;
+
+	for (i = 0; i < PIN_ALL; i++)
+	{
+		int r = 4 * i;
+		*pins += (target[r] != dev->led[r] || target[r + 1] != dev->led[r + 1] ||
+				  target[r + 2] != dev->led[r + 2] || target[r + 3] != dev->led[r + 3]);
+	}
+
+	for (i = 0; i < n; i++)
+		cost += blocks[i].len + MERGE_GAP;
+
+	// Check if a single LEDALL message would do, which needs equal columns on all pins
+	int equal = (colMax - colMin + 1 + MERGE_GAP < cost);
+
+	for (i = 4; equal && i < LED_REGS; i++)
+		if (i % 4 >= colMin && i % 4 <= colMax && target[i] != target[i % 4])
+			equal = 0;
+
+	if (equal)
+	{
+		blocks[0].reg  = LEDALL_ON_L + colMin;
+		blocks[0].len  = colMax - colMin + 1;
+		blocks[0].data = target + colMin;
+		n = 1;
+	}
+
+	// Switch the latch mode right before the pins
+	if (dev->latch >= 0 && onAck != ((dev->mode2 & MODE2_OCH) != 0))
+	{
+		for (i = n; i > 0; i--)
+			blocks[i] = blocks[i - 1];
+
+		dev->mode2Frame = onAck ? dev->mode2 | MODE2_OCH : dev->mode2 & ~MODE2_OCH;
+
+		blocks[0].reg  = PCA9685_MODE2;
+		blocks[0].len  = 1;
+		blocks[0].data = &dev->mode2Frame;
+		n++;
+	}
+
+	return n;
+}
+
+/**
+ * Unstages the pins of a mask after the blocks planned for them were sent, and
+ * drops the latch mode that went along
+ */
+void pca9685DevSent(struct pca9685Dev *dev, int mask)
+{
+	dev->staged &= ~mask;
+	dev->latch = -1;
+}
+
+/**
+ * Writes a value with the same meaning as pwmWrite to a pin (16: all pins) right away.
+ * Other staged pins stay staged. Returns 0 on success or -1 on error.
+ */
+int pca9685DevPWM(struct pca9685Dev *dev, int pin, int value)
+{
+	unsigned long long start = pca9685Now();
+	int mask = pca9685PinMask(pin);
+	int i;
+
+	for (i = 0; i < PIN_ALL; i++)
+		if (mask & (1 << i))
+			pca9685DevStage(dev, i, value);
+
+	int ret = mask && pca9685DevCommit(dev, mask) >= 0 ? 0 : -1;
+
+	pca9685DevTime(dev, PCA9685_OP_COMMIT, start);
+	return ret;
+}
+
+/**
+ * Writes all staged pins of the mask which differ from the cache in one transaction.
+ * Returns the number of changed pins or -1 on error.
+ */
+int pca9685DevCommit(struct pca9685Dev *dev, int mask)
+{
+	struct pca9685Block blocks[LED_REGS / 2];
+	unsigned char target[LED_REGS];
+	int pins;
+
+	if (pca9685DevRecover(dev) < 0)
+		return -1;
+
+	int n = pca9685DevPlan(dev, mask, target, blocks, &pins);
+	if (!n)
+	{
+		dev->staged &= ~mask;
+		return 0;
+	}
+
+	if (pca9685DevWrite(dev, blocks, n) < 0)
+		return -1;
+
+	pca9685DevSent(dev, mask);
+	return pins;
+}
+
+/**
+ * Stages on and off ticks of a pin without writing to the chip
+ * (Deactivates any full-on and full-off, just like pca9685PWMWrite)
+ */
+int pca9685FrameWrite(int fd, int pin, int on, int off)
+{
+	struct pca9685Dev *dev = pca9685DevLock(fd);
+	int mask = pca9685PinMask(pin);
+	int i;
+
+	if (!dev)
+		return -1;
+
+	for (i = 0; i < PIN_ALL; i++)
+		if (mask & (1 << i))
+			stageOnOff(dev, i, on & 0x0FFF, off & 0x0FFF);
+
+	pca9685DevUnlock(dev);
+	return mask ? 0 : -1;
+}
+
+/**
+ * Stages a value with the same meaning as pwmWrite without writing to the chip.
+ * If value is <= 0, full-off will be enabled
+ * If value is >= 4096, full-on will be enabled
+ * Every value in between sets on-tick to 0 and off-tick to value
+ */
+int pca9685FramePWM(int fd, int pin, int value)
+{
+	struct pca9685Dev *dev = pca9685DevLock(fd);
+	int mask = pca9685PinMask(pin);
+	int i;
+
+	if (!dev)
+		return -1;
+
+	for (i = 0; i < PIN_ALL; i++)
+		if (mask & (1 << i))
+			pca9685DevStage(dev, i, value);
+
+	pca9685DevUnlock(dev);
+	return mask ? 0 : -1;
+}
+
+/**
+ * Stages a pulse width in microseconds like pca9685WriteMicros without writing to the chip
+ */
+int pca9685FrameMicros(int fd, int pin, int us)
+{
+	struct pca9685Dev *dev = pca9685DevLock(fd);
+	if (!dev)
+		return -1;
+
+	int ret = pca9685FramePWM(fd, pin, pca9685DevTicks(dev, us));
+
+	pca9685DevUnlock(dev);
+	return ret;
+}
+
+/**
+ * Sets when the pins of the next commit of this chip change. PCA9685_LATCH_STOP changes all of them
+ * together at the end of the transaction, PCA9685_LATCH_ACK each one as soon as it's written.
+ * The MODE2 write goes out with the commit and the mode stays until changed again.
+ * Returns 0 on success or -1 on error.
+ */
+int pca9685FrameLatch(int fd, int latch)
+{
+	if (latch != PCA9685_LATCH_STOP && latch != PCA9685_LATCH_ACK)
+		return -1;
+
+	struct pca9685Dev *dev = pca9685DevLock(fd);
+	if (!dev)
+		return -1;
+
+	dev->latch = latch;
+
+	pca9685DevUnlock(dev);
+	return 0;
+}
+
+/**
+ * Stages full-on of a pin without writing to the chip
+ */
+int pca9685FrameFullOn(int fd, int pin, int tf)
+{
+	struct pca9685Dev *dev = pca9685DevLock(fd);
+	int mask = pca9685PinMask(pin);
+	int i;
+
+	if (!dev)
+		return -1;
+
+	for (i = 0; i < PIN_ALL; i++)
+		if (mask & (1 << i))
+			stageFull(dev, i, 1, tf);
+
+	pca9685DevUnlock(dev);
+	return mask ? 0 : -1;
+}
+
+/**
+ * Stages full-off of a pin without writing to the chip
+ */
+int pca9685FrameFullOff(int fd, int pin, int tf)
+{
+	struct pca9685Dev *dev = pca9685DevLock(fd);
+	int mask = pca9685PinMask(pin);
+	int i;
+
+	if (!dev)
+		return -1;
+
+	for (i = 0; i < PIN_ALL; i++)
+		if (mask & (1 << i))
+			stageFull(dev, i, 3, tf);
+
+	pca9685DevUnlock(dev);
+	return mask ? 0 : -1;
+}
+
+/**
+ * Writes all staged pins which differ from what was last sent in one transaction.
+ * Returns the number of pins that changed or -1 on error.
+ */
+int pca9685FrameCommit(int fd)
+{
+	struct pca9685Dev *dev = pca9685DevLock(fd);
+	if (!dev)
+		return -1;
+
+	unsigned long long start = pca9685Now();
+	int ret = pca9685DevCommit(dev, (1 << PIN_ALL) - 1);
+
+	pca9685DevTime(dev, PCA9685_OP_COMMIT, start);
+	pca9685DevUnlock(dev);
+	return ret;
+}
+
+
+/**
+ * Spreads the on-ticks of pwmWrite values over the period, so the pins don't all switch on
+ * at the same time. Pins get on-ticks in bit-reversed order (0, 2048, 1024, 3072, 512, ...),
+ * so even a few pins are spread well. shift moves all of them, eg. to interleave boards
+ * on the same supply. The on-ticks never change while stagger mode is on, so a new value
+ * only writes the off registers. Already written pins keep their values until written again.
+ * Returns 0 on success or -1 on error.
+ */
+int pca9685Stagger(int fd, int enable, int shift)
+{
+	struct pca9685Dev *dev = pca9685DevLock(fd);
+	if (!dev)
+		return -1;
+
+	int pin;
+	for (pin = 0; pin < PIN_ALL; pin++)
+	{
+		int reversed = ((pin & 1) << 3) | ((pin & 2) << 1) | ((pin & 4) >> 1) | ((pin & 8) >> 3);
+		dev->phase[pin] = (reversed * 4096 / PIN_ALL + shift) & 0x0FFF;
+	}
+
+	dev->stagger = enable != 0;
+
+	pca9685DevUnlock(dev);
+	return 0;
+}
+
+/**
+ * Returns 1 if a pin with these LED register values is high at a tick of the period
+ */
+static int pinHigh(const unsigned char *led, int tick)
+{
+	int on  = led[0] | ((led[1] & 0x0F) << 8);
+	int off = led[2] | ((led[3] & 0x0F) << 8);
+
+	// Full-off has priority over full-on
+	if (led[3] & 0x10)
+		return 0;
+	if (led[1] & 0x10)
+		return 1;
+
+	if (on == off)
+		return 0;
+
+	return on < off ? (tick >= on && tick < off) : (tick >= on || tick < off);
+}
+
+/**
+ * Returns the highest number of pins that are high at the same time during a period,
+ * according to the register cache. Returns -1 on error.
+ */
+int pca9685ConcurrentOn(int fd)
+{
+	struct pca9685Dev *dev = pca9685DevLock(fd);
+	if (!dev)
+		return -1;
+
+	int pin, edge, worst = 0;
+
+	// The count only goes up at an on-tick, so it's enough to look at those
+	for (edge = 0; edge < PIN_ALL; edge++)
+	{
+		const unsigned char *led = dev->led + 4 * edge;
+		int tick = led[0] | ((led[1] & 0x0F) << 8);
+		int count = 0;
+
+		for (pin = 0; pin < PIN_ALL; pin++)
+			count += pinHigh(dev->led + 4 * pin, tick);
+
+		worst = count > worst ? count : worst;
+	}
+
+	pca9685DevUnlock(dev);
+	return worst;
+}
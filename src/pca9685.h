@@ -29,9 +29,162 @@
 extern "C" {
 #endif
 
-// Setup a pca9685 at the specific i2c address
+// State of a single pin as read from the chip
+struct pca9685Pin
+{
+	int on;			// [0..4095]
+	int off;		// [0..4095]
+	int fullOn;		// 0 or 1
+	int fullOff;	// 0 or 1
+};
+
+// Lock statistics of a bus in thread-safe mode
+struct pca9685LockStats
+{
+	unsigned long locks;			// Operations and batches that took the lock
+	unsigned long contended;		// How many of them had to wait for another thread
+	unsigned long long waitNs;		// Total time spent waiting
+	unsigned long long holdNs;		// Total time the lock was held
+	unsigned long long maxHoldNs;	// Longest time the lock was held at once
+};
+
+// Traffic of a fake bus, see pca9685FakeStats
+struct pca9685FakeStats
+{
+	unsigned long transfers;		// Transactions from START to STOP
+	unsigned long messages;			// Messages, each starts with an address byte
+	unsigned long bytes;			// Bytes on the wire, including address bytes
+	unsigned long blocked;			// Writes the chips ignored (PRESCALE while awake)
+	unsigned long early;			// Restarts less than 500 us after leaving sleep
+	unsigned long partial;			// Pins left half written at a STOP while outputs change on ACK
+	double us[3];					// Estimated bus time at 100 kHz, 400 kHz and 1 MHz
+};
+
+// Retune statistics of a device, see pca9685RetuneStats
+struct pca9685RetuneStats
+{
+	unsigned long retunes;
+	unsigned long skipped;			// Retunes to the prescale that was set already
+	unsigned long long lastNs;		// From the call until PWM runs again
+	unsigned long long maxNs;
+	unsigned long long totalNs;
+};
+
+// MODE2 settings, see pca9685Mode2Set
+struct pca9685Mode2
+{
+	int invert;						// INVRT: invert the outputs
+	int onAck;						// OCH: outputs change on ACK of each pin instead of at STOP
+	int totemPole;					// OUTDRV: totem pole outputs, open drain otherwise
+	int disabled;					// OUTNE: pins while OE is high, PCA9685_OE_LOW, _HIGH or _HIGHZ
+};
+
+// Statistics of the motion engine, see pca9685MotionStats
+struct pca9685MotionStats
+{
+	float plannedHz;				// Rate of pca9685MotionStart
+	float achievedHz;				// Steps per second since start or reset, 0 unless the clock runs
+	unsigned long steps;
+	unsigned long late;				// Steps that missed their deadline
+	unsigned long writes;			// Pin updates written
+	unsigned long skipped;			// Pin updates skipped because the tick value didn't change
+};
+
+// Transactions of a device or a bus, see pca9685Stats
+struct pca9685Counters
+{
+	unsigned long reads;			// Transactions that read registers
+	unsigned long writes;			// Transactions that only wrote
+	unsigned long long bytesRead;
+	unsigned long long bytesWritten;	// Including register bytes, without address bytes
+	unsigned long errors;			// Transactions that failed
+	unsigned long retries;			// Transactions that were repeated after an error
+};
+
+// Operations with a latency histogram
+#define PCA9685_OP_PWMWRITE	0
+#define PCA9685_OP_PWMFREQ	1
+#define PCA9685_OP_FULLON	2
+#define PCA9685_OP_FULLOFF	3
+#define PCA9685_OP_RESET	4
+#define PCA9685_OP_COMMIT	5		// Frame commits, pwmWrite, digitalWrite and WriteMicros
+#define PCA9685_OPS			6
+
+// Bucket 0 counts calls below 1 us, bucket n those from 2^(n-1) up to 2^n us
+#define PCA9685_BUCKETS		24
+
+struct pca9685Histogram
+{
+	unsigned long count;
+	unsigned long long totalNs;
+	unsigned long long maxNs;
+	unsigned long bucket[PCA9685_BUCKETS];
+};
+
+// Snapshot of a device, see pca9685Stats
+struct pca9685Stats
+{
+	struct pca9685Counters dev;
+	struct pca9685Counters bus;		// All devices on the same bus
+	struct pca9685Histogram op[PCA9685_OPS];
+	int degraded;					// See pca9685Degraded
+};
+
+// Statistics of the frame scheduler, see pca9685SchedStats
+struct pca9685SchedStats
+{
+	float plannedHz;				// Rate of pca9685SchedRun or pca9685SchedStart
+	float achievedHz;				// Frames per second since start or reset
+	unsigned long frames;			// Frames run
+	unsigned long skipped;			// Frames dropped because the one before ran too long
+	unsigned long overruns;			// Frames that ended after the next deadline
+	unsigned long errors;			// Frames where a producer or a flush failed
+	unsigned long long lastJitterNs;	// How late the frame started
+	unsigned long long maxJitterNs;
+	unsigned long long totalJitterNs;
+	unsigned long long lastWorkNs;	// How long the producers and the flush took
+	unsigned long long maxWorkNs;
+	unsigned long long totalWorkNs;
+};
+
+// A note of a tone table, see pca9685ToneInfo
+struct pca9685Tone
+{
+	float freq;						// Frequency of the note in Hertz
+	float achieved;					// Frequency of its prescale
+	float cents;					// Error of achieved, 100 cents make a semitone
+	int prescale;
+};
+
+// A step of a sequence, see pca9685TonePlay
+struct pca9685Note
+{
+	int note;						// MIDI note number (69: A4), -1 for a rest
+	float beats;					// Length
+};
+
+// Latency of an async writer, see pca9685AsyncLatency
+struct pca9685LatencyStats
+{
+	unsigned long rounds;			// Rounds of the writer started by a post
+	unsigned long long wakeP50Ns;	// From the post until the writer runs
+	unsigned long long wakeP99Ns;
+	unsigned long long wakeP999Ns;
+	unsigned long long wakeMaxNs;
+	unsigned long long writeP50Ns;	// From the post until the update is on the bus
+	unsigned long long writeP99Ns;
+	unsigned long long writeP999Ns;
+	unsigned long long writeMaxNs;
+	int priority;					// SCHED_FIFO priority, 0 for the normal scheduler
+	int cpu;						// CPU the writer is pinned to, -1 for any
+};
+
+// Setup a pca9685 at the specific i2c address (not available if built with WIRINGPI=0)
 extern int pca9685Setup(const int pinBase, const int i2cAddress/* = 0x40*/, float freq/* = 50*/);
 
+// Same, but takes over a running chip as it is without glitching its outputs
+extern int pca9685SetupWarm(const int pinBase, const int i2cAddress/* = 0x40*/);
+
 // You now have access to the following wiringPi functions:
 //
 // void pwmWrite (int pin, int value)
@@ -44,13 +197,13 @@ extern int pca9685Setup(const int pinBase, const int i2cAddress/* = 0x40*/, floa
 //		else set full-off
 //
 // int digitalRead (int pin)
-//		read off-register
+//		read off-register (from the register cache)
 //		To get PWM: mask with 0xFFF
 //		To get full-off bit: mask with 0x1000
 //		Note: ALL_LED pin will always return 0
 //
 // int analogRead (int pin)
-//		read on-register
+//		read on-register (from the register cache)
 //		To get PWM: mask with 0xFFF
 //		To get full-on bit: mask with 0x1000
 //		Note: ALL_LED pin will always return 0
@@ -59,13 +212,253 @@ extern int pca9685Setup(const int pinBase, const int i2cAddress/* = 0x40*/, floa
 
 // Advanced controls
 // You can use the file descriptor returned from the setup function to access the following features directly on each connected pca9685
-extern void pca9685PWMFreq(int fd, float freq);
-extern void pca9685PWMReset(int fd);
-extern void pca9685PWMWrite(int fd, int pin, int on, int off);
-extern void pca9685PWMRead(int fd, int pin, int *on, int *off);
+// All of them return 0 on success or -1 on error.
+extern int pca9685PWMFreq(int fd, float freq);
+extern int pca9685PWMReset(int fd);
+extern int pca9685PWMWrite(int fd, int pin, int on, int off);
+extern int pca9685PWMRead(int fd, int pin, int *on, int *off);
+
+// Write several consecutive pins in one I2C transaction.
+// on and off hold count values each, formatted like the ones pca9685PWMRead returns
+// (bits [0..11] PWM, bit 12 full-on / full-off).
+extern int pca9685PWMWriteRange(int fd, int pin, int count, const int *on, const int *off);
+
+extern int pca9685FullOn(int fd, int pin, int tf);
+extern int pca9685FullOff(int fd, int pin, int tf);
+
+// Frequency
+// Frequency picks the closest prescale (3..255) for the oscillator, returns the achieved frequency
+// or -1 and optionally the error in Hertz. Oscillator sets the clock frequency in Hertz (1 to 50 MHz),
+// eg. a calibrated internal one, or switches to the EXTCLK pin (which only a power cycle undoes).
+extern float pca9685Frequency(int fd, float freq, float *error);
+extern int pca9685Oscillator(int fd, int hz, int external);
+
+// Retune writes sleep, prescale and wake in one transaction and only waits the 500 us the oscillator
+// needs if the outputs should resume (RESTART). With NOWAIT, RetuneFinish does the restart later
+// (wait = 0: returns 1 if it's too early). Frequency and PWMFreq retune with RESTART.
+#define PCA9685_RETUNE_RESTART 1
+#define PCA9685_RETUNE_NOWAIT 2
+extern float pca9685Retune(int fd, float freq, int flags);
+extern int pca9685RetuneFinish(int fd, int wait);
+extern int pca9685RetuneStats(int fd, struct pca9685RetuneStats *stats, int reset);
+
+// MODE2
+// Typed access to output inversion, output change on STOP or ACK, output driver and the pin
+// state while OE is high (open drain drives high as high-impedance). Get reads the cache.
+#define PCA9685_OE_LOW		0
+#define PCA9685_OE_HIGH		1
+#define PCA9685_OE_HIGHZ	2
+extern int pca9685Mode2Set(int fd, const struct pca9685Mode2 *mode);
+extern int pca9685Mode2Get(int fd, struct pca9685Mode2 *mode);
+
+// Pulse widths
+// Period returns the true PWM period in ns, from the programmed prescale and the oscillator.
+// WriteMicros sets a pin high for us microseconds per period using integer math only.
+extern int pca9685Period(int fd);
+extern int pca9685WriteMicros(int fd, int pin, int us);
+
+// Read all 16 pins (and optionally MODE1, MODE2 and PRESCALE) from the chip in one transaction.
+// This bypasses the register cache. Returns 0 on success or -1 on error.
+extern int pca9685ReadAll(int fd, struct pca9685Pin *pins, int *mode1, int *mode2, int *prescale);
+
+// Frames
+// Stage values of any pins in a back buffer without touching the bus, then commit them at once.
+// Commit only sends pins which differ from what was last sent, merged into as few
+// messages as possible in a single transaction. It returns the number of changed pins or -1.
+// Pin 16 stages all pins. pwmWrite and digitalWrite use the same path for a single pin.
+// Staging returns 0 or -1 for an unknown device or pin.
+extern int pca9685FrameWrite(int fd, int pin, int on, int off);
+extern int pca9685FramePWM(int fd, int pin, int value);
+extern int pca9685FrameMicros(int fd, int pin, int us);
+extern int pca9685FrameFullOn(int fd, int pin, int tf);
+extern int pca9685FrameFullOff(int fd, int pin, int tf);
+extern int pca9685FrameCommit(int fd);
+
+// FrameLatch picks when the pins of the next commit change: all together at the end of the
+// transaction (STOP) or each one as soon as it's written (ACK). It's sent along with the commit.
+#define PCA9685_LATCH_STOP	0
+#define PCA9685_LATCH_ACK	1
+extern int pca9685FrameLatch(int fd, int latch);
+
+// Phase stagger
+// Spread the on-ticks of pwmWrite values over the period to avoid current spikes. Each pin gets a
+// fixed on-tick (plus shift), the off-tick wraps around, the duty stays the same. ConcurrentOn
+// returns the highest number of pins that are high at the same time.
+extern int pca9685Stagger(int fd, int enable, int shift);
+extern int pca9685ConcurrentOn(int fd);
+
+// Shared buses
+// Open /dev/i2c-N once and add any number of PCA9685 (0x40..0x7F) to it. No wiringPi pins are used.
+// BusAdd returns a handle which works with all functions above and below (it's not a file descriptor).
+// BusCommit flushes the staged frames of all chips on the bus in a single transfer and
+// returns the number of changed pins or -1.
+// BusOpen picks the transport. BusSetup uses PCA9685_I2CDEV.
+#define PCA9685_I2CDEV		0	// i2c-dev ioctls, combined transfers if the adapter supports them
+#define PCA9685_WIRINGPI	1	// wiringPiI2C functions, 8 and 16 bit register access only
+#define PCA9685_FAKE		2	// Registers in memory, no hardware needed (device is ignored)
+
+extern int pca9685BusOpen(const char *device, int transport);
+extern int pca9685BusSetup(const char *device/* = "/dev/i2c-1"*/);
+
+// Fake buses emulate sleep, restart, auto-increment, blocked PRESCALE writes, full-on/full-off
+// priority and LEDALL. FakeStats counts their traffic and estimates its duration on a real bus.
+// FakeOutput returns how many ticks of the period a pin is high (0..4096) or -1. FakeFail makes the
+// next count transactions to an address fail with a NACK (-1: until it's called with 0). A fake bus
+// only has the chips of BusAdd and BusAdopt, other addresses NACK. FakeAdd plugs in another one.
+extern int pca9685FakeAdd(int bus, int i2cAddress);
+extern int pca9685FakeStats(int bus, struct pca9685FakeStats *stats, int reset);
+extern int pca9685FakeOutput(int bus, int i2cAddress, int pin);
+extern int pca9685FakeFail(int bus, int i2cAddress, int count);
+extern int pca9685BusAdd(int bus, int i2cAddress, float freq);
+extern int pca9685BusCommit(int bus);
+
+// BusAdopt adds a running chip without touching it, keeping MODE1, MODE2, PRESCALE and all pins.
+// BusInit sets up count chips with one shared oscillator wait (handles optional, -1 per missing chip)
+// and returns the number of chips that answered or -1.
+extern int pca9685BusAdopt(int bus, int i2cAddress);
+extern int pca9685BusInit(int bus, const int *addresses, int count, float freq, int *handles);
+
+// Groups
+// Chips can listen to up to three sub-addresses (group 1..3) and the ALLCALL address (group 0,
+// 0x70 and enabled after power-on). GroupWrite sends a pin's 16 bit on and off values (pin 16: LEDALL)
+// to all members with a single message and updates the register caches of the members on that bus.
+// It returns the number of those members or -1. GroupPWM takes a value like pwmWrite.
+extern int pca9685GroupJoin(int fd, int group, int i2cAddress);
+extern int pca9685GroupLeave(int fd, int group);
+extern int pca9685GroupWrite(int bus, int i2cAddress, int pin, int on, int off);
+extern int pca9685GroupPWM(int bus, int i2cAddress, int pin, int value);
+
+// Async mode
+// Post updates without waiting for the bus. A writer thread per bus sends them with batched
+// writes, keeping only the newest value of each pin. pwmWrite and digitalWrite post as well.
+// Flush waits until everything posted before has been written (-1 if that failed), Coalesced
+// returns the number of updates that were dropped because a newer one came in first. Writes which
+// don't post drop the posted updates of their pins. The bus is locked as in thread-safe mode while async mode runs.
+extern int pca9685AsyncStart(int fd);
+extern void pca9685AsyncStop(int fd);
+extern int pca9685AsyncWrite(int fd, int pin, int on, int off);
+extern int pca9685AsyncPWM(int fd, int pin, int value);
+extern int pca9685AsyncFlush(int fd);
+extern unsigned long pca9685AsyncCoalesced(int fd);
+extern int pca9685AsyncActive(int fd);
+
+// Real-time mode runs the writer of a bus with SCHED_FIFO priority (1..99, 0: normal) pinned to a cpu
+// (-1: any) and locks all memory. Latency reports percentiles of wake-up and write latency of the writer,
+// in any mode, so the difference shows. pca9685PWMWrite and WriteMicros post in async mode, too.
+extern int pca9685AsyncRealtime(int fd, int priority, int cpu);
+extern int pca9685AsyncLatency(int fd, struct pca9685LatencyStats *stats, int reset);
+
+// Thread-safe mode
+// Every operation takes the lock of its bus, threads on different buses never wait for each other.
+// A batch holds the lock across several operations so no other thread gets in between.
+// LockStats reports contention and hold times of a bus (fd may be a device or a bus).
+extern void pca9685ThreadSafe(int enable);
+extern int pca9685BatchBegin(int fd);
+extern void pca9685BatchEnd(int fd);
+extern int pca9685LockStats(int fd, struct pca9685LockStats *stats, int reset);
+
+// Servo motion
+// Move servos to a pulse width (us) with limited velocity (us/s) and acceleration (us/s^2).
+// jerk (us/s^3) > 0 gives an S-curve, 0 a trapezoidal profile. Targets can change at any time.
+// Step advances all servos by dt seconds and writes the pins whose tick value changed, one
+// transfer per bus. Other staged pins stay staged. Start runs Step on a fixed clock in a thread.
+extern int pca9685MotionMove(int fd, int pin, float target, float maxVel, float maxAcc, float jerk);
+extern float pca9685MotionPosition(int fd, int pin);
+extern int pca9685MotionMoving(void);
+extern int pca9685MotionStep(float dt);
+extern int pca9685MotionStart(float hz);
+extern void pca9685MotionStop(void);
+extern void pca9685MotionStats(struct pca9685MotionStats *stats, int reset);
+
+// Pixels
+// Map 8 or 16 bit frames onto LED walls of any number of boards. Layout sets the number of pixels and
+// colors per pixel (1..4), Assign puts a pixel on consecutive pins of a board. Curve sets gamma and gain
+// (white balance) of a color, Brightness scales all of them. Show converts a whole frame with lookup
+// tables, stages it and flushes every bus in one transfer. It returns the number of changed pins or -1.
+#define PCA9685_COLORS 4
+extern int pca9685PixelLayout(int pixels, int depth);
+extern int pca9685PixelAssign(int pixel, int fd, int pin);
+extern int pca9685PixelCurve(int color, float gamma, float gain);
+extern int pca9685PixelBrightness(float brightness);
+extern int pca9685PixelShow8(const unsigned char *frame);
+extern int pca9685PixelShow16(const unsigned short *frame);
+
+// Frame scheduler
+// Producers stage a frame (eg. with FramePWM or PixelShow8) and get the frame number, counted from the
+// start. Run calls them at absolute deadlines of hz on the calling thread (frames = 0: until Stop),
+// Start does the same in a thread. All buses with staged pins are flushed after each frame. Frames
+// that would start too late are skipped, so animations keep their speed instead of drifting.
+typedef int (*pca9685Producer)(unsigned long frame, void *arg);
+extern int pca9685SchedAdd(pca9685Producer func, void *arg);
+extern int pca9685SchedRemove(pca9685Producer func, void *arg);
+extern int pca9685SchedRun(float hz, unsigned long frames);
+extern int pca9685SchedStart(float hz);
+extern void pca9685SchedStop(void);
+extern void pca9685SchedStats(struct pca9685SchedStats *stats, int reset);
+
+// Shared memory
+// pca9685d owns the buses and chips of its command line, so any number of processes can share them.
+// ShmOpen maps its shared memory (name 0: "/pca9685") and returns the number of chips, Find looks one
+// up by bus (numbered in the order of the command line) and address. Write and Frame store values like
+// pwmWrite under a robust lock per chip, the daemon sees all or none of a call and flushes what changed
+// with its next round, one transfer per bus. Read returns the value last stored for a pin or -1.
+extern int pca9685ShmOpen(const char *name);
+extern void pca9685ShmClose(void);
+extern int pca9685ShmFind(int bus, int i2cAddress);
+extern int pca9685ShmWrite(int chip, int pin, int value);
+extern int pca9685ShmFrame(int chip, int first, int count, const int *values);
+extern int pca9685ShmRead(int chip, int pin);
+
+// Shows
+// RecordStart captures every pin change of any chip into a file (times in ticks of tickUs, 0: 100 us),
+// starting with the state of all chips. RecordStop completes it and returns the number of events or -1.
+// ShowOpen maps a show and returns its number of chips, ShowChip tells where one was recorded and
+// ShowAssign plays it on a device. ShowPlay replays the show at absolute deadlines on the calling thread,
+// flushing each bus once per frame, and returns the number of frames or -1. ShowStop ends it early.
+extern int pca9685RecordStart(const char *path, int tickUs);
+extern long long pca9685RecordStop(void);
+extern int pca9685ShowOpen(const char *path);
+extern int pca9685ShowChip(int chip, int *bus, int *i2cAddress);
+extern int pca9685ShowAssign(int chip, int fd);
+extern long pca9685ShowPlay(void);
+extern void pca9685ShowStop(void);
+extern void pca9685ShowClose(void);
+
+// Tones
+// A chip plays a voice on a piezo disc: the note sets the frequency, the pin runs at 50% duty. ToneSetup
+// works out the prescale of every MIDI note for the chip's oscillator and returns the number of notes
+// within 50 cents, ToneInfo reports the error of a note. ToneNote switches pitch with a single retune
+// transaction (none if the prescale stays), -1 is a rest. TonePlay plays a sequence at absolute deadlines
+// of tempo beats per minute on the calling thread and returns the number of notes played or -1.
+extern int pca9685ToneSetup(int fd, int pin, float a4);
+extern int pca9685ToneInfo(int fd, int note, struct pca9685Tone *tone);
+extern int pca9685ToneNote(int fd, int note);
+extern int pca9685TonePlay(int fd, const struct pca9685Note *notes, int count, float tempo);
+extern void pca9685ToneStop(void);
+
+// Statistics
+// Every transaction is counted for its bus and its device, every call of the operations above
+// is timed. Stats copies them (and starts over if reset is set), StatsDump writes them as text
+// in the Prometheus format and returns its length like snprintf. With a bus fd, both only cover
+// the bus counters, which only start over that way.
+extern int pca9685Stats(int fd, struct pca9685Stats *stats, int reset);
+extern int pca9685StatsDump(int fd, char *buf, int size);
+
+// Error handling
+// Failed transactions are tried again according to the retry policy of their bus (fd may be a device
+// or a bus): up to attempts tries, waiting backoffUs before the first retry and twice as long before
+// each further one, but none starting later than deadlineUs after the first try (0: no deadline).
+// The default is a single try. A device whose transaction failed for good is degraded: its cache is
+// resynced from the chip before the next write. Degraded returns 1 until then.
+extern int pca9685RetryPolicy(int fd, int attempts, int deadlineUs, int backoffUs);
+extern int pca9685Degraded(int fd);
 
-extern void pca9685FullOn(int fd, int pin, int tf);
-extern void pca9685FullOff(int fd, int pin, int tf);
+// Register cache
+// All writes are mirrored in a per-device cache, so reads never touch the bus.
+// Verify returns the number of registers where chip and cache differ (-1 on error),
+// Resync reloads the cache from the chip.
+extern int pca9685Verify(int fd);
+extern int pca9685Resync(int fd);
 
 #ifdef __cplusplus
 }
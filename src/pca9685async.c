@@ -0,0 +1,657 @@
+/*************************************************************************
+ * pca9685async.c
+ *
+ * Optional async mode. Callers post pin updates without waiting for the bus,
+ * a writer thread per bus sends them with batched writes. Only the newest
+ * value of each pin is sent, older ones are dropped (coalesced).
+ * The writer can run in real-time mode and measures its own latency.
+ *
+ * This software is a devLib extension to wiringPi <http://wiringpi.com/>
+ * and enables it to control the Adafruit PCA9685 16-Channel 12-bit
+ * PWM/Servo Driver <http://www.adafruit.com/products/815> via I2C interface.
+ *
+ * Copyright (c) 2014 Reinhard Sprung
+ *
+ * If you have questions or improvements email me at
+ * reinhard.sprung[at]gmail.com
+ *
+ * This software is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * The given code is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You can view the contents of the licence at <http://www.gnu.org/licenses/>.
+ **************************************************************************
+ */
+
+// For CPU affinity
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "pca9685.h"
+#include "pca9685dev.h"
+
+// A slot holds the newest update of a pin:
+// bits [0..12] on-tick or pwmWrite value, bits [13..25] off-tick
+#define SLOT_PENDING	0x80000000u		// Not picked up by the writer yet
+#define SLOT_PWM		0x40000000u		// Value has pwmWrite meaning
+
+// Latency histograms have 8 buckets per power of two of nanoseconds, up to 2^40 ns
+#define LATENCY_BUCKETS (8 * 38)
+
+
+/**
+ * Updates of a device, one slot per pin. Producers never block:
+ * they swap their value into the slot and mark the pin in the pending mask.
+ */
+struct pca9685Queue
+{
+	atomic_uint slot[PIN_ALL];
+	atomic_uint pending;				// Bit n is set if slot n may hold an update
+	atomic_ulong coalesced;				// Updates overwritten before the writer got them
+	struct pca9685Writer *writer;		// Writer of the bus, stays until the queue is freed
+};
+
+/**
+ * Writer thread of a bus
+ */
+struct pca9685Writer
+{
+	pthread_t thread;
+	struct pca9685Bus *bus;
+	sem_t wake;
+	atomic_int running;
+	atomic_ulong posted;				// Sequence number of the last posted update
+	unsigned long written;				// Sequence number of the last update on the bus
+	unsigned long failedFrom;			// Updates after this one are still staged since the last rounds failed
+	int failing;						// The last round failed
+	pthread_mutex_t lock;				// Held while writing, producers never take it
+	pthread_cond_t done;
+	int users;							// Devices in async mode
+	atomic_ullong kicked;				// When the first update since the last round was posted, 0 if none
+	int priority;						// SCHED_FIFO priority, 0 for the normal scheduler
+	int cpu;							// CPU the writer is pinned to, -1 for any
+	unsigned long rounds;				// Rounds with a latency sample, guarded by lock
+	unsigned long wakeHist[LATENCY_BUCKETS];
+	unsigned long writeHist[LATENCY_BUCKETS];
+	unsigned long long wakeMax;
+	unsigned long long writeMax;
+};
+
+
+/**
+ * Returns the histogram bucket of a latency. Values below 8 ns have their own bucket, above that
+ * each power of two is split into 8, so a bucket is at most 12.5% wide.
+ */
+static int latencyBucket(unsigned long long ns)
+{
+	if (ns < 8)
+		return ns;
+
+	int msb = 63 - __builtin_clzll(ns);
+	if (msb > 39)
+		return LATENCY_BUCKETS - 1;
+
+	return (msb - 2) * 8 + ((ns >> (msb - 3)) & 7);
+}
+
+/**
+ * Returns the upper end of a latency bucket
+ */
+static unsigned long long bucketEnd(int bucket)
+{
+	if (bucket < 8)
+		return bucket;
+
+	int msb = bucket / 8 + 2;
+
+	return ((unsigned long long)(9 + bucket % 8) << (msb - 3)) - 1;
+}
+
+/**
+ * Returns the latency below which a fraction (eg. 0.99) of the samples lie
+ */
+static unsigned long long percentile(const unsigned long *hist, unsigned long count, double fraction)
+{
+	unsigned long need = (unsigned long)(count * fraction + 0.999999);
+	unsigned long sum = 0;
+	int i;
+
+	if (!count)
+		return 0;
+
+	for (i = 0; i < LATENCY_BUCKETS; i++)
+	{
+		sum += hist[i];
+		if (sum >= need)
+			return bucketEnd(i);
+	}
+
+	return bucketEnd(LATENCY_BUCKETS - 1);
+}
+
+
+/**
+ * Takes all pending updates of a device and stages them in its frame.
+ * Returns the mask of the staged pins.
+ */
+static int drainQueue(struct pca9685Dev *dev, struct pca9685Queue *q)
+{
+	unsigned int mask = atomic_exchange(&q->pending, 0);
+	int pin, staged = 0;
+
+	for (pin = 0; mask && pin < PIN_ALL; pin++)
+	{
+		if (!(mask & (1u << pin)))
+			continue;
+
+		unsigned int v = atomic_exchange(&q->slot[pin], 0);
+		if (!(v & SLOT_PENDING))
+			continue;
+
+		if (v & SLOT_PWM)
+			pca9685FramePWM(dev->id, pin, v & 0x1FFF);
+		else
+			pca9685FrameWrite(dev->id, pin, v & 0x1FFF, (v >> 13) & 0x1FFF);
+
+		staged |= 1 << pin;
+	}
+
+	return staged;
+}
+
+/**
+ * Writer thread. Sleeps until something is posted, then drains the queues of all
+ * async devices on the bus and sends them in one go.
+ */
+static void *writerThread(void *arg)
+{
+	struct pca9685Writer *w = arg;
+	struct pca9685Bus *bus = w->bus;
+	struct pca9685Dev *dev;
+
+	while (atomic_load(&w->running))
+	{
+		sem_wait(&w->wake);
+
+		unsigned long long kicked = atomic_exchange(&w->kicked, 0);
+		unsigned long long woke = pca9685Now();
+
+		// In thread-safe mode, the whole round is one batch.
+		// The bus lock always comes before the writer lock.
+		pca9685BusLock(bus);
+		pthread_mutex_lock(&w->lock);
+
+		// Everything posted up to here is in the queues already
+		unsigned long target = atomic_load(&w->posted);
+
+		for (dev = pca9685Devices; dev; dev = dev->next)
+			if (dev->bus == bus && dev->queue)
+				drainQueue(dev, dev->queue);
+
+		// Flushes wait for this round, they need to know if it failed. Pins of a failed
+		// round stay staged, so a round that gets through writes them as well.
+		if (pca9685BusFlush(bus->fd, 1) < 0)
+		{
+			if (!w->failing)
+				w->failedFrom = w->written;
+			w->failing = 1;
+		}
+		else
+			w->failing = 0;
+
+		// Rounds started by a post, not by a flush, tell how long an update waits
+		if (kicked)
+		{
+			unsigned long long wake = woke > kicked ? woke - kicked : 0;
+			unsigned long long write = pca9685Now() - kicked;
+
+			w->rounds++;
+			w->wakeHist[latencyBucket(wake)]++;
+			w->writeHist[latencyBucket(write)]++;
+			w->wakeMax = wake > w->wakeMax ? wake : w->wakeMax;
+			w->writeMax = write > w->writeMax ? write : w->writeMax;
+		}
+
+		w->written = target;
+		pthread_cond_broadcast(&w->done);
+		pthread_mutex_unlock(&w->lock);
+		pca9685BusUnlock(bus);
+	}
+
+	return 0;
+}
+
+/**
+ * Enters an async function of a device. Returns its queue or 0 (without entering) if it isn't
+ * in async mode. pca9685AsyncStop waits for everyone inside before it frees the queue and writer.
+ */
+static struct pca9685Queue *enter(struct pca9685Dev *dev)
+{
+	atomic_fetch_add(&dev->inside, 1);
+
+	struct pca9685Queue *q = dev->queue;
+	if (!q)
+		atomic_fetch_sub(&dev->inside, 1);
+
+	return q;
+}
+
+/**
+ * Leaves an async function entered with enter()
+ */
+static void leave(struct pca9685Dev *dev)
+{
+	atomic_fetch_sub(&dev->inside, 1);
+}
+
+/**
+ * Posts an update into a slot and wakes the writer if necessary
+ */
+static int post(int fd, int pin, unsigned int value)
+{
+	struct pca9685Dev *dev = pca9685DevGet(fd);
+	if (!dev || pin < 0 || pin > PIN_ALL)
+		return -1;
+
+	struct pca9685Queue *q = enter(dev);
+	if (!q)
+		return -1;
+
+	struct pca9685Writer *w = q->writer;
+	int i;
+
+	for (i = 0; i < PIN_ALL; i++)
+	{
+		if (pin != PIN_ALL && pin != i)
+			continue;
+
+		if (atomic_exchange(&q->slot[i], value | SLOT_PENDING) & SLOT_PENDING)
+			atomic_fetch_add(&q->coalesced, 1);
+	}
+
+	unsigned int mask = pin == PIN_ALL ? (1u << PIN_ALL) - 1 : 1u << pin;
+	unsigned int old = atomic_fetch_or(&q->pending, mask);
+
+	atomic_fetch_add(&w->posted, 1);
+
+	// The writer only needs a kick if it has nothing to do yet
+	if (!old)
+	{
+		unsigned long long idle = 0;
+		atomic_compare_exchange_strong(&w->kicked, &idle, pca9685Now());
+
+		sem_post(&w->wake);
+	}
+
+	leave(dev);
+	return 0;
+}
+
+/**
+ * Discards the posted updates of the pins of a mask. Called under the bus lock by writes which
+ * don't go through the queue, so an older posted value can't overwrite them later.
+ */
+void pca9685AsyncDrop(struct pca9685Dev *dev, int mask)
+{
+	struct pca9685Queue *q = dev->queue;
+	int pin;
+
+	if (!q)
+		return;
+
+	for (pin = 0; pin < PIN_ALL; pin++)
+		if ((mask & (1 << pin)) && (atomic_exchange(&q->slot[pin], 0) & SLOT_PENDING))
+			atomic_fetch_add(&q->coalesced, 1);
+}
+
+/**
+ * Gives a device a queue and starts the writer thread of its bus if necessary
+ */
+static int startQueue(struct pca9685Dev *dev)
+{
+	if (dev->queue)
+		return 0;
+
+	struct pca9685Bus *bus = dev->bus;
+	struct pca9685Queue *q = calloc(1, sizeof(struct pca9685Queue));
+	if (!q)
+		return -1;
+
+	if (!bus->writer)
+	{
+		struct pca9685Writer *w = calloc(1, sizeof(struct pca9685Writer));
+		if (!w)
+		{
+			free(q);
+			return -1;
+		}
+
+		sem_init(&w->wake, 0, 0);
+		pthread_mutex_init(&w->lock, 0);
+		pthread_cond_init(&w->done, 0);
+		atomic_store(&w->running, 1);
+		w->bus = bus;
+		w->cpu = -1;
+		bus->writer = w;
+
+		if (pthread_create(&w->thread, 0, writerThread, w) != 0)
+		{
+			bus->writer = 0;
+			free(w);
+			free(q);
+			return -1;
+		}
+	}
+
+	bus->writer->users++;
+	q->writer = bus->writer;
+	dev->queue = q;
+
+	return 0;
+}
+
+/**
+ * Switches a device to async mode. Starts the writer thread of its bus if necessary.
+ * While the device is in async mode, its bus is locked even without thread-safe mode.
+ * Returns 0 on success or -1 on error.
+ */
+int pca9685AsyncStart(int fd)
+{
+	// Locking has to be on before the lock is taken
+	pca9685LockRequire(1);
+
+	struct pca9685Dev *dev = pca9685DevLock(fd);
+	if (!dev)
+	{
+		pca9685LockRequire(0);
+		return -1;
+	}
+
+	int started = !dev->queue;
+	int ret = startQueue(dev);
+
+	pca9685DevUnlock(dev);
+
+	// Only the start which gave the device its queue keeps locking on
+	if (ret < 0 || !started)
+		pca9685LockRequire(0);
+
+	return ret;
+}
+
+/**
+ * Writes all pending updates and switches a device back to blocking mode.
+ * The writer thread ends when the last device of its bus leaves async mode.
+ * Updates posted while it stops are still written.
+ */
+void pca9685AsyncStop(int fd)
+{
+	struct pca9685Dev *dev = pca9685DevGet(fd);
+	if (!dev || !dev->queue)
+		return;
+
+	pca9685AsyncFlush(fd);
+
+	struct pca9685Bus *bus = dev->bus;
+
+	// Don't pull the queue away while the writer drains it
+	pca9685BusLock(bus);
+
+	struct pca9685Queue *q = dev->queue;
+	if (!q)
+	{
+		// Stopped by someone else meanwhile
+		pca9685BusUnlock(bus);
+		return;
+	}
+
+	struct pca9685Writer *w = q->writer;
+
+	pthread_mutex_lock(&w->lock);
+	dev->queue = 0;
+	pthread_mutex_unlock(&w->lock);
+
+	pca9685BusUnlock(bus);
+
+	// New calls fail now. Wait for the ones which still use the queue, without the bus lock
+	// since a flush among them needs the writer to get it.
+	while (atomic_load(&dev->inside))
+		sched_yield();
+
+	// Write what they left. The writer goes with the last device of the bus.
+	pca9685BusLock(bus);
+	pthread_mutex_lock(&w->lock);
+
+	int left = drainQueue(dev, q);
+	if (left)
+		pca9685DevCommit(dev, left);
+
+	int last = --w->users == 0;
+	if (last)
+		bus->writer = 0;
+
+	pthread_mutex_unlock(&w->lock);
+	pca9685BusUnlock(bus);
+
+	if (last)
+	{
+		atomic_store(&w->running, 0);
+		sem_post(&w->wake);
+		pthread_join(w->thread, 0);
+
+		sem_destroy(&w->wake);
+		pthread_mutex_destroy(&w->lock);
+		pthread_cond_destroy(&w->done);
+		free(w);
+	}
+
+	free(q);
+	pca9685LockRequire(0);
+}
+
+/**
+ * Posts on and off ticks of a pin (Deactivates any full-on and full-off, like pca9685PWMWrite)
+ * Returns immediately. Returns -1 if the device is not in async mode.
+ */
+int pca9685AsyncWrite(int fd, int pin, int on, int off)
+{
+	return post(fd, pin, (on & 0x0FFF) | ((off & 0x0FFF) << 13));
+}
+
+/**
+ * Posts a value with the same meaning as pwmWrite.
+ * Returns immediately. Returns -1 if the device is not in async mode.
+ */
+int pca9685AsyncPWM(int fd, int pin, int value)
+{
+	value = value > 4096 ? 4096 : (value < 0 ? 0 : value);
+
+	return post(fd, pin, value | SLOT_PWM);
+}
+
+/**
+ * Waits until everything posted to the bus of the device before this call has been written.
+ * Returns 0 on success or -1 if the device is not in async mode or a flush that should have
+ * written some of it failed (the chip is degraded then).
+ */
+int pca9685AsyncFlush(int fd)
+{
+	struct pca9685Dev *dev = pca9685DevGet(fd);
+	if (!dev)
+		return -1;
+
+	struct pca9685Queue *q = enter(dev);
+	if (!q)
+		return -1;
+
+	struct pca9685Writer *w = q->writer;
+	unsigned long target = atomic_load(&w->posted);
+
+	pthread_mutex_lock(&w->lock);
+
+	while (w->written < target)
+	{
+		sem_post(&w->wake);
+		pthread_cond_wait(&w->done, &w->lock);
+	}
+
+	// Failed updates are written by the next round that gets through, what we waited
+	// for failed if it is still behind the failing rounds
+	int ret = w->failing && w->failedFrom < target ? -1 : 0;
+
+	pthread_mutex_unlock(&w->lock);
+
+	leave(dev);
+	return ret;
+}
+
+/**
+ * Returns the number of updates that were overwritten by newer ones before they were sent
+ */
+unsigned long pca9685AsyncCoalesced(int fd)
+{
+	struct pca9685Dev *dev = pca9685DevGet(fd);
+	if (!dev)
+		return 0;
+
+	struct pca9685Queue *q = enter(dev);
+	if (!q)
+		return 0;
+
+	unsigned long coalesced = atomic_load(&q->coalesced);
+
+	leave(dev);
+	return coalesced;
+}
+
+/**
+ * Returns 1 if the device is in async mode
+ */
+int pca9685AsyncActive(int fd)
+{
+	struct pca9685Dev *dev = pca9685DevGet(fd);
+
+	return dev && dev->queue;
+}
+
+/**
+ * Switches the scheduling of a writer thread, see pca9685AsyncRealtime
+ */
+static int setRealtime(struct pca9685Writer *w, int priority, int cpu)
+{
+	struct sched_param param = { priority };
+	cpu_set_t cpus;
+
+	if (priority && mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+		return -1;
+
+	if (pthread_setschedparam(w->thread, priority ? SCHED_FIFO : SCHED_OTHER, &param) != 0)
+		return -1;
+
+	CPU_ZERO(&cpus);
+	if (cpu < 0)
+	{
+		int i;
+		for (i = 0; i < CPU_SETSIZE; i++)
+			CPU_SET(i, &cpus);
+	}
+	else
+		CPU_SET(cpu, &cpus);
+
+	if (pthread_setaffinity_np(w->thread, sizeof(cpus), &cpus) != 0)
+		return -1;
+
+	pthread_mutex_lock(&w->lock);
+	w->priority = priority;
+	w->cpu = cpu;
+	pthread_mutex_unlock(&w->lock);
+
+	return 0;
+}
+
+/**
+ * Runs the writer thread of the device's bus in real-time mode: SCHED_FIFO with priority (1..99)
+ * and pinned to cpu (-1: any). All memory of the process is locked and faulted in, now and in the
+ * future, so the writer never waits for a page. Posting and writing don't allocate anything, so
+ * once async mode is started, nothing touches the heap anymore. priority 0 returns the writer to
+ * the normal scheduler (memory stays locked). Needs CAP_SYS_NICE and CAP_IPC_LOCK (or root).
+ * Returns 0 on success or -1 on error or if the device is not in async mode.
+ */
+int pca9685AsyncRealtime(int fd, int priority, int cpu)
+{
+	struct pca9685Dev *dev = pca9685DevGet(fd);
+	if (!dev || priority < 0 || priority > 99 || cpu < -1 || cpu >= CPU_SETSIZE)
+		return -1;
+
+	struct pca9685Queue *q = enter(dev);
+	if (!q)
+		return -1;
+
+	int ret = setRealtime(q->writer, priority, cpu);
+
+	leave(dev);
+	return ret;
+}
+
+/**
+ * Copies the latency percentiles of the writer of the device's bus: how long the first update of a
+ * round waited for the writer to wake up and until it was on the bus. If reset is set, they start over.
+ * Returns 0 on success or -1 if the device is not in async mode.
+ */
+int pca9685AsyncLatency(int fd, struct pca9685LatencyStats *stats, int reset)
+{
+	struct pca9685Dev *dev = pca9685DevGet(fd);
+	if (!dev)
+		return -1;
+
+	struct pca9685Queue *q = enter(dev);
+	if (!q)
+		return -1;
+
+	struct pca9685Writer *w = q->writer;
+	int i;
+
+	pthread_mutex_lock(&w->lock);
+
+	if (stats)
+	{
+		stats->rounds		= w->rounds;
+		stats->wakeP50Ns	= percentile(w->wakeHist, w->rounds, 0.5);
+		stats->wakeP99Ns	= percentile(w->wakeHist, w->rounds, 0.99);
+		stats->wakeP999Ns	= percentile(w->wakeHist, w->rounds, 0.999);
+		stats->wakeMaxNs	= w->wakeMax;
+		stats->writeP50Ns	= percentile(w->writeHist, w->rounds, 0.5);
+		stats->writeP99Ns	= percentile(w->writeHist, w->rounds, 0.99);
+		stats->writeP999Ns	= percentile(w->writeHist, w->rounds, 0.999);
+		stats->writeMaxNs	= w->writeMax;
+		stats->priority		= w->priority;
+		stats->cpu			= w->cpu;
+	}
+
+	if (reset)
+	{
+		for (i = 0; i < LATENCY_BUCKETS; i++)
+			w->wakeHist[i] = w->writeHist[i] = 0;
+
+		w->rounds = 0;
+		w->wakeMax = 0;
+		w->writeMax = 0;
+	}
+
+	pthread_mutex_unlock(&w->lock);
+
+	leave(dev);
+	return 0;
+}
@@ -0,0 +1,129 @@
+/*************************************************************************
+ * pca9685bench.c
+ *
+ * Runs the basic operations against a fake bus and reports what each of
+ * them costs on the wire. Build and run with "make bench".
+ *
+ * This software is a devLib extension to wiringPi <http://wiringpi.com/>
+ * and enables it to control the Adafruit PCA9685 16-Channel 12-bit
+ * PWM/Servo Driver <http://www.adafruit.com/products/815> via I2C interface.
+ *
+ * Copyright (c) 2014 Reinhard Sprung
+ *
+ * If you have questions or improvements email me at
+ * reinhard.sprung[at]gmail.com
+ *
+ * This software is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * The given code is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You can view the contents of the licence at <http://www.gnu.org/licenses/>.
+ **************************************************************************
+ */
+
+#include "pca9685.h"
+
+#include <stdio.h>
+
+#define RUNS 1000
+#define HERTZ 50
+
+
+static int bus, fd;
+
+
+/**
+ * pwmWrite stages a single pin and commits it
+ */
+static void pwmWrite(int pin, int value)
+{
+	pca9685FramePWM(fd, pin, value);
+	pca9685FrameCommit(fd);
+}
+
+static void pwmChanged(int i)		{ pwmWrite(i % 16, 100 + i % 3000); }
+static void pwmUnchanged(int i)		{ pwmWrite(0, 2000); }
+static void pwmOnOff(int i)			{ pwmWrite(i % 16, ((i / 16) & 1) ? 4096 : 0); }
+static void pwmWriteTicks(int i)	{ pca9685PWMWrite(fd, i % 16, i % 4096, (i + 1000) % 4096); }
+static void fullOn(int i)			{ pca9685FullOn(fd, i % 16, (i / 16) & 1); }
+static void fullOff(int i)			{ pca9685FullOff(fd, i % 16, (i / 16) & 1); }
+static void reset(int i)			{ pca9685PWMReset(fd); }
+static void freq(int i)				{ pca9685PWMFreq(fd, (i & 1) ? 50 : 60); }
+static void readAll(int i)			{ struct pca9685Pin pins[16]; pca9685ReadAll(fd, pins, 0, 0, 0); }
+
+static void frame(int i)
+{
+	int pin;
+
+	for (pin = 0; pin < 16; pin++)
+		pca9685FramePWM(fd, pin, 100 + (i + pin) % 3000);
+
+	pca9685FrameCommit(fd);
+}
+
+
+struct op
+{
+	const char *name;
+	void (*run)(int i);
+	int runs;
+};
+
+static const struct op ops[] =
+{
+	{ "pwmWrite, changed",		pwmChanged,		RUNS },
+	{ "pwmWrite, unchanged",	pwmUnchanged,	RUNS },
+	{ "pwmWrite, on/off",		pwmOnOff,		RUNS },
+	{ "pca9685PWMWrite",		pwmWriteTicks,	RUNS },
+	{ "pca9685FullOn",			fullOn,			RUNS },
+	{ "pca9685FullOff",			fullOff,		RUNS },
+	{ "pca9685PWMReset",		reset,			RUNS },
+	{ "pca9685PWMFreq",			freq,			20 },
+	{ "frame of 16 pins",		frame,			RUNS },
+	{ "pca9685ReadAll",			readAll,		RUNS },
+};
+
+
+int main(void)
+{
+	struct pca9685FakeStats stats;
+	unsigned long blocked = 0, early = 0;
+	int i, j;
+
+	bus = pca9685BusOpen(0, PCA9685_FAKE);
+	fd = pca9685BusAdd(bus, 0x40, HERTZ);
+	if (fd < 0)
+	{
+		printf("Error in setup\n");
+		return 1;
+	}
+
+	printf("%-22s %10s %10s %10s %10s %10s\n", "per operation", "transfers", "bytes", "us@100k", "us@400k", "us@1M");
+
+	for (i = 0; i < sizeof(ops) / sizeof(ops[0]); i++)
+	{
+		pca9685FakeStats(bus, 0, 1);
+
+		for (j = 0; j < ops[i].runs; j++)
+			ops[i].run(j);
+
+		pca9685FakeStats(bus, &stats, 0);
+
+		double n = ops[i].runs;
+		printf("%-22s %10.2f %10.1f %10.1f %10.1f %10.1f\n", ops[i].name,
+			stats.transfers / n, stats.bytes / n, stats.us[0] / n, stats.us[1] / n, stats.us[2] / n);
+
+		blocked += stats.blocked;
+		early += stats.early;
+	}
+
+	printf("\nblocked writes %lu, early restarts %lu, verify %d\n", blocked, early, pca9685Verify(fd));
+
+	return 0;
+}
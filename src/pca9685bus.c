@@ -0,0 +1,603 @@
+/*************************************************************************
+ * pca9685bus.c
+ *
+ * Several PCA9685 sharing one /dev/i2c-N file descriptor.
+ * Staged frames of all chips on a bus are flushed in a single I2C_RDWR transfer.
+ *
+ * This software is a devLib extension to wiringPi <http://wiringpi.com/>
+ * and enables it to control the Adafruit PCA9685 16-Channel 12-bit
+ * PWM/Servo Driver <http://www.adafruit.com/products/815> via I2C interface.
+ *
+ * Copyright (c) 2014 Reinhard Sprung
+ *
+ * If you have questions or improvements email me at
+ * reinhard.sprung[at]gmail.com
+ *
+ * This software is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * The given code is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You can view the contents of the licence at <http://www.gnu.org/licenses/>.
+ **************************************************************************
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+
+#include "pca9685.h"
+#include "pca9685dev.h"
+
+// The PCA9685 can be wired to these addresses
+#define ADDRESS_MIN 0x40
+#define ADDRESS_MAX 0x7F
+
+
+static atomic_int nextHandle = PCA9685_HANDLE_BASE;
+
+
+/**
+ * Finds a device which was added to a bus at an address
+ */
+static struct pca9685Dev *findDevice(struct pca9685Bus *bus, int i2cAddress)
+{
+	struct pca9685Dev *dev;
+
+	for (dev = pca9685Devices; dev; dev = dev->next)
+		if (dev->bus == bus && dev->address == i2cAddress && dev->id >= PCA9685_HANDLE_BASE)
+			return dev;
+
+	return 0;
+}
+
+/**
+ * Adds a device to a bus and initializes it, or adopts its state if warm is set
+ */
+static int addDevice(int bus, int i2cAddress, float freq, int warm)
+{
+	if (i2cAddress < ADDRESS_MIN || i2cAddress > ADDRESS_MAX)
+		return -1;
+
+	struct pca9685Bus *b = pca9685BusGet(bus);
+	if (!b && !(b = pca9685BusAttach(bus, &pca9685I2cOps)))
+		return -1;
+
+	int handle = -1;
+
+	// Two threads adding the same address must get the same handle
+	pca9685BusLock(b);
+
+	struct pca9685Dev *dev = findDevice(b, i2cAddress);
+
+	// A transport which emulates its chips plugs one in at that address
+	if (!dev && b->ops->attach)
+		b->ops->attach(b, i2cAddress);
+
+	if (dev)
+		handle = dev->id;
+	else if ((dev = pca9685DevAdd(atomic_fetch_add(&nextHandle, 1), b, i2cAddress)))
+		handle = (warm ? pca9685DevAdopt(dev) : pca9685DevInit(dev, freq)) == 0 ? dev->id : -1;
+
+	pca9685BusUnlock(b);
+
+	return handle;
+}
+
+/**
+ * Writes per blocks to each device, all of them in as few combined transfers as possible.
+ * blocks holds per entries for each device in order.
+ */
+static int writeEach(struct pca9685Bus *b, struct pca9685Dev **devs, int count, const struct pca9685Block *blocks, int per)
+{
+	struct i2c_msg msgs[I2C_RDWR_IOCTL_MAX_MSGS];
+	unsigned char buf[I2C_RDWR_IOCTL_MAX_MSGS * (1 + LED_REGS)];
+	unsigned char *p = buf;
+	int i, j, k, first = 0, n = 0, ret = 0;
+
+	for (i = 0; i < count; i++)
+	{
+		const struct pca9685Block *own = blocks + i * per;
+
+		// Without combined transfers, every device writes on its own
+		if (!(b->funcs & I2C_FUNC_I2C))
+		{
+			if (pca9685DevWrite(devs[i], own, per) < 0)
+				ret = -1;
+			continue;
+		}
+
+		for (j = 0; j < per; j++, n++)
+		{
+			msgs[n].addr  = devs[i]->address;
+			msgs[n].flags = 0;
+			msgs[n].len   = own[j].len + 1;
+			msgs[n].buf   = p;
+
+			*p++ = own[j].reg;
+			for (k = 0; k < own[j].len; k++)
+				*p++ = own[j].data[k];
+		}
+
+		// Send when the next device doesn't fit anymore. A chip that doesn't answer
+		// aborts the transfer, so on error everyone tries again on their own.
+		if (i + 1 == count || n + per > I2C_RDWR_IOCTL_MAX_MSGS)
+		{
+			int failed = pca9685Transfer(b, msgs, n) < 0;
+
+			for (; first <= i; first++)
+			{
+				if (!failed)
+					pca9685DevCache(devs[first], blocks + first * per, per);
+				else if (pca9685DevWrite(devs[first], blocks + first * per, per) < 0)
+					ret = -1;
+			}
+
+			n = 0;
+			p = buf;
+		}
+	}
+
+	return ret;
+}
+
+
+/**
+ * Open an I2C bus, eg. "/dev/i2c-1".
+ * Returns the file descriptor of the bus or -1 on error.
+ */
+int pca9685BusSetup(const char *device)
+{
+	return pca9685BusOpen(device, PCA9685_I2CDEV);
+}
+
+/**
+ * Open an I2C bus with a specific transport:
+ * PCA9685_I2CDEV:		i2c-dev ioctls, with combined transfers if the adapter supports them
+ * PCA9685_WIRINGPI:	wiringPiI2C functions, 8 and 16 bit register access only
+ * PCA9685_FAKE:		Registers in memory, no hardware needed. device is ignored
+ *
+ * Returns the file descriptor of the bus (a handle for fake buses) or -1 on error.
+ */
+int pca9685BusOpen(const char *device, int transport)
+{
+	const struct pca9685Ops *ops;
+
+	if (transport == PCA9685_FAKE)
+		return pca9685FakeOpen();
+	else if (transport == PCA9685_I2CDEV)
+		ops = &pca9685I2cOps;
+#ifndef PCA9685_NO_WIRINGPI
+	else if (transport == PCA9685_WIRINGPI)
+		ops = &pca9685WiringPiOps;
+#endif
+	else
+		return -1;
+
+	int fd = open(device, O_RDWR);
+	if (fd < 0)
+		return -1;
+
+	if (!pca9685BusAttach(fd, ops))
+	{
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/**
+ * Add a PCA9685 at the specific i2c address to a bus.
+ * It doesn't use any wiringPi pins and shares the file descriptor of the bus.
+ *
+ * bus:			File descriptor returned by pca9685BusSetup
+ * i2cAddress:	[0x40..0x7F]
+ * freq:		Frequency is limited to about [24..1526] Hertz. Skipped if 0
+ *
+ * Returns a handle to use with all other pca9685 functions (it is not a file descriptor)
+ * or -1 on error. Adding the same address twice returns the same handle.
+ */
+int pca9685BusAdd(int bus, int i2cAddress, float freq)
+{
+	return addDevice(bus, i2cAddress, freq, 0);
+}
+
+/**
+ * Add a running PCA9685 to a bus without touching its outputs, eg. after a restart of
+ * your program. MODE1, MODE2, PRESCALE and all pins are read from the chip and kept as they are.
+ * Returns a handle like pca9685BusAdd or -1 on error.
+ */
+int pca9685BusAdopt(int bus, int i2cAddress)
+{
+	return addDevice(bus, i2cAddress, 0, 1);
+}
+
+/**
+ * Initializes many PCA9685 on a bus at once. All chips go to sleep and get their prescale in one
+ * pass, wake up in the next and are restarted together after a single wait for the oscillators.
+ * MODE1 starts over with auto-increment and ALLCALL, so group memberships are lost.
+ *
+ * addresses:	count addresses in [0x40..0x7F]
+ * freq:		Frequency for all of them, must be > 0
+ * handles:		Receives a handle per address, -1 if that chip didn't respond. Optional
+ *
+ * Returns the number of chips that were initialized or -1 on error.
+ */
+int pca9685BusInit(int bus, const int *addresses, int count, float freq, int *handles)
+{
+	struct pca9685Dev *devs[ADDRESS_MAX - ADDRESS_MIN + 1];
+	struct pca9685Block blocks[2 * (ADDRESS_MAX - ADDRESS_MIN + 1)];
+	unsigned char data[2 * (ADDRESS_MAX - ADDRESS_MIN + 1)];
+	int i, n = 0;
+
+	if (count < 1 || count > ADDRESS_MAX - ADDRESS_MIN + 1 || freq <= 0)
+		return -1;
+
+	struct pca9685Bus *b = pca9685BusGet(bus);
+	if (!b && !(b = pca9685BusAttach(bus, &pca9685I2cOps)))
+		return -1;
+
+	pca9685BusLock(b);
+
+	// Sleep with auto-increment and program the prescale
+	for (i = 0; i < count; i++)
+	{
+		struct pca9685Dev *dev = findDevice(b, addresses[i]);
+
+		if (!dev && addresses[i] >= ADDRESS_MIN && addresses[i] <= ADDRESS_MAX)
+			dev = pca9685DevAdd(atomic_fetch_add(&nextHandle, 1), b, addresses[i]);
+
+		if (handles)
+			handles[i] = -1;
+
+		if (!dev)
+			continue;
+
+		data[2 * n]		= 0x31;						// Sleep, auto-increment, ALLCALL
+		data[2 * n + 1] = pca9685DevPrescale(dev, freq);
+
+		blocks[2 * n]	  = (struct pca9685Block) { PCA9685_MODE1,	  1, data + 2 * n };
+		blocks[2 * n + 1] = (struct pca9685Block) { PCA9685_PRESCALE, 1, data + 2 * n + 1 };
+
+		devs[n++] = dev;
+	}
+
+	writeEach(b, devs, n, blocks, 2);
+
+	// Fill the register caches. Chips that don't answer are left out from here on.
+	int ready = 0;
+	for (i = 0; i < n; i++)
+		if (pca9685Resync(devs[i]->id) == 0)
+			devs[ready++] = devs[i];
+
+	// Wake up together, wait once for all oscillators and restart PWM
+	for (i = 0; i < ready; i++)
+	{
+		data[i] = devs[i]->mode1 & 0x6F;
+		blocks[i] = (struct pca9685Block) { PCA9685_MODE1, 1, data + i };
+	}
+
+	writeEach(b, devs, ready, blocks, 1);
+
+	unsigned long long settle = pca9685Now() + 500000;
+	struct timespec ts = { settle / 1000000000ull, settle % 1000000000ull };
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0) == EINTR)
+		;
+
+	for (i = 0; i < ready; i++)
+		data[i] = devs[i]->mode1 | 0x80;
+
+	writeEach(b, devs, ready, blocks, 1);
+
+	pca9685BusUnlock(b);
+
+	if (handles)
+		for (i = 0; i < count; i++)
+		{
+			struct pca9685Dev *dev = findDevice(b, addresses[i]);
+			int j;
+
+			for (j = 0; dev && j < ready; j++)
+				if (devs[j] == dev)
+					handles[i] = dev->id;
+		}
+
+	return ready;
+}
+
+/**
+ * Flushes the staged frames of all chips on a bus.
+ * Every chip gets its own messages (usually one), all of them go out in a single
+ * combined transfer. The kernel allows 42 messages per transfer, so very large
+ * setups need a few more.
+ * Returns the number of changed pins or -1 on error.
+ */
+int pca9685BusCommit(int bus)
+{
+	return pca9685BusFlush(bus, 0);
+}
+
+/**
+ * Sends a batch of messages in one transfer. Only if it got through, the chips cache the
+ * blocks and unstage the pins they planned (sent), otherwise the pins stay staged for the next flush.
+ */
+static int sendBatch(struct pca9685Bus *b, struct i2c_msg *msgs, const struct pca9685Block *blocks,
+					 struct pca9685Dev **owner, const int *sent, int n)
+{
+	int i;
+
+	if (pca9685Transfer(b, msgs, n) < 0)
+		return -1;
+
+	for (i = 0; i < n; i++)
+	{
+		pca9685DevCache(owner[i], &blocks[i], 1);
+		pca9685DevSent(owner[i], sent[i]);
+	}
+
+	return 0;
+}
+
+/**
+ * Picks all staged pins of a device
+ */
+static int pickStaged(struct pca9685Dev *dev, void *arg)
+{
+	return dev->staged;
+}
+
+/**
+ * Picks the staged pins of a device in async mode
+ */
+static int pickAsync(struct pca9685Dev *dev, void *arg)
+{
+	return dev->queue ? dev->staged : 0;
+}
+
+/**
+ * Flushes the staged frames of all chips on a bus, or only of those in async mode
+ */
+int pca9685BusFlush(int bus, int asyncOnly)
+{
+	struct pca9685Bus *b = pca9685BusGet(bus);
+	if (!b)
+		return -1;
+
+	return pca9685BusFlushPick(b, asyncOnly ? pickAsync : pickStaged, 0);
+}
+
+/**
+ * Flushes the staged pins that pick returns for each chip on a bus with staged pins (0: none of them).
+ * Other staged pins stay staged. Returns the number of changed pins or -1 on error.
+ */
+int pca9685BusFlushPick(struct pca9685Bus *b, pca9685Pick pick, void *arg)
+{
+	struct i2c_msg msgs[I2C_RDWR_IOCTL_MAX_MSGS];
+	unsigned char buf[I2C_RDWR_IOCTL_MAX_MSGS * (1 + LED_REGS)];
+	struct pca9685Block blocks[I2C_RDWR_IOCTL_MAX_MSGS];
+	struct pca9685Dev *owner[I2C_RDWR_IOCTL_MAX_MSGS];
+	int sent[I2C_RDWR_IOCTL_MAX_MSGS];
+	struct pca9685Dev *dev;
+	unsigned char *p = buf;
+	int i, j, n = 0, total = 0, ret = 0;
+
+	pca9685BusLock(b);
+
+	for (dev = pca9685Devices; dev; dev = dev->next)
+	{
+		if (dev->bus != b || !dev->staged)
+			continue;
+
+		int mask = pick(dev, arg) & dev->staged;
+		if (!mask)
+			continue;
+
+		// The cache of a chip that failed before may be wrong, don't plan against it
+		if (pca9685DevRecover(dev) < 0)
+		{
+			ret = -1;
+			continue;
+		}
+
+		struct pca9685Block plan[LED_REGS / 2];
+		unsigned char target[LED_REGS];
+		int pins;
+		int count = pca9685DevPlan(dev, mask, target, plan, &pins);
+		if (!count)
+		{
+			dev->staged &= ~mask;
+			continue;
+		}
+
+		total += pins;
+
+		// These can't be batched, send them on their own
+		if (!(b->funcs & I2C_FUNC_I2C) || !(dev->mode1 & 0x20) || dev->address < 0)
+		{
+			if (pca9685DevWrite(dev, plan, count) < 0)
+				ret = -1;
+			else
+				pca9685DevSent(dev, mask);
+			continue;
+		}
+
+		// Keep the messages of a chip in the same transfer. A failed one left its chips
+		// degraded, they resync before their next write.
+		if (n + count > I2C_RDWR_IOCTL_MAX_MSGS || p + count + LED_REGS + 1 > buf + sizeof(buf))
+		{
+			if (sendBatch(b, msgs, blocks, owner, sent, n) < 0)
+				ret = -1;
+
+			n = 0;
+			p = buf;
+		}
+
+		for (i = 0; i < count; i++, n++)
+		{
+			msgs[n].addr  = dev->address;
+			msgs[n].flags = 0;
+			msgs[n].len   = plan[i].len + 1;
+			msgs[n].buf   = p;
+
+			// The cache is updated from the copy, target belongs to this chip only
+			blocks[n].reg  = plan[i].reg;
+			blocks[n].len  = plan[i].len;
+			blocks[n].data = p + 1;
+			owner[n] = dev;
+			sent[n] = mask;
+
+			*p++ = plan[i].reg;
+			for (j = 0; j < plan[i].len; j++)
+				*p++ = plan[i].data[j];
+		}
+	}
+
+	if (n && sendBatch(b, msgs, blocks, owner, sent, n) < 0)
+		ret = -1;
+
+	pca9685BusUnlock(b);
+
+	return ret < 0 ? -1 : total;
+}
+
+/**
+ * Sets how a bus handles failed transactions (fd may be a device or a bus). A transaction
+ * is tried up to attempts times. The first retry waits backoffUs, every further one twice as long.
+ * No retry starts later than deadlineUs after the first try (0: no deadline), so a chip that
+ * is gone costs at most that plus one transaction. Returns 0 on success or -1 on error.
+ */
+int pca9685RetryPolicy(int fd, int attempts, int deadlineUs, int backoffUs)
+{
+	if (attempts < 1 || deadlineUs < 0 || backoffUs < 0)
+		return -1;
+
+	struct pca9685Bus *bus = pca9685BusGet(fd);
+	if (!bus)
+	{
+		struct pca9685Dev *dev = pca9685DevGet(fd);
+		if (!dev)
+			return -1;
+
+		bus = dev->bus;
+	}
+
+	pca9685BusLock(bus);
+
+	bus->attempts = attempts;
+	bus->deadlineUs = deadlineUs;
+	bus->backoffUs = backoffUs;
+
+	pca9685BusUnlock(bus);
+	return 0;
+}
+
+/**
+ * Decides if a transaction that failed attempt times and started at start (ns) is tried again.
+ * If so, it waits for the backoff and returns 1. Returns 0 if the policy doesn't allow another try.
+ */
+int pca9685BusRetry(struct pca9685Bus *bus, int attempt, unsigned long long start)
+{
+	if (attempt >= bus->attempts)
+		return 0;
+
+	// Doubles with each retry, the shift is limited so it can't overflow
+	unsigned long long backoff = (unsigned long long)bus->backoffUs * 1000 << (attempt < 20 ? attempt - 1 : 19);
+	unsigned long long next = pca9685Now() + backoff;
+
+	if (bus->deadlineUs && next > start + bus->deadlineUs * 1000ull)
+		return 0;
+
+	if (backoff)
+	{
+		struct timespec ts = { next / 1000000000ull, next % 1000000000ull };
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0) == EINTR)
+			;
+	}
+
+	return 1;
+}
+
+/**
+ * Updates the register caches of all chips on a bus which listen to a group address.
+ * Values of the pins that were posted or staged before would overwrite the group write, they are dropped.
+ * Returns the number of members.
+ */
+static int cacheMembers(struct pca9685Bus *bus, int i2cAddress, int pin, const struct pca9685Block *block)
+{
+	int mask = pca9685PinMask(pin);
+
+	struct pca9685Dev *dev;
+	int group, members = 0;
+
+	for (dev = pca9685Devices; dev; dev = dev->next)
+	{
+		if (dev->bus != bus)
+			continue;
+
+		for (group = 0; group < 4; group++)
+		{
+			int reg = group ? group - 1 : 3;		// SUBADR1..3, ALLCALLADR
+
+			if ((dev->mode1 & GROUP_BIT(group)) && dev->subadr[reg] == i2cAddress << 1)
+			{
+				pca9685DevCache(dev, block, 1);
+				pca9685AsyncDrop(dev, mask);
+				dev->staged &= ~mask;
+				members++;
+				break;
+			}
+		}
+	}
+
+	return members;
+}
+
+/**
+ * Writes on and off values of a pin to all chips listening to a group address
+ * (see pca9685GroupJoin) in a single message, no matter how many there are.
+ * Values are 16 bit of data, like the ones pca9685PWMRead returns. Pin 16 writes LEDALL.
+ * The register caches of all members on this bus are updated, their posted and staged values of the pin dropped.
+ * Returns the number of members on this bus or -1 on error.
+ */
+int pca9685GroupWrite(int bus, int i2cAddress, int pin, int on, int off)
+{
+	struct pca9685Bus *b = pca9685BusGet(bus);
+	if (!b || pin < 0 || pin > PIN_ALL || i2cAddress < 0 || i2cAddress > 0x7F)
+		return -1;
+
+	unsigned char data[4] = { on & 0xFF, (on >> 8) & 0x1F, off & 0xFF, (off >> 8) & 0x1F };
+	struct pca9685Block block = { baseReg(pin), 4, data };
+
+	int members = -1;
+
+	pca9685BusLock(b);
+	if (pca9685BusWrite(b, i2cAddress, block.reg, data, 4) == 0)
+		members = cacheMembers(b, i2cAddress, pin, &block);
+	pca9685BusUnlock(b);
+
+	return members;
+}
+
+/**
+ * Writes a value with the same meaning as pwmWrite to all chips listening to a group address.
+ * Unlike pwmWrite, full-on and full-off clear the PWM values since members may differ.
+ */
+int pca9685GroupPWM(int bus, int i2cAddress, int pin, int value)
+{
+	if (value >= 4096)
+		return pca9685GroupWrite(bus, i2cAddress, pin, 0x1000, 0);
+	else if (value > 0)
+		return pca9685GroupWrite(bus, i2cAddress, pin, 0, value);
+	else
+		return pca9685GroupWrite(bus, i2cAddress, pin, 0, 0x1000);
+}
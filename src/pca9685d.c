@@ -0,0 +1,228 @@
+/*************************************************************************
+ * pca9685d.c
+ *
+ * Daemon which owns the buses and chips given on its command line and
+ * publishes their channels in shared memory. Any number of processes can
+ * store values there with the pca9685Shm functions, the daemon flushes
+ * what changed once per round, one transfer per bus. Build with "make daemon".
+ *
+ *   pca9685d [-n name] [-r hz] device:address[:freq] ...
+ *
+ * device is /dev/i2c-N or "fake", address the I2C address of a chip. With
+ * a frequency the chip is set up, without it it's adopted as it runs.
+ *
+ * This software is a devLib extension to wiringPi <http://wiringpi.com/>
+ * and enables it to control the Adafruit PCA9685 16-Channel 12-bit
+ * PWM/Servo Driver <http://www.adafruit.com/products/815> via I2C interface.
+ *
+ * Copyright (c) 2014 Reinhard Sprung
+ *
+ * If you have questions or improvements email me at
+ * reinhard.sprung[at]gmail.com
+ *
+ * This software is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * The given code is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You can view the contents of the licence at <http://www.gnu.org/licenses/>.
+ **************************************************************************
+ */
+
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "pca9685.h"
+#include "pca9685dev.h"
+
+#define MAX_BUSES 16
+#define MAX_CHIPS 256
+#define DEFAULT_HZ 200
+
+
+/**
+ * A chip of the daemon
+ */
+struct chip
+{
+	int fd;
+	int bus;						// Index into buses
+	unsigned int seq;				// Seq of the values last flushed
+	unsigned int copied;			// Seq of the values staged
+};
+
+static struct
+{
+	const char *device;
+	int fd;
+} buses[MAX_BUSES];
+
+static struct chip chips[MAX_CHIPS];
+static int nbuses, nchips;
+
+static volatile sig_atomic_t running = 1;
+
+
+static void stop(int sig)
+{
+	running = 0;
+}
+
+/**
+ * Opens a bus once, returns its index or -1
+ */
+static int openBus(const char *device)
+{
+	int i;
+
+	for (i = 0; i < nbuses; i++)
+		if (!strcmp(buses[i].device, device))
+			return i;
+
+	if (nbuses == MAX_BUSES)
+		return -1;
+
+	int fd = strcmp(device, "fake") ? pca9685BusOpen(device, PCA9685_I2CDEV) : pca9685BusOpen(0, PCA9685_FAKE);
+	if (fd < 0)
+		return -1;
+
+	buses[nbuses].device = device;
+	buses[nbuses].fd = fd;
+
+	return nbuses++;
+}
+
+/**
+ * Sets up a chip from device:address[:freq]. Returns 0 on success or -1 on error.
+ */
+static int addChip(char *spec)
+{
+	char *colon = strchr(spec, ':');
+	if (!colon || nchips == MAX_CHIPS)
+		return -1;
+
+	*colon = 0;
+	char *end;
+	int address = strtol(colon + 1, &end, 0);
+	float freq = *end == ':' ? atof(end + 1) : 0;
+
+	int bus = openBus(spec);
+	if (bus < 0)
+		return -1;
+
+	int fd = freq > 0 ? pca9685BusAdd(buses[bus].fd, address, freq) : pca9685BusAdopt(buses[bus].fd, address);
+	if (fd < 0)
+		return -1;
+
+	chips[nchips].fd = fd;
+	chips[nchips].bus = bus;
+	nchips++;
+
+	return 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: pca9685d [-n name] [-r hz] device:address[:freq] ...\n");
+	exit(1);
+}
+
+
+int main(int argc, char **argv)
+{
+	const char *name = PCA9685_SHM_NAME;
+	float hz = DEFAULT_HZ;
+	size_t size;
+	int i, opt;
+
+	while ((opt = getopt(argc, argv, "n:r:")) != -1)
+	{
+		if (opt == 'n')
+			name = optarg;
+		else if (opt == 'r' && atof(optarg) > 0)
+			hz = atof(optarg);
+		else
+			usage();
+	}
+
+	if (optind == argc)
+		usage();
+
+	for (i = optind; i < argc; i++)
+	{
+		if (addChip(argv[i]) < 0)
+		{
+			fprintf(stderr, "pca9685d: can't set up %s\n", argv[i]);
+			return 1;
+		}
+	}
+
+	int fds[MAX_CHIPS], owners[MAX_CHIPS];
+	for (i = 0; i < nchips; i++)
+	{
+		fds[i] = chips[i].fd;
+		owners[i] = chips[i].bus;
+	}
+
+	struct pca9685ShmHeader *shm = pca9685ShmCreate(name, fds, owners, nchips, &size);
+	if (!shm)
+	{
+		perror("pca9685d: shared memory");
+		return 1;
+	}
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = stop;
+	sigaction(SIGINT, &sa, 0);
+	sigaction(SIGTERM, &sa, 0);
+
+	unsigned long long period = (unsigned long long)(1e9 / hz);
+	unsigned long long next = pca9685Now();
+
+	while (running)
+	{
+		int staged[MAX_BUSES] = { 0 }, flushed[MAX_BUSES] = { 0 }, any = 0;
+
+		for (i = 0; i < nchips; i++)
+			staged[chips[i].bus] |= pca9685ShmCollect(&shm->chip[i], chips[i].fd, chips[i].seq, &chips[i].copied);
+
+		// One transfer per bus for all chips that changed
+		for (i = 0; i < nbuses; i++)
+			if (staged[i] && pca9685BusFlush(buses[i].fd, 0) >= 0)
+				flushed[i] = any = 1;
+
+		// Chips of a bus whose flush failed copy their values again next round
+		for (i = 0; i < nchips; i++)
+			if (flushed[chips[i].bus])
+				chips[i].seq = chips[i].copied;
+
+		if (any)
+			atomic_fetch_add(&shm->flushes, 1);
+
+		// Absolute deadlines, rounds that are missed completely are skipped
+		next += period;
+		unsigned long long now = pca9685Now();
+		while (next < now)
+			next += period;
+
+		struct timespec ts = { next / 1000000000ull, next % 1000000000ull };
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0);
+	}
+
+	munmap(shm, size);
+	shm_unlink(name);
+
+	return 0;
+}
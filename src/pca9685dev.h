@@ -0,0 +1,316 @@
+/*************************************************************************
+ * pca9685dev.h
+ *
+ * Internal device state shared by the pca9685 source files.
+ * This header is not installed.
+ *
+ * This software is a devLib extension to wiringPi <http://wiringpi.com/>
+ * and enables it to control the Adafruit PCA9685 16-Channel 12-bit
+ * PWM/Servo Driver <http://www.adafruit.com/products/815> via I2C interface.
+ *
+ * Copyright (c) 2014 Reinhard Sprung
+ *
+ * If you have questions or improvements email me at
+ * reinhard.sprung[at]gmail.com
+ *
+ * This software is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * The given code is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You can view the contents of the licence at <http://www.gnu.org/licenses/>.
+ **************************************************************************
+ */
+
+#ifndef PCA9685DEV_H
+#define PCA9685DEV_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+// Setup registers
+#define PCA9685_MODE1 0x0
+#define PCA9685_MODE2 0x1
+#define PCA9685_SUBADR1 0x2
+#define PCA9685_ALLCALLADR 0x5
+#define PCA9685_PRESCALE 0xFE
+
+// MODE2 bit: outputs change on ACK instead of STOP
+#define MODE2_OCH 0x08
+
+// Oscillator range in Hz. EXTCLK takes up to 50 MHz, below 1 MHz the period of prescale 255 wouldn't fit an int (ns).
+#define OSC_MIN 1000000
+#define OSC_MAX 50000000
+
+// MODE1, MODE2, PRESCALE, SUBADR1..3 and ALLCALLADR
+#define MODE_REGS 7
+
+// MODE1 bit which enables a group address. Group 0 is ALLCALL (bit 0), groups 1..3 are SUB1..3 (bits 3..1)
+#define GROUP_BIT(group) ((group) ? 0x10 >> (group) : 0x01)
+
+// Define first LED and all LED. We calculate the rest
+#define LED0_ON_L 0x6
+#define LEDALL_ON_L 0xFA
+
+#define PIN_ALL 16
+
+// Number of LED registers (4 per pin)
+#define LED_REGS (4 * PIN_ALL)
+
+// Number of registers from MODE1 up to the last LED
+#define FRONT_REGS (LED0_ON_L + LED_REGS)
+
+// Starting a new message costs a repeated start, the address and the register byte,
+// plus some work per message in the I2C driver. Gaps of unchanged registers up to
+// this length are cheaper to write along.
+#define MERGE_GAP 3
+
+// Handles of devices added to a shared bus start here. The kernel never hands out
+// file descriptors this large (fs.nr_open is below 2^30), so they can't collide
+// with the file descriptors pca9685Setup returns.
+#define PCA9685_HANDLE_BASE 0x40000000
+
+// Handles of fake buses, which have no file descriptor
+#define PCA9685_FAKE_BASE 0x20000000
+
+struct i2c_msg;
+struct pca9685Bus;
+
+
+/**
+ * Transport of a bus.
+ * transfer sends messages of struct i2c_msg in one combined transaction with repeated starts,
+ * it's only called if funcs contains I2C_FUNC_I2C. read and write access consecutive registers
+ * of a chip with auto-increment. An address of -1 means the one the bus is already set to.
+ * All return 0 on success or -1 on error.
+ */
+struct pca9685Ops
+{
+	const char *name;
+	unsigned long (*funcs)(struct pca9685Bus *bus);
+	int (*transfer)(struct pca9685Bus *bus, struct i2c_msg *msgs, int count);
+	int (*read)(struct pca9685Bus *bus, int address, int reg, unsigned char *data, int len);
+	int (*write)(struct pca9685Bus *bus, int address, int reg, const unsigned char *data, int len);
+	void (*attach)(struct pca9685Bus *bus, int address);	// Optional, pca9685BusAdd or Adopt adds a device at address
+};
+
+
+/**
+ * An open /dev/i2c-N file descriptor (or a fake bus), shared by all devices on it
+ */
+struct pca9685Bus
+{
+	int fd;
+	const struct pca9685Ops *ops;
+	void *priv;						// State of the transport, eg. the registers of a fake bus
+	unsigned long funcs;			// I2C adapter functionality
+	int slave;						// Address set with I2C_SLAVE, -1 if unknown
+	struct pca9685Writer *writer;	// Async writer thread, if any device on the bus uses it
+	pthread_mutex_t lock;			// Recursive, only taken in thread-safe mode
+	int depth;						// Nesting level of the thread holding the lock
+	unsigned long long since;		// When the outermost lock was taken
+	struct pca9685LockStats stats;
+	struct pca9685Counters counters;	// Every transaction on the bus
+	int attempts;					// Retry policy: tries per transaction (0 or 1: no retries),
+	int deadlineUs;					// no new try later than this after the first one (0: none),
+	int backoffUs;					// wait before the second try, doubled for each further one
+	struct pca9685Bus *next;
+};
+
+/**
+ * Shadow copy of the chip's registers.
+ * Every write goes through here so we never have to read a register back
+ * from the chip before we modify it.
+ */
+struct pca9685Dev
+{
+	int id;							// Handle used by the public functions
+	int address;					// -1 if the device wasn't created by a setup function
+	struct pca9685Bus *bus;
+	int mode1;						// Restart bit is never cached, it clears itself
+	int mode2;
+	int prescale;
+	int osc;						// Oscillator frequency in Hz
+	int period;						// PWM period in ns, from prescale and osc
+	unsigned long long usTicks;		// Ticks per microsecond, 32.32 fixed point
+	unsigned long long settle;		// When the oscillator is stable after a retune, 0 if none is pending
+	unsigned long long retuneStart;
+	int restart;					// Restart PWM when the pending retune finishes
+	struct pca9685RetuneStats retune;
+	int subadr[4];					// SUBADR1..3, ALLCALLADR
+	unsigned char led[LED_REGS];	// LEDn_ON_L, LEDn_ON_H, LEDn_OFF_L, LEDn_OFF_H
+	unsigned char frame[LED_REGS];	// Back buffer for staged values, same layout as led
+	int staged;						// Bit n is set if pin n has a value in frame
+	int latch;						// Latch mode to switch to with the next commit, -1 to keep it
+	unsigned char mode2Frame;		// Outgoing MODE2 when the latch mode changes
+	int stagger;					// pwmWrite values start at phase instead of tick 0
+	int phase[PIN_ALL];				// On-tick of each pin in stagger mode
+	struct pca9685Queue *_Atomic queue;	// Updates waiting for the async writer, 0 if not in async mode
+	atomic_int inside;				// Callers of async functions using the queue, pca9685AsyncStop waits for them
+	struct pca9685Counters counters;	// Transactions addressed to this chip
+	int degraded;					// A transaction failed for good, resync before the next write
+	struct pca9685Histogram hist[PCA9685_OPS];
+	struct pca9685Dev *next;
+};
+
+/**
+ * Consecutive registers which are written in a single I2C message
+ */
+struct pca9685Block
+{
+	int reg;
+	int len;
+	const unsigned char *data;
+};
+
+
+// Shared memory of pca9685d. Version changes whenever the layout does.
+#define PCA9685_SHM_NAME "/pca9685"
+#define PCA9685_SHM_MAGIC 0x50434139
+#define PCA9685_SHM_VERSION 2
+#define PCA9685_SHM_KEEP 0xFFFF			// Channel value which leaves the pin alone
+
+/**
+ * A chip in shared memory. Clients take lock, a robust process-shared mutex, so one that dies
+ * while writing doesn't block the others. Inside, they move seq from even to odd, store their
+ * values and make it even again. The daemon never takes the lock: it copies the values when seq
+ * is even and differs from what it saw last, and checks it didn't change meanwhile.
+ */
+struct pca9685ShmChip
+{
+	pthread_mutex_t lock;
+	_Atomic unsigned int seq;
+	int bus;						// Number of the bus in the order of the daemon's arguments
+	int address;
+	_Atomic unsigned short value[PIN_ALL];	// pwmWrite values (0..4096) or PCA9685_SHM_KEEP
+};
+
+/**
+ * Start of the shared memory, followed by chips entries
+ */
+struct pca9685ShmHeader
+{
+	unsigned int magic;
+	unsigned int version;
+	int chips;
+	int pid;						// Of the daemon
+	_Atomic unsigned long long flushes;	// Rounds of the daemon that wrote something
+	struct pca9685ShmChip chip[];
+};
+
+// Show files, little endian. The header is followed by the events, sorted by time, and the chips.
+#define PCA9685_SHOW_MAGIC 0x48533950	// "P9SH"
+#define PCA9685_SHOW_VERSION 1
+
+struct pca9685ShowHeader
+{
+	unsigned int magic;
+	unsigned short version;
+	unsigned short headerSize;		// Events start here
+	unsigned int tickUs;			// Unit of the event times
+	unsigned int chips;
+	unsigned long long events;
+	unsigned int duration;			// Time of the last event in ticks
+	unsigned int reserved;
+};
+
+/**
+ * A pin of a chip changed at time. Events with the same time make up a frame.
+ */
+struct pca9685ShowEvent
+{
+	unsigned int time;				// Ticks since the start
+	unsigned short channel;			// Chip * 16 + pin
+	unsigned short value;			// pwmWrite value, 0..4096
+};
+
+/**
+ * Where a chip of a show was recorded
+ */
+struct pca9685ShowChip
+{
+	unsigned short bus;				// Buses numbered in the order they showed up
+	unsigned short address;
+};
+
+// Prepended under a lock, loads of the head acquire the devices it publishes
+extern struct pca9685Dev *_Atomic pca9685Devices;
+
+// Transports
+extern const struct pca9685Ops pca9685I2cOps;
+extern const struct pca9685Ops pca9685WiringPiOps;
+extern const struct pca9685Ops pca9685FakeOps;
+extern int pca9685FakeOpen(void);
+
+// Devices and buses
+extern struct pca9685Bus *pca9685BusAttach(int fd, const struct pca9685Ops *ops);
+extern struct pca9685Bus *pca9685BusGet(int fd);
+extern int pca9685BusSelect(struct pca9685Bus *bus, int address);
+extern int pca9685BusWrite(struct pca9685Bus *bus, int address, int reg, const unsigned char *data, int len);
+extern struct pca9685Dev *pca9685DevAdd(int id, struct pca9685Bus *bus, int address);
+extern struct pca9685Dev *pca9685DevGet(int id);
+extern int pca9685DevInit(struct pca9685Dev *dev, float freq);
+extern int pca9685DevAdopt(struct pca9685Dev *dev);
+extern int pca9685DevPrescale(struct pca9685Dev *dev, float freq);
+extern int pca9685DevTicks(struct pca9685Dev *dev, int us);
+extern int pca9685DevRetune(struct pca9685Dev *dev, int prescale, int flags);
+
+// Writes. Stage puts a pwmWrite value of a pin into dev->frame, Plan puts the outgoing values
+// into target and returns the number of blocks (at most LED_REGS / 2), Sent unstages the pins once
+// they got through, Commit plans and writes the staged pins of a mask, PWM stages and commits a
+// single pin (pwmWrite), Cache stores blocks that were sent by someone else.
+extern void pca9685DevStage(struct pca9685Dev *dev, int pin, int value);
+extern int pca9685DevPlan(struct pca9685Dev *dev, int mask, unsigned char *target, struct pca9685Block *blocks, int *pins);
+extern void pca9685DevSent(struct pca9685Dev *dev, int mask);
+extern int pca9685DevWrite(struct pca9685Dev *dev, const struct pca9685Block *blocks, int count);
+extern int pca9685DevCommit(struct pca9685Dev *dev, int mask);
+extern int pca9685DevPWM(struct pca9685Dev *dev, int pin, int value);
+extern void pca9685DevCache(struct pca9685Dev *dev, const struct pca9685Block *blocks, int count);
+extern int pca9685BusFlush(int bus, int asyncOnly);
+
+// FlushPick flushes the pins a callback picks of each device on a bus, in one transfer like BusFlush
+typedef int (*pca9685Pick)(struct pca9685Dev *dev, void *arg);
+extern int pca9685BusFlushPick(struct pca9685Bus *bus, pca9685Pick pick, void *arg);
+
+// Instrumentation. Transfer, Read and Write go through the transport and count
+// the transaction, Time adds the time since start to the histogram of an operation.
+extern int pca9685Transfer(struct pca9685Bus *bus, struct i2c_msg *msgs, int count);
+extern int pca9685Read(struct pca9685Bus *bus, int address, int reg, unsigned char *data, int len);
+extern int pca9685Write(struct pca9685Bus *bus, int address, int reg, const unsigned char *data, int len);
+extern void pca9685DevTime(struct pca9685Dev *dev, int op, unsigned long long start);
+
+// Time of the monotonic clock in nanoseconds, for deadlines and the statistics
+extern unsigned long long pca9685Now(void);
+
+// Error recovery. BusRetry waits for the next try of a failed transaction and returns 1, or 0 if the
+// policy of the bus doesn't allow another one. DevRecover resyncs a degraded device.
+extern int pca9685BusRetry(struct pca9685Bus *bus, int attempt, unsigned long long start);
+extern int pca9685DevRecover(struct pca9685Dev *dev);
+
+// Show recorder. While pca9685Recording is set, Cache hands the pins of a mask it changed to Capture.
+extern atomic_int pca9685Recording;
+extern void pca9685RecordCapture(struct pca9685Dev *dev, int mask);
+
+// Async writer. Synchronous writes of pins call Drop, so updates posted before them can't overtake them.
+extern void pca9685AsyncDrop(struct pca9685Dev *dev, int mask);
+
+// Thread-safe mode. Lock calls do nothing unless it is enabled or a thread of the library requires it.
+extern void pca9685LockRequire(int enable);
+extern void pca9685BusLock(struct pca9685Bus *bus);
+extern void pca9685BusUnlock(struct pca9685Bus *bus);
+extern struct pca9685Dev *pca9685DevLock(int id);
+extern void pca9685DevUnlock(struct pca9685Dev *dev);
+
+// Shared memory, daemon side. Create sets up the chips of pca9685d, Collect stages what a client changed.
+extern struct pca9685ShmHeader *pca9685ShmCreate(const char *name, const int *fds, const int *buses, int count, size_t *size);
+extern int pca9685ShmCollect(struct pca9685ShmChip *c, int fd, unsigned int last, unsigned int *seq);
+
+extern int pca9685PinMask(int pin);
+extern int baseReg(int pin);
+
+#endif
@@ -0,0 +1,552 @@
+/*************************************************************************
+ * pca9685fake.c
+ *
+ * Transport without hardware. A fake bus emulates its chips in memory, so the
+ * library runs on hosts without I2C. The chips follow the datasheet where the
+ * driver depends on it, and the bus estimates how long its traffic would take.
+ *
+ * This software is a devLib extension to wiringPi <http://wiringpi.com/>
+ * and enables it to control the Adafruit PCA9685 16-Channel 12-bit
+ * PWM/Servo Driver <http://www.adafruit.com/products/815> via I2C interface.
+ *
+ * Copyright (c) 2014 Reinhard Sprung
+ *
+ * If you have questions or improvements email me at
+ * reinhard.sprung[at]gmail.com
+ *
+ * This software is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * The given code is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You can view the contents of the licence at <http://www.gnu.org/licenses/>.
+ **************************************************************************
+ */
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <linux/i2c.h>
+
+#include "pca9685.h"
+#include "pca9685dev.h"
+
+// 7 bit addresses
+#define ADDRESSES 128
+
+// With auto-increment, the register pointer wraps from the last LED to MODE1
+#define LAST_LED (LED0_ON_L + LED_REGS - 1)
+
+// MODE1 bits
+#define RESTART 0x80
+#define EXTCLK	0x40
+#define SLEEP	0x10
+
+// MODE2 bit: outputs change on ACK
+#define OCH		0x08
+
+// The oscillator needs this long after leaving sleep before PWM may restart
+#define SETTLE_NS 500000
+
+// Bus free time between STOP and START at 100 kHz, 400 kHz and 1 MHz (in ns)
+static const int busFree[3] = { 4700, 1300, 500 };
+static const int busClock[3] = { 100000, 400000, 1000000 };
+
+
+/**
+ * A chip on a fake bus
+ */
+struct fakeChip
+{
+	unsigned char reg[256];
+	int pointer;					// Register pointer, set by the first byte of a write
+	int present;					// Plugged in by pca9685BusAdd, BusAdopt or FakeAdd
+	int stopped;					// PWM was halted by sleep and waits for a restart
+	unsigned long long wake;		// When sleep was left last
+	unsigned char out[LED_REGS];	// LED registers the outputs run with
+	unsigned char loaded[PIN_ALL];	// Registers of each pin written since it changed last (on ACK)
+	int dirty;						// LED registers changed, the outputs follow at STOP
+};
+
+struct fakeBus
+{
+	struct fakeChip chip[ADDRESSES];
+	int fail[ADDRESSES];			// Transactions to each address that get a NACK, -1: all of them
+	struct pca9685FakeStats stats;
+	unsigned long long bits;		// Clock cycles on the wire
+};
+
+
+static atomic_int nextFake = PCA9685_FAKE_BASE;
+
+
+/**
+ * Puts a chip into its power-on state
+ */
+static void powerOn(struct fakeChip *chip)
+{
+	int i;
+
+	for (i = 0; i < 256; i++)
+		chip->reg[i] = 0;
+
+	chip->reg[PCA9685_MODE1]		= 0x11;		// Sleep, ALLCALL
+	chip->reg[PCA9685_MODE2]		= 0x04;		// Totem pole
+	chip->reg[PCA9685_SUBADR1]		= 0xE2;
+	chip->reg[PCA9685_SUBADR1 + 1]	= 0xE4;
+	chip->reg[PCA9685_SUBADR1 + 2]	= 0xE8;
+	chip->reg[PCA9685_ALLCALLADR]	= 0xE0;
+	chip->reg[PCA9685_PRESCALE]		= 0x1E;		// 200 Hz
+
+	// All pins full-off
+	for (i = 0; i < PIN_ALL; i++)
+		chip->reg[LED0_ON_L + 4 * i + 3] = 0x10;
+
+	for (i = 0; i < LED_REGS; i++)
+		chip->out[i] = chip->reg[LED0_ON_L + i];
+
+	for (i = 0; i < PIN_ALL; i++)
+		chip->loaded[i] = 0;
+
+	chip->pointer = 0;
+	chip->present = 1;
+	chip->stopped = 0;
+	chip->wake = 0;
+	chip->dirty = 0;
+}
+
+/**
+ * Notes a write to a LED register of a pin. Outputs change at STOP, or on ACK once all four
+ * registers of the pin are written.
+ */
+static void loadPin(struct fakeChip *chip, int pin, int column)
+{
+	int i;
+
+	if (!(chip->reg[PCA9685_MODE2] & OCH))
+	{
+		chip->dirty = 1;
+		return;
+	}
+
+	chip->loaded[pin] |= 1 << column;
+
+	if (chip->loaded[pin] == 0x0F)
+	{
+		for (i = 0; i < 4; i++)
+			chip->out[4 * pin + i] = chip->reg[LED0_ON_L + 4 * pin + i];
+
+		chip->loaded[pin] = 0;
+	}
+}
+
+/**
+ * A STOP ends the transaction. Outputs that change on STOP follow their registers now,
+ * pins which were only partly written on ACK are counted and start over.
+ */
+static void stop(struct fakeBus *fake)
+{
+	int chip, i;
+
+	for (chip = 0; chip < ADDRESSES; chip++)
+	{
+		struct fakeChip *c = &fake->chip[chip];
+
+		if (c->dirty)
+			for (i = 0; i < LED_REGS; i++)
+				c->out[i] = c->reg[LED0_ON_L + i];
+
+		for (i = 0; i < PIN_ALL; i++)
+		{
+			fake->stats.partial += c->loaded[i] != 0;
+			c->loaded[i] = 0;
+		}
+
+		c->dirty = 0;
+	}
+}
+
+/**
+ * Returns 1 if a chip listens to an address, either its own or one of its groups
+ */
+static int listens(struct fakeBus *fake, int chip, int address)
+{
+	struct fakeChip *c = &fake->chip[chip];
+	int group;
+
+	if (!c->present)
+		return 0;
+
+	if (chip == address)
+		return 1;
+
+	for (group = 0; group < 4; group++)
+	{
+		int reg = group ? PCA9685_SUBADR1 + group - 1 : PCA9685_ALLCALLADR;
+
+		if ((c->reg[PCA9685_MODE1] & GROUP_BIT(group)) && c->reg[reg] == address << 1)
+			return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Moves the register pointer on if auto-increment is enabled
+ */
+static void advance(struct fakeChip *chip)
+{
+	if (!(chip->reg[PCA9685_MODE1] & 0x20))
+		return;
+
+	chip->pointer = chip->pointer == LAST_LED ? 0 : (chip->pointer + 1) & 0xFF;
+}
+
+/**
+ * Writes MODE1.
+ * Going to sleep halts running PWM, which then reads as RESTART until a 1 is written to it
+ * after leaving sleep. EXTCLK can only be set during sleep and only a power cycle clears it.
+ */
+static void storeMode1(struct fakeBus *fake, struct fakeChip *chip, int value)
+{
+	int old = chip->reg[PCA9685_MODE1];
+	int mode1 = value & ~(RESTART | EXTCLK);
+
+	if ((old & EXTCLK) || ((value & EXTCLK) && (old & SLEEP)))
+		mode1 |= EXTCLK;
+
+	if ((mode1 & SLEEP) && !(old & SLEEP) && !chip->stopped)
+		chip->stopped = 1;
+
+	if (!(mode1 & SLEEP) && (old & SLEEP))
+		chip->wake = pca9685Now();
+
+	if ((value & RESTART) && chip->stopped && !(mode1 & SLEEP))
+	{
+		if (pca9685Now() - chip->wake < SETTLE_NS)
+			fake->stats.early++;
+
+		chip->stopped = 0;
+	}
+
+	if (chip->stopped)
+		mode1 |= RESTART;
+
+	chip->reg[PCA9685_MODE1] = mode1;
+}
+
+/**
+ * Stores a byte at the register pointer. Writes to LEDALL go to every LED,
+ * writes to PRESCALE are blocked unless the chip sleeps.
+ * Writing a pin after sleep resumes PWM without a restart, with the new values.
+ */
+static void store(struct fakeBus *fake, struct fakeChip *chip, int value)
+{
+	int reg = chip->pointer, i;
+
+	if (chip->stopped && ((reg >= LED0_ON_L && reg <= LAST_LED) || (reg >= LEDALL_ON_L && reg < LEDALL_ON_L + 4))
+		&& !(chip->reg[PCA9685_MODE1] & SLEEP))
+	{
+		chip->stopped = 0;
+		chip->reg[PCA9685_MODE1] &= ~RESTART;
+	}
+
+	if (reg >= LEDALL_ON_L && reg < LEDALL_ON_L + 4)
+		for (i = reg - LEDALL_ON_L; i < LED_REGS; i += 4)
+		{
+			chip->reg[LED0_ON_L + i] = value;
+			loadPin(chip, i / 4, i % 4);
+		}
+	else if (reg >= LED0_ON_L && reg <= LAST_LED)
+	{
+		chip->reg[reg] = value;
+		loadPin(chip, (reg - LED0_ON_L) / 4, (reg - LED0_ON_L) % 4);
+	}
+	else if (reg == PCA9685_MODE1)
+		storeMode1(fake, chip, value);
+	else if (reg == PCA9685_PRESCALE && !(chip->reg[PCA9685_MODE1] & SLEEP))
+		fake->stats.blocked++;
+	else
+		chip->reg[reg] = value;
+
+	advance(chip);
+}
+
+/**
+ * Loads the byte at the register pointer. LEDALL reads as 0.
+ */
+static int load(struct fakeChip *chip)
+{
+	int reg = chip->pointer;
+	int value = (reg >= LEDALL_ON_L && reg < LEDALL_ON_L + 4) ? 0 : chip->reg[reg];
+
+	advance(chip);
+
+	return value;
+}
+
+/**
+ * Every message reaches all chips that listen to its address. Reads only come from
+ * the chip with that address. Nobody answers an address without a chip: that's a NACK.
+ */
+static int fakeTransfer(struct pca9685Bus *bus, struct i2c_msg *msgs, int count)
+{
+	struct fakeBus *fake = bus->priv;
+	int i, j, chip;
+
+	// START, address and data bytes with their ACK, STOP
+	fake->stats.transfers++;
+	fake->bits++;
+
+	for (i = 0; i < count; i++)
+	{
+		int address = msgs[i].addr;
+		int targets = 0;
+
+		fake->stats.messages++;
+		fake->stats.bytes += 1 + msgs[i].len;
+		fake->bits += 1 + 9 * (1 + msgs[i].len);
+
+		// A NACK aborts the transaction with a STOP
+		if (address < 0 || address >= ADDRESSES)
+			break;
+
+		if (fake->fail[address])
+		{
+			fake->fail[address] -= fake->fail[address] > 0;
+			break;
+		}
+
+		for (chip = 0; chip < ADDRESSES; chip++)
+			targets += listens(fake, chip, address);
+
+		if (!targets)
+			break;
+
+		if (msgs[i].flags & I2C_M_RD)
+		{
+			struct fakeChip *c = &fake->chip[address];
+			if (!c->present)
+				break;
+
+			for (j = 0; j < msgs[i].len; j++)
+				msgs[i].buf[j] = load(c);
+
+			continue;
+		}
+
+		for (chip = 0; chip < ADDRESSES; chip++)
+		{
+			if (!listens(fake, chip, address) || msgs[i].len < 1)
+				continue;
+
+			struct fakeChip *c = &fake->chip[chip];
+
+			c->pointer = msgs[i].buf[0];
+			for (j = 1; j < msgs[i].len; j++)
+				store(fake, c, msgs[i].buf[j]);
+		}
+	}
+
+	stop(fake);
+
+	return i < count ? -1 : 0;
+}
+
+/**
+ * Plugs in a chip at an address, in its power-on state. One that is there already stays as it is.
+ */
+static void fakeAttach(struct pca9685Bus *bus, int address)
+{
+	struct fakeBus *fake = bus->priv;
+
+	if (address < 0 || address >= ADDRESSES)
+		return;
+
+	pca9685BusLock(bus);
+
+	if (!fake->chip[address].present)
+		powerOn(&fake->chip[address]);
+
+	pca9685BusUnlock(bus);
+}
+
+/**
+ * Fake buses support everything
+ */
+static unsigned long fakeFuncs(struct pca9685Bus *bus)
+{
+	return I2C_FUNC_I2C | I2C_FUNC_SMBUS_I2C_BLOCK;
+}
+
+/**
+ * Reads consecutive registers as a write of the register followed by a read
+ */
+static int fakeRead(struct pca9685Bus *bus, int address, int reg, unsigned char *data, int len)
+{
+	unsigned char out = reg;
+	struct i2c_msg msgs[2] =
+	{
+		{ address < 0 ? bus->slave : address, 0,		1,	 &out },
+		{ address < 0 ? bus->slave : address, I2C_M_RD, len, data }
+	};
+
+	return fakeTransfer(bus, msgs, 2);
+}
+
+/**
+ * Writes consecutive registers in a single message
+ */
+static int fakeWrite(struct pca9685Bus *bus, int address, int reg, const unsigned char *data, int len)
+{
+	unsigned char buf[1 + LED_REGS];
+	int i;
+
+	if (len > LED_REGS)
+		return -1;
+
+	buf[0] = reg;
+	for (i = 0; i < len; i++)
+		buf[i + 1] = data[i];
+
+	struct i2c_msg msg = { address < 0 ? bus->slave : address, 0, len + 1, buf };
+
+	return fakeTransfer(bus, &msg, 1);
+}
+
+
+const struct pca9685Ops pca9685FakeOps =
+{
+	"fake",
+	fakeFuncs,
+	fakeTransfer,
+	fakeRead,
+	fakeWrite,
+	fakeAttach
+};
+
+
+/**
+ * Creates a fake bus. Returns its handle (not a file descriptor) or -1 on error.
+ */
+int pca9685FakeOpen(void)
+{
+	struct fakeBus *fake = calloc(1, sizeof(struct fakeBus));
+	if (!fake)
+		return -1;
+
+	int handle = atomic_fetch_add(&nextFake, 1);
+
+	struct pca9685Bus *bus = pca9685BusAttach(handle, &pca9685FakeOps);
+	if (!bus)
+	{
+		free(fake);
+		return -1;
+	}
+
+	bus->priv = fake;
+
+	return handle;
+}
+
+/**
+ * Copies the statistics of a fake bus and estimates how long its traffic would have
+ * taken on a real bus. If reset is set, the statistics start over.
+ * Returns 0 on success or -1 if bus is not a fake bus.
+ */
+int pca9685FakeStats(int bus, struct pca9685FakeStats *stats, int reset)
+{
+	struct pca9685Bus *b = pca9685BusGet(bus);
+	if (!b || b->ops != &pca9685FakeOps)
+		return -1;
+
+	struct fakeBus *fake = b->priv;
+	int i;
+
+	pca9685BusLock(b);
+
+	if (stats)
+	{
+		*stats = fake->stats;
+
+		for (i = 0; i < 3; i++)
+			stats->us[i] = fake->bits * 1e6 / busClock[i] + fake->stats.transfers * busFree[i] / 1e3;
+	}
+
+	if (reset)
+	{
+		struct pca9685FakeStats zero = { 0 };
+		fake->stats = zero;
+		fake->bits = 0;
+	}
+
+	pca9685BusUnlock(b);
+
+	return 0;
+}
+
+/**
+ * Plugs in a chip at an address of a fake bus without adding a device, eg. to be reached through
+ * a group address or to be found by pca9685BusInit. pca9685BusAdd and BusAdopt plug in their chips.
+ * Returns 0 on success or -1 on error.
+ */
+int pca9685FakeAdd(int bus, int i2cAddress)
+{
+	struct pca9685Bus *b = pca9685BusGet(bus);
+	if (!b || b->ops != &pca9685FakeOps || i2cAddress < 0 || i2cAddress >= ADDRESSES)
+		return -1;
+
+	fakeAttach(b, i2cAddress);
+	return 0;
+}
+
+/**
+ * Lets the next count transactions to an address of a fake bus fail with a NACK, as if the chip
+ * didn't answer (-1: until it's called again, 0: answer again). Returns 0 on success or -1 on error.
+ */
+int pca9685FakeFail(int bus, int i2cAddress, int count)
+{
+	struct pca9685Bus *b = pca9685BusGet(bus);
+	if (!b || b->ops != &pca9685FakeOps || i2cAddress < 0 || i2cAddress >= ADDRESSES || count < -1)
+		return -1;
+
+	pca9685BusLock(b);
+	((struct fakeBus *)b->priv)->fail[i2cAddress] = count;
+	pca9685BusUnlock(b);
+
+	return 0;
+}
+
+/**
+ * Returns how many of the 4096 ticks of a period a pin of a fake chip is high.
+ * Full-off has priority over full-on, which has priority over the on and off ticks.
+ * A sleeping or halted chip doesn't drive its pins. Returns -1 on error.
+ */
+int pca9685FakeOutput(int bus, int i2cAddress, int pin)
+{
+	struct pca9685Bus *b = pca9685BusGet(bus);
+	if (!b || b->ops != &pca9685FakeOps || i2cAddress < 0 || i2cAddress >= ADDRESSES || pin < 0 || pin >= PIN_ALL)
+		return -1;
+
+	struct fakeChip *chip = &((struct fakeBus *)b->priv)->chip[i2cAddress];
+	if (!chip->present)
+		return -1;
+
+	unsigned char *led = chip->out + 4 * pin;
+
+	if ((chip->reg[PCA9685_MODE1] & SLEEP) || chip->stopped || (led[3] & 0x10))
+		return 0;
+
+	if (led[1] & 0x10)
+		return 4096;
+
+	// The pin goes high at the on tick and low at the off tick, wrapping around the period
+	int on  = led[0] | ((led[1] & 0x0F) << 8);
+	int off = led[2] | ((led[3] & 0x0F) << 8);
+
+	return (off - on + 4096) % 4096;
+}
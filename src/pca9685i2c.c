@@ -0,0 +1,201 @@
+/*************************************************************************
+ * pca9685i2c.c
+ *
+ * Transport which talks to /dev/i2c-N directly with the ioctls of i2c-dev.
+ * Combined transfers use I2C_RDWR, anything else uses SMBus.
+ *
+ * This software is a devLib extension to wiringPi <http://wiringpi.com/>
+ * and enables it to control the Adafruit PCA9685 16-Channel 12-bit
+ * PWM/Servo Driver <http://www.adafruit.com/products/815> via I2C interface.
+ *
+ * Copyright (c) 2014 Reinhard Sprung
+ *
+ * If you have questions or improvements email me at
+ * reinhard.sprung[at]gmail.com
+ *
+ * This software is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * The given code is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You can view the contents of the licence at <http://www.gnu.org/licenses/>.
+ **************************************************************************
+ */
+
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+
+#include "pca9685.h"
+#include "pca9685dev.h"
+
+
+/**
+ * Points the bus to an address for transfers which don't carry one (SMBus, read, write).
+ * An address of -1 keeps whatever is set.
+ */
+int pca9685BusSelect(struct pca9685Bus *bus, int address)
+{
+	if (address < 0 || bus->slave == address)
+		return 0;
+
+	if (ioctl(bus->fd, I2C_SLAVE, address) < 0)
+		return -1;
+
+	bus->slave = address;
+	return 0;
+}
+
+/**
+ * Asks the adapter which kind of transfers it supports
+ */
+static unsigned long i2cFuncs(struct pca9685Bus *bus)
+{
+	unsigned long funcs;
+
+	return ioctl(bus->fd, I2C_FUNCS, &funcs) < 0 ? 0 : funcs;
+}
+
+/**
+ * Sends several messages in a single I2C_RDWR transfer
+ */
+static int i2cTransfer(struct pca9685Bus *bus, struct i2c_msg *msgs, int count)
+{
+	struct i2c_rdwr_ioctl_data rdwr = { msgs, count };
+
+	return ioctl(bus->fd, I2C_RDWR, &rdwr) < 0 ? -1 : 0;
+}
+
+/**
+ * Runs a single SMBus command
+ */
+static int smbus(struct pca9685Bus *bus, char readWrite, int reg, int size, union i2c_smbus_data *data)
+{
+	struct i2c_smbus_ioctl_data args = { readWrite, reg, size, data };
+
+	return ioctl(bus->fd, I2C_SMBUS, &args) < 0 ? -1 : 0;
+}
+
+/**
+ * Reads consecutive registers in blocks of 32 bytes.
+ * Without block support, we fall back to 16 and 8 bit reads.
+ */
+static int i2cRead(struct pca9685Bus *bus, int address, int reg, unsigned char *data, int len)
+{
+	int i, j, n;
+
+	if (pca9685BusSelect(bus, address) < 0)
+		return -1;
+
+	for (i = 0; i < len; i += n)
+	{
+		union i2c_smbus_data block;
+
+		if (len - i > 2 && (bus->funcs & I2C_FUNC_SMBUS_READ_I2C_BLOCK))
+		{
+			n = len - i > I2C_SMBUS_BLOCK_MAX ? I2C_SMBUS_BLOCK_MAX : len - i;
+			block.block[0] = n;
+
+			if (smbus(bus, I2C_SMBUS_READ, reg + i, I2C_SMBUS_I2C_BLOCK_DATA, &block) < 0)
+				return -1;
+
+			for (j = 0; j < n; j++)
+				data[i + j] = block.block[j + 1];
+		}
+		else if (len - i > 1)
+		{
+			n = 2;
+			if (smbus(bus, I2C_SMBUS_READ, reg + i, I2C_SMBUS_WORD_DATA, &block) < 0)
+				return -1;
+
+			data[i]		= block.word & 0xFF;
+			data[i + 1] = block.word >> 8;
+		}
+		else
+		{
+			n = 1;
+			if (smbus(bus, I2C_SMBUS_READ, reg + i, I2C_SMBUS_BYTE_DATA, &block) < 0)
+				return -1;
+
+			data[i] = block.byte;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Writes consecutive registers.
+ * Without an address, a plain write() is the only way to send them in one message.
+ * Otherwise we use blocks of 32 bytes or fall back to 16 and 8 bit writes.
+ */
+static int i2cWrite(struct pca9685Bus *bus, int address, int reg, const unsigned char *data, int len)
+{
+	int i, j, n;
+
+	if (address < 0 && (bus->funcs & I2C_FUNC_I2C))
+	{
+		unsigned char buf[1 + LED_REGS];
+
+		if (len > LED_REGS)
+			return -1;
+
+		buf[0] = reg;
+		for (i = 0; i < len; i++)
+			buf[i + 1] = data[i];
+
+		return write(bus->fd, buf, len + 1) == len + 1 ? 0 : -1;
+	}
+
+	if (pca9685BusSelect(bus, address) < 0)
+		return -1;
+
+	for (i = 0; i < len; i += n)
+	{
+		union i2c_smbus_data block;
+		int size;
+
+		if (len - i > 2 && (bus->funcs & I2C_FUNC_SMBUS_WRITE_I2C_BLOCK))
+		{
+			n = len - i > I2C_SMBUS_BLOCK_MAX ? I2C_SMBUS_BLOCK_MAX : len - i;
+			size = I2C_SMBUS_I2C_BLOCK_DATA;
+
+			block.block[0] = n;
+			for (j = 0; j < n; j++)
+				block.block[j + 1] = data[i + j];
+		}
+		else if (len - i > 1)
+		{
+			n = 2;
+			size = I2C_SMBUS_WORD_DATA;
+			block.word = data[i] | (data[i + 1] << 8);
+		}
+		else
+		{
+			n = 1;
+			size = I2C_SMBUS_BYTE_DATA;
+			block.byte = data[i];
+		}
+
+		if (smbus(bus, I2C_SMBUS_WRITE, reg + i, size, &block) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+
+const struct pca9685Ops pca9685I2cOps =
+{
+	"i2c-dev",
+	i2cFuncs,
+	i2cTransfer,
+	i2cRead,
+	i2cWrite
+};
@@ -0,0 +1,193 @@
+/*************************************************************************
+ * pca9685lock.c
+ *
+ * Optional thread-safe mode. Every operation takes the lock of its bus,
+ * so threads working on different buses never wait for each other.
+ * Batches hold the lock across several operations.
+ *
+ * This software is a devLib extension to wiringPi <http://wiringpi.com/>
+ * and enables it to control the Adafruit PCA9685 16-Channel 12-bit
+ * PWM/Servo Driver <http://www.adafruit.com/products/815> via I2C interface.
+ *
+ * Copyright (c) 2014 Reinhard Sprung
+ *
+ * If you have questions or improvements email me at
+ * reinhard.sprung[at]gmail.com
+ *
+ * This software is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * The given code is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You can view the contents of the licence at <http://www.gnu.org/licenses/>.
+ **************************************************************************
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "pca9685.h"
+#include "pca9685dev.h"
+
+
+static int threadSafe = 0;
+static atomic_int required;				// Threads of the library which need locking
+
+
+/**
+ * Enables or disables thread-safe mode for all buses.
+ * Switch it before more than one thread uses the library.
+ */
+void pca9685ThreadSafe(int enable)
+{
+	threadSafe = enable != 0;
+}
+
+/**
+ * Switches locking on while a thread of the library (async writer, motion clock, scheduler)
+ * runs, whether or not thread-safe mode is enabled. Calls nest. Like pca9685ThreadSafe,
+ * switch it before the thread starts and after it ended, never while holding a lock.
+ */
+void pca9685LockRequire(int enable)
+{
+	atomic_fetch_add(&required, enable ? 1 : -1);
+}
+
+/**
+ * Returns 1 if lock calls take the locks
+ */
+static int locking(void)
+{
+	return threadSafe || atomic_load(&required) > 0;
+}
+
+/**
+ * Takes the lock of a bus (in thread-safe mode). The lock is recursive, so operations
+ * can call each other and batches can hold it across several of them.
+ */
+void pca9685BusLock(struct pca9685Bus *bus)
+{
+	if (!locking())
+		return;
+
+	unsigned long long wait = 0;
+
+	// The first try tells us if another thread has it
+	if (pthread_mutex_trylock(&bus->lock) != 0)
+	{
+		wait = pca9685Now();
+		pthread_mutex_lock(&bus->lock);
+		wait = pca9685Now() - wait;
+
+		bus->stats.contended++;
+		bus->stats.waitNs += wait;
+	}
+
+	// Only the outermost lock counts
+	if (bus->depth++ == 0)
+	{
+		bus->stats.locks++;
+		bus->since = pca9685Now();
+	}
+}
+
+/**
+ * Releases the lock of a bus
+ */
+void pca9685BusUnlock(struct pca9685Bus *bus)
+{
+	if (!locking())
+		return;
+
+	if (--bus->depth == 0)
+	{
+		unsigned long long hold = pca9685Now() - bus->since;
+
+		bus->stats.holdNs += hold;
+		if (hold > bus->stats.maxHoldNs)
+			bus->stats.maxHoldNs = hold;
+	}
+
+	pthread_mutex_unlock(&bus->lock);
+}
+
+/**
+ * Finds a device and takes the lock of its bus.
+ * Returns 0 (without locking) if there is no such device.
+ */
+struct pca9685Dev *pca9685DevLock(int id)
+{
+	struct pca9685Dev *dev = pca9685DevGet(id);
+	if (dev)
+		pca9685BusLock(dev->bus);
+
+	return dev;
+}
+
+/**
+ * Releases the lock taken by pca9685DevLock
+ */
+void pca9685DevUnlock(struct pca9685Dev *dev)
+{
+	pca9685BusUnlock(dev->bus);
+}
+
+/**
+ * Starts a batch. All operations on the bus of the device up to pca9685BatchEnd
+ * happen without other threads getting in between. Batches can be nested.
+ * Don't call pca9685AsyncFlush or pca9685AsyncStop for this bus inside a batch.
+ * Returns 0 on success or -1 on error.
+ */
+int pca9685BatchBegin(int fd)
+{
+	return pca9685DevLock(fd) ? 0 : -1;
+}
+
+/**
+ * Ends a batch started with pca9685BatchBegin
+ */
+void pca9685BatchEnd(int fd)
+{
+	struct pca9685Dev *dev = pca9685DevGet(fd);
+	if (dev)
+		pca9685DevUnlock(dev);
+}
+
+/**
+ * Copies the lock statistics of the bus of a device (or a bus file descriptor).
+ * If reset is set, the statistics start over.
+ * Returns 0 on success or -1 on error.
+ */
+int pca9685LockStats(int fd, struct pca9685LockStats *stats, int reset)
+{
+	struct pca9685Bus *bus = pca9685BusGet(fd);
+	if (!bus)
+	{
+		struct pca9685Dev *dev = pca9685DevGet(fd);
+		if (!dev)
+			return -1;
+
+		bus = dev->bus;
+	}
+
+	// The statistics only change under the lock
+	pthread_mutex_lock(&bus->lock);
+
+	if (stats)
+		*stats = bus->stats;
+
+	if (reset)
+	{
+		struct pca9685LockStats zero = { 0 };
+		bus->stats = zero;
+	}
+
+	pthread_mutex_unlock(&bus->lock);
+
+	return 0;
+}
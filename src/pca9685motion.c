@@ -0,0 +1,425 @@
+/*************************************************************************
+ * pca9685motion.c
+ *
+ * Motion engine for servos. Every channel moves towards its target with
+ * limited velocity and acceleration (and optionally jerk), sampled on a
+ * fixed update clock. Only changed pulse widths are written.
+ *
+ * This software is a devLib extension to wiringPi <http://wiringpi.com/>
+ * and enables it to control the Adafruit PCA9685 16-Channel 12-bit
+ * PWM/Servo Driver <http://www.adafruit.com/products/815> via I2C interface.
+ *
+ * Copyright (c) 2014 Reinhard Sprung
+ *
+ * If you have questions or improvements email me at
+ * reinhard.sprung[at]gmail.com
+ *
+ * This software is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * The given code is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You can view the contents of the licence at <http://www.gnu.org/licenses/>.
+ **************************************************************************
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "pca9685.h"
+#include "pca9685dev.h"
+
+// Buses flushed together per step. Servos on further buses commit their pin on their own.
+#define MAX_BUSES 16
+
+
+/**
+ * A servo channel
+ */
+struct axis
+{
+	int fd;
+	int pin;
+	double pos;						// Pulse width in microseconds
+	double vel;						// us/s
+	double acc;						// us/s^2
+	double target;
+	double maxVel;
+	double maxAcc;
+	double jerk;					// us/s^3, 0 for a trapezoidal profile
+	int ticks;						// Last value written, -1 if none
+	int changed;					// Staged by the current step, goes out with its bus
+	struct axis *next;
+};
+
+/**
+ * The engine. All fields are guarded by lock.
+ */
+static struct
+{
+	pthread_mutex_t lock;
+	struct axis *axes;
+	struct pca9685MotionStats stats;
+	unsigned long long start;		// When the clock was started
+	pthread_t thread;
+	atomic_int running;
+} engine = { PTHREAD_MUTEX_INITIALIZER };
+
+
+/**
+ * Returns the number of ticks per microsecond of a device
+ */
+static double ticksPerUs(int fd)
+{
+	struct pca9685Dev *dev = pca9685DevGet(fd);
+
+	return dev ? dev->usTicks / 4294967296.0 : 0;
+}
+
+/**
+ * Finds the axis of a pin
+ */
+static struct axis *findAxis(int fd, int pin)
+{
+	struct axis *a;
+
+	for (a = engine.axes; a; a = a->next)
+		if (a->fd == fd && a->pin == pin)
+			return a;
+
+	return 0;
+}
+
+/**
+ * Returns the highest speed which still allows stopping within distance.
+ * With a jerk limit, the acceleration needs time to ramp down as well.
+ */
+static double stopSpeed(const struct axis *a, double distance)
+{
+	if (a->jerk <= 0)
+		return sqrt(2 * a->maxAcc * distance);
+
+	double lag = a->maxAcc * a->maxAcc / (2 * a->jerk);
+
+	return sqrt(lag * lag + 2 * a->maxAcc * distance) - lag;
+}
+
+/**
+ * Moves an axis on by dt seconds
+ */
+static void stepAxis(struct axis *a, double dt)
+{
+	double distance = a->target - a->pos;
+	double dir = distance < 0 ? -1 : 1;
+
+	// Velocity we want: as fast as allowed, but slow enough to stop at the target
+	double want = stopSpeed(a, fabs(distance));
+	want = dir * (want < a->maxVel ? want : a->maxVel);
+
+	// Acceleration needed to get there within this step, limited by maxAcc
+	double acc = (want - a->vel) / dt;
+	acc = acc > a->maxAcc ? a->maxAcc : (acc < -a->maxAcc ? -a->maxAcc : acc);
+
+	// S-curve: the acceleration itself can only change by jerk per second
+	if (a->jerk > 0)
+	{
+		double limit = a->jerk * dt;
+		acc = acc > a->acc + limit ? a->acc + limit : (acc < a->acc - limit ? a->acc - limit : acc);
+	}
+
+	a->acc = acc;
+	a->vel += acc * dt;
+	a->pos += a->vel * dt;
+
+	// Snap onto the target once we'd pass it or are close enough and slow
+	double left = a->target - a->pos;
+	if (left * dir < 0 || (fabs(left) < 0.5 && fabs(a->vel) <= a->maxAcc * dt))
+	{
+		a->pos = a->target;
+		a->vel = 0;
+		a->acc = 0;
+	}
+}
+
+/**
+ * Lets a servo move to target (pulse width in microseconds) with at most maxVel (us/s)
+ * and maxAcc (us/s^2). jerk (us/s^3) > 0 gives an S-curve, 0 a trapezoidal profile.
+ * The target may change at any time, the servo continues smoothly from where it is.
+ * A servo that isn't moved yet starts at its current pulse width, or jumps to the
+ * target if it has none. Returns 0 on success or -1 on error.
+ */
+int pca9685MotionMove(int fd, int pin, float target, float maxVel, float maxAcc, float jerk)
+{
+	if (pin < 0 || pin >= PIN_ALL || target < 0 || maxVel <= 0 || maxAcc <= 0 || jerk < 0)
+		return -1;
+
+	double scale = ticksPerUs(fd);
+	if (scale <= 0)
+		return -1;
+
+	pthread_mutex_lock(&engine.lock);
+
+	struct axis *a = findAxis(fd, pin);
+	if (!a)
+	{
+		a = calloc(1, sizeof(struct axis));
+		if (!a)
+		{
+			pthread_mutex_unlock(&engine.lock);
+			return -1;
+		}
+
+		// Start from what the servo gets now
+		int on, off;
+		pca9685PWMRead(fd, pin, &on, &off);
+
+		a->fd = fd;
+		a->pin = pin;
+		a->pos = (on | off) & 0x1000 ? target : ((off - on) & 0x0FFF) / scale;
+		a->ticks = -1;
+		a->next = engine.axes;
+		engine.axes = a;
+	}
+
+	a->target = target;
+	a->maxVel = maxVel;
+	a->maxAcc = maxAcc;
+	a->jerk = jerk;
+
+	pthread_mutex_unlock(&engine.lock);
+	return 0;
+}
+
+/**
+ * Returns the current pulse width of a servo in microseconds or -1 if it isn't moved by the engine
+ */
+float pca9685MotionPosition(int fd, int pin)
+{
+	pthread_mutex_lock(&engine.lock);
+
+	struct axis *a = findAxis(fd, pin);
+	float pos = a ? a->pos : -1;
+
+	pthread_mutex_unlock(&engine.lock);
+	return pos;
+}
+
+/**
+ * Returns the number of servos which haven't reached their target yet
+ */
+int pca9685MotionMoving(void)
+{
+	struct axis *a;
+	int moving = 0;
+
+	pthread_mutex_lock(&engine.lock);
+
+	for (a = engine.axes; a; a = a->next)
+		moving += (a->pos != a->target || a->ticks < 0);
+
+	pthread_mutex_unlock(&engine.lock);
+	return moving;
+}
+
+/**
+ * Picks the pins of a device whose servo changed in this step (engine lock held)
+ */
+static int pickChanged(struct pca9685Dev *dev, void *arg)
+{
+	struct axis *a;
+	int mask = 0;
+
+	for (a = engine.axes; a; a = a->next)
+		if (a->changed && a->fd == dev->id)
+			mask |= 1 << a->pin;
+
+	return mask;
+}
+
+/**
+ * Moves all servos on by dt seconds and writes the pulse widths that changed.
+ * Only the pins of changed servos are sent, one transfer per bus. Other pins staged
+ * on the same chips stay staged.
+ * Call it at a fixed rate or let pca9685MotionStart do it.
+ * Returns the number of pins written or -1 on error.
+ */
+int pca9685MotionStep(float dt)
+{
+	struct pca9685Bus *buses[MAX_BUSES];
+	int i, nbuses = 0, written = 0, ret = 0;
+	struct axis *a;
+
+	if (dt <= 0)
+		return -1;
+
+	pthread_mutex_lock(&engine.lock);
+
+	for (a = engine.axes; a; a = a->next)
+	{
+		a->changed = 0;
+
+		if (a->pos != a->target)
+			stepAxis(a, dt);
+
+		// Only a new tick value costs a write
+		int ticks = (int)(a->pos * ticksPerUs(a->fd) + 0.5);
+		if (ticks == a->ticks)
+		{
+			engine.stats.skipped++;
+			continue;
+		}
+
+		pca9685FramePWM(a->fd, a->pin, ticks);
+		a->ticks = ticks;
+		written++;
+
+		// Remember the bus, flush it below
+		struct pca9685Dev *dev = pca9685DevGet(a->fd);
+		for (i = 0; i < nbuses && buses[i] != dev->bus; i++)
+			;
+
+		if (i < nbuses || nbuses < MAX_BUSES)
+		{
+			buses[i == nbuses ? nbuses++ : i] = dev->bus;
+			a->changed = 1;
+			continue;
+		}
+
+		// No room for the bus, commit the pin on its own
+		pca9685DevLock(a->fd);
+		if (pca9685DevCommit(dev, 1 << a->pin) < 0)
+			ret = -1;
+		pca9685DevUnlock(dev);
+	}
+
+	for (i = 0; i < nbuses; i++)
+		if (pca9685BusFlushPick(buses[i], pickChanged, 0) < 0)
+			ret = -1;
+
+	engine.stats.steps++;
+	engine.stats.writes += written;
+
+	pthread_mutex_unlock(&engine.lock);
+
+	return ret < 0 ? -1 : written;
+}
+
+/**
+ * Update clock. Wakes up at absolute deadlines, so the rate doesn't drift.
+ * Steps that are missed completely are skipped instead of being made up in a burst.
+ */
+static void *clockThread(void *arg)
+{
+	unsigned long long period = (unsigned long long)(1e9 / engine.stats.plannedHz);
+	unsigned long long next = pca9685Now();
+
+	while (atomic_load(&engine.running))
+	{
+		pca9685MotionStep(period / 1e9);
+
+		next += period;
+		unsigned long long now = pca9685Now();
+
+		if (now > next)
+		{
+			pthread_mutex_lock(&engine.lock);
+			engine.stats.late++;
+			pthread_mutex_unlock(&engine.lock);
+
+			// Don't catch up, start over from now
+			while (next < now)
+				next += period;
+		}
+
+		struct timespec ts = { next / 1000000000ull, next % 1000000000ull };
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0) == EINTR)
+			;
+	}
+
+	return 0;
+}
+
+/**
+ * Starts a thread which steps all servos hz times per second.
+ * The buses are locked as in thread-safe mode while it runs.
+ * Don't call motion functions inside a batch (pca9685BatchBegin) while it runs.
+ * Returns 0 on success or -1 on error.
+ */
+int pca9685MotionStart(float hz)
+{
+	if (hz <= 0 || atomic_load(&engine.running))
+		return -1;
+
+	pca9685LockRequire(1);
+
+	pthread_mutex_lock(&engine.lock);
+	engine.stats.plannedHz = hz;
+	engine.stats.steps = 0;
+	engine.stats.late = 0;
+	engine.start = pca9685Now();
+	pthread_mutex_unlock(&engine.lock);
+
+	atomic_store(&engine.running, 1);
+	if (pthread_create(&engine.thread, 0, clockThread, 0) != 0)
+	{
+		atomic_store(&engine.running, 0);
+		pca9685LockRequire(0);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Stops the update clock. Servos stay where they are.
+ */
+void pca9685MotionStop(void)
+{
+	if (!atomic_exchange(&engine.running, 0))
+		return;
+
+	pthread_join(engine.thread, 0);
+	pca9685LockRequire(0);
+}
+
+/**
+ * Copies the statistics of the engine: planned and achieved update rate (0 unless the clock runs),
+ * steps that came too late and how many pin updates were written or skipped because the tick value
+ * didn't change. If reset is set, the counters start over.
+ */
+void pca9685MotionStats(struct pca9685MotionStats *stats, int reset)
+{
+	pthread_mutex_lock(&engine.lock);
+
+	unsigned long long now = pca9685Now();
+
+	if (stats)
+	{
+		*stats = engine.stats;
+		stats->achievedHz = 0;
+
+		// Manual steps have no rate of their own
+		if (atomic_load(&engine.running) && now > engine.start)
+			stats->achievedHz = engine.stats.steps * 1e9 / (now - engine.start);
+	}
+
+	if (reset)
+	{
+		engine.stats.steps = 0;
+		engine.stats.late = 0;
+		engine.stats.writes = 0;
+		engine.stats.skipped = 0;
+		engine.start = now;
+	}
+
+	pthread_mutex_unlock(&engine.lock);
+}
@@ -0,0 +1,390 @@
+/*************************************************************************
+ * pca9685pixel.c
+ *
+ * Pixel pipeline for LED walls. Groups of channels on any number of boards
+ * form logical pixels. Whole 8 or 16 bit frames are converted to 12 bit at
+ * once through per-color lookup tables (gamma, white balance, brightness)
+ * and staged directly into the back buffers of the chips.
+ *
+ * This software is a devLib extension to wiringPi <http://wiringpi.com/>
+ * and enables it to control the Adafruit PCA9685 16-Channel 12-bit
+ * PWM/Servo Driver <http://www.adafruit.com/products/815> via I2C interface.
+ *
+ * Copyright (c) 2014 Reinhard Sprung
+ *
+ * If you have questions or improvements email me at
+ * reinhard.sprung[at]gmail.com
+ *
+ * This software is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * The given code is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You can view the contents of the licence at <http://www.gnu.org/licenses/>.
+ **************************************************************************
+ */
+
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "pca9685.h"
+#include "pca9685dev.h"
+
+// Segments of the 16 bit lookup tables, values in between are interpolated
+#define SEGMENTS 256
+
+
+/**
+ * Where a channel of a pixel goes
+ */
+struct channel
+{
+	struct pca9685Dev *dev;			// 0 if the pixel isn't assigned
+	int pin;
+	int bus;						// Index into canvas.buses
+};
+
+/**
+ * The layout and the color curves. All fields are guarded by lock.
+ */
+static struct
+{
+	pthread_mutex_t lock;
+	int pixels;
+	int depth;						// Colors per pixel
+	struct channel *channels;		// pixels * depth, in frame order
+	unsigned short *values;			// 12 bit values of the last frame, same order
+	int *order;						// Channels sorted by bus
+	int *first;						// Start of each bus in order, nbuses + 1 entries
+	int sorted;						// order is up to date
+	struct pca9685Bus **buses;
+	int nbuses;
+	float gamma[PCA9685_COLORS];
+	float gain[PCA9685_COLORS];
+	float brightness;
+	unsigned short lut8[PCA9685_COLORS][256];
+	unsigned short lut16[PCA9685_COLORS][SEGMENTS + 2];	// Last entry repeated for the top value
+} canvas = { PTHREAD_MUTEX_INITIALIZER };
+
+
+/**
+ * Fills the lookup tables of a color. Outputs are 0..4096 like pwmWrite values,
+ * so black is full-off and white at full gain is full-on.
+ */
+static void buildCurve(int color)
+{
+	double scale = 4096.0 * canvas.gain[color] * canvas.brightness;
+	int i;
+
+	for (i = 0; i < 256; i++)
+		canvas.lut8[color][i] = (unsigned short)(pow(i / 255.0, canvas.gamma[color]) * scale + 0.5);
+
+	for (i = 0; i <= SEGMENTS; i++)
+		canvas.lut16[color][i] = (unsigned short)(pow(i / (double)SEGMENTS, canvas.gamma[color]) * scale + 0.5);
+
+	canvas.lut16[color][SEGMENTS + 1] = canvas.lut16[color][SEGMENTS];
+}
+
+/**
+ * Sets default curves the first time they are needed: gamma 2.2, full gain and brightness
+ */
+static void defaultCurves(void)
+{
+	int color;
+
+	if (canvas.brightness > 0)
+		return;
+
+	canvas.brightness = 1;
+
+	for (color = 0; color < PCA9685_COLORS; color++)
+	{
+		canvas.gamma[color] = 2.2f;
+		canvas.gain[color] = 1;
+		buildCurve(color);
+	}
+}
+
+/**
+ * Sorts the channels by bus (counting sort), so each bus is staged under its lock in one go
+ */
+static void sortChannels(void)
+{
+	int i, n = canvas.pixels * canvas.depth;
+
+	for (i = 0; i <= canvas.nbuses; i++)
+		canvas.first[i] = 0;
+
+	for (i = 0; i < n; i++)
+		if (canvas.channels[i].dev)
+			canvas.first[canvas.channels[i].bus + 1]++;
+
+	for (i = 0; i < canvas.nbuses; i++)
+		canvas.first[i + 1] += canvas.first[i];
+
+	int next[canvas.nbuses + 1];
+	for (i = 0; i <= canvas.nbuses; i++)
+		next[i] = canvas.first[i];
+
+	for (i = 0; i < n; i++)
+		if (canvas.channels[i].dev)
+			canvas.order[next[canvas.channels[i].bus]++] = i;
+
+	canvas.sorted = 1;
+}
+
+/**
+ * Stages the converted frame on all buses and flushes each of them in one transfer.
+ * Returns the number of pins that changed or -1 on error.
+ */
+static int stageFrame(void)
+{
+	int b, i, total = 0, ret = 0;
+
+	if (!canvas.sorted)
+		sortChannels();
+
+	for (b = 0; b < canvas.nbuses; b++)
+	{
+		struct pca9685Bus *bus = canvas.buses[b];
+
+		pca9685BusLock(bus);
+
+		for (i = canvas.first[b]; i < canvas.first[b + 1]; i++)
+		{
+			const struct channel *ch = &canvas.channels[canvas.order[i]];
+			pca9685DevStage(ch->dev, ch->pin, canvas.values[canvas.order[i]]);
+		}
+
+		pca9685BusUnlock(bus);
+
+		int n = pca9685BusFlush(bus->fd, 0);
+		if (n < 0)
+			ret = -1;
+		else
+			total += n;
+	}
+
+	return ret < 0 ? -1 : total;
+}
+
+
+/**
+ * Sets up a wall of pixels with depth colors each (1..4, eg. 3 for RGB, 4 for RGBW).
+ * Frames hold pixels * depth values in this order. Any previous layout is dropped.
+ * Returns 0 on success or -1 on error.
+ */
+int pca9685PixelLayout(int pixels, int depth)
+{
+	if (pixels < 1 || depth < 1 || depth > PCA9685_COLORS)
+		return -1;
+
+	int n = pixels * depth;
+	struct channel *channels = calloc(n, sizeof(struct channel));
+	unsigned short *values = calloc(n, sizeof(unsigned short));
+	int *order = calloc(n, sizeof(int));
+	int *first = calloc(1, sizeof(int));
+
+	if (!channels || !values || !order || !first)
+	{
+		free(channels);
+		free(values);
+		free(order);
+		free(first);
+		return -1;
+	}
+
+	pthread_mutex_lock(&canvas.lock);
+
+	free(canvas.channels);
+	free(canvas.values);
+	free(canvas.order);
+	free(canvas.first);
+	free(canvas.buses);
+
+	canvas.pixels = pixels;
+	canvas.depth = depth;
+	canvas.channels = channels;
+	canvas.values = values;
+	canvas.order = order;
+	canvas.first = first;
+	canvas.buses = 0;
+	canvas.nbuses = 0;
+	canvas.sorted = 0;
+	defaultCurves();
+
+	pthread_mutex_unlock(&canvas.lock);
+	return 0;
+}
+
+/**
+ * Puts a pixel on consecutive pins of a device, starting at pin: one pin per color.
+ * Returns 0 on success or -1 on error.
+ */
+int pca9685PixelAssign(int pixel, int fd, int pin)
+{
+	struct pca9685Dev *dev = pca9685DevGet(fd);
+	if (!dev)
+		return -1;
+
+	pthread_mutex_lock(&canvas.lock);
+
+	if (pixel < 0 || pixel >= canvas.pixels || pin < 0 || pin + canvas.depth > PIN_ALL)
+	{
+		pthread_mutex_unlock(&canvas.lock);
+		return -1;
+	}
+
+	int b, c;
+	for (b = 0; b < canvas.nbuses && canvas.buses[b] != dev->bus; b++)
+		;
+
+	// A new bus needs room in the bus list and its index
+	if (b == canvas.nbuses)
+	{
+		struct pca9685Bus **buses = realloc(canvas.buses, (b + 1) * sizeof(struct pca9685Bus *));
+		if (buses)
+			canvas.buses = buses;
+
+		int *first = realloc(canvas.first, (b + 2) * sizeof(int));
+		if (first)
+			canvas.first = first;
+
+		if (!buses || !first)
+		{
+			pthread_mutex_unlock(&canvas.lock);
+			return -1;
+		}
+
+		canvas.buses[b] = dev->bus;
+		canvas.nbuses++;
+	}
+
+	for (c = 0; c < canvas.depth; c++)
+	{
+		struct channel *ch = &canvas.channels[pixel * canvas.depth + c];
+
+		ch->dev = dev;
+		ch->pin = pin + c;
+		ch->bus = b;
+	}
+
+	canvas.sorted = 0;
+
+	pthread_mutex_unlock(&canvas.lock);
+	return 0;
+}
+
+/**
+ * Sets the curve of a color (0..3): gamma (1 is linear, 2.2 matches the eye) and gain
+ * (0..1, for white balance). Returns 0 on success or -1 on error.
+ */
+int pca9685PixelCurve(int color, float gamma, float gain)
+{
+	if (color < 0 || color >= PCA9685_COLORS || gamma <= 0 || gain < 0 || gain > 1)
+		return -1;
+
+	pthread_mutex_lock(&canvas.lock);
+
+	defaultCurves();
+	canvas.gamma[color] = gamma;
+	canvas.gain[color] = gain;
+	buildCurve(color);
+
+	pthread_mutex_unlock(&canvas.lock);
+	return 0;
+}
+
+/**
+ * Scales all colors (0..1). Returns 0 on success or -1 on error.
+ */
+int pca9685PixelBrightness(float brightness)
+{
+	if (brightness <= 0 || brightness > 1)
+		return -1;
+
+	pthread_mutex_lock(&canvas.lock);
+
+	int color;
+	defaultCurves();
+	canvas.brightness = brightness;
+
+	for (color = 0; color < PCA9685_COLORS; color++)
+		buildCurve(color);
+
+	pthread_mutex_unlock(&canvas.lock);
+	return 0;
+}
+
+/**
+ * Shows a frame of 8 bit values (pixels * depth) on the wall.
+ * Returns the number of pins that changed or -1 on error.
+ */
+int pca9685PixelShow8(const unsigned char *frame)
+{
+	if (!frame)
+		return -1;
+
+	pthread_mutex_lock(&canvas.lock);
+
+	int depth = canvas.depth, pixels = canvas.pixels;
+	unsigned short *out = canvas.values;
+	int p, c;
+
+	// One plain table lookup per value, a color at a time so its table stays in the cache
+	for (c = 0; c < depth; c++)
+	{
+		const unsigned short *lut = canvas.lut8[c];
+
+		for (p = 0; p < pixels; p++)
+			out[p * depth + c] = lut[frame[p * depth + c]];
+	}
+
+	int ret = pixels ? stageFrame() : -1;
+
+	pthread_mutex_unlock(&canvas.lock);
+	return ret;
+}
+
+/**
+ * Shows a frame of 16 bit values (pixels * depth) on the wall. Tables have 256 segments,
+ * values in between are interpolated linearly with integer math only.
+ * Returns the number of pins that changed or -1 on error.
+ */
+int pca9685PixelShow16(const unsigned short *frame)
+{
+	if (!frame)
+		return -1;
+
+	pthread_mutex_lock(&canvas.lock);
+
+	int depth = canvas.depth, pixels = canvas.pixels;
+	unsigned short *out = canvas.values;
+	int p, c;
+
+	for (c = 0; c < depth; c++)
+	{
+		const unsigned short *lut = canvas.lut16[c];
+
+		for (p = 0; p < pixels; p++)
+		{
+			// Stretch 0..65535 to 0..65536, so white hits the last entry exactly
+			unsigned v = frame[p * depth + c];
+			v += v >> 15;
+
+			unsigned i = v >> 8, f = v & 0xFF;
+			out[p * depth + c] = (lut[i] * (256 - f) + lut[i + 1] * f + 128) >> 8;
+		}
+	}
+
+	int ret = pixels ? stageFrame() : -1;
+
+	pthread_mutex_unlock(&canvas.lock);
+	return ret;
+}
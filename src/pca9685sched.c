@@ -0,0 +1,349 @@
+/*************************************************************************
+ * pca9685sched.c
+ *
+ * Frame scheduler for animations. Registered producers stage a frame at
+ * absolute deadlines of a fixed rate, then all buses are flushed. Frames
+ * the bus can't keep up with are skipped, so the animation stays in time
+ * instead of drifting.
+ *
+ * This software is a devLib extension to wiringPi <http://wiringpi.com/>
+ * and enables it to control the Adafruit PCA9685 16-Channel 12-bit
+ * PWM/Servo Driver <http://www.adafruit.com/products/815> via I2C interface.
+ *
+ * Copyright (c) 2014 Reinhard Sprung
+ *
+ * If you have questions or improvements email me at
+ * reinhard.sprung[at]gmail.com
+ *
+ * This software is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * The given code is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You can view the contents of the licence at <http://www.gnu.org/licenses/>.
+ **************************************************************************
+ */
+
+// For the recursive mutex initializer
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "pca9685.h"
+#include "pca9685dev.h"
+
+
+/**
+ * A registered frame producer
+ */
+struct producer
+{
+	pca9685Producer func;
+	void *arg;
+	struct producer *next;
+};
+
+/**
+ * The scheduler. producers and stats are guarded by lock. It's held while the producers run
+ * and is recursive, so they can add producers and read the statistics.
+ */
+static struct
+{
+	pthread_mutex_t lock;
+	struct producer *producers;
+	struct pca9685SchedStats stats;
+	unsigned long long start;		// When the run was started or the stats reset
+	unsigned long long period;		// ns
+	unsigned long frames;			// Frames to run, 0 until stopped
+	pthread_t thread;
+	atomic_int running;
+	atomic_int threaded;
+} sched = { PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP };
+
+
+/**
+ * Sleeps until an absolute time of the monotonic clock
+ */
+static void sleepUntil(unsigned long long ns)
+{
+	struct timespec ts = { ns / 1000000000ull, ns % 1000000000ull };
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0) == EINTR)
+		;
+}
+
+/**
+ * Flushes every bus which has staged pins, each one in a single transfer
+ */
+static int flushAll(void)
+{
+	struct pca9685Dev *dev, *other;
+	int ret = 0;
+
+	for (dev = pca9685Devices; dev; dev = dev->next)
+	{
+		if (!dev->staged)
+			continue;
+
+		// Only the first staged device of a bus flushes it
+		for (other = pca9685Devices; other != dev && !(other->bus == dev->bus && other->staged); other = other->next)
+			;
+
+		if (other == dev && pca9685BusFlush(dev->bus->fd, 0) < 0)
+			ret = -1;
+	}
+
+	return ret;
+}
+
+/**
+ * Runs frames on absolute deadlines until stopped or the number of frames is reached.
+ * A frame that ends after the next deadline is an overrun; the deadlines it missed are skipped
+ * and their frame numbers with them, so producers always see the frame of the current time.
+ */
+static void runFrames(void)
+{
+	unsigned long long period = sched.period;
+	unsigned long long next = pca9685Now();
+	unsigned long frame = 0;
+
+	while (atomic_load(&sched.running) && (!sched.frames || frame < sched.frames))
+	{
+		unsigned long long wake = pca9685Now();
+		unsigned long long jitter = wake > next ? wake - next : 0;
+		struct producer *p;
+		int failed = 0;
+
+		pthread_mutex_lock(&sched.lock);
+
+		for (p = sched.producers; p; p = p->next)
+			if (p->func(frame, p->arg) < 0)
+				failed = 1;
+
+		if (flushAll() < 0)
+			failed = 1;
+
+		unsigned long long now = pca9685Now();
+		unsigned long long work = now - wake;
+
+		sched.stats.frames++;
+		sched.stats.errors += failed;
+		sched.stats.lastJitterNs = jitter;
+		sched.stats.totalJitterNs += jitter;
+		sched.stats.maxJitterNs = jitter > sched.stats.maxJitterNs ? jitter : sched.stats.maxJitterNs;
+		sched.stats.lastWorkNs = work;
+		sched.stats.totalWorkNs += work;
+		sched.stats.maxWorkNs = work > sched.stats.maxWorkNs ? work : sched.stats.maxWorkNs;
+
+		frame++;
+		next += period;
+
+		// Too late for the next deadline: drop the frames we missed instead of catching up
+		if (now >= next)
+		{
+			unsigned long missed = (now - next) / period + 1;
+
+			sched.stats.overruns++;
+			sched.stats.skipped += missed;
+			frame += missed;
+			next += missed * period;
+		}
+
+		pthread_mutex_unlock(&sched.lock);
+
+		sleepUntil(next);
+	}
+
+	atomic_store(&sched.running, 0);
+}
+
+/**
+ * Thread of pca9685SchedStart
+ */
+static void *schedThread(void *arg)
+{
+	runFrames();
+	return 0;
+}
+
+/**
+ * Sets up a run at hz. Returns 0 on success or -1 if the rate is wrong or it runs already.
+ */
+static int prepare(float hz, unsigned long frames)
+{
+	int idle = 0;
+
+	if (hz <= 0)
+		return -1;
+
+	// A thread that was stopped by one of its producers still needs to be joined
+	if (!atomic_load(&sched.running) && atomic_exchange(&sched.threaded, 0))
+	{
+		pthread_join(sched.thread, 0);
+		pca9685LockRequire(0);
+	}
+
+	if (!atomic_compare_exchange_strong(&sched.running, &idle, 1))
+		return -1;
+
+	pthread_mutex_lock(&sched.lock);
+
+	struct pca9685SchedStats zero = { 0 };
+	sched.stats = zero;
+	sched.stats.plannedHz = hz;
+	sched.period = (unsigned long long)(1e9 / hz);
+	sched.frames = frames;
+	sched.start = pca9685Now();
+
+	pthread_mutex_unlock(&sched.lock);
+	return 0;
+}
+
+
+/**
+ * Registers a producer. Once per frame, it gets the frame number (counted from the start of the
+ * run, frames that were skipped included) and stages the pins it wants to change, eg. with
+ * pca9685FramePWM or pca9685PixelShow8. It returns a negative value on error.
+ * The same function may be added with different args. Returns 0 on success or -1 on error.
+ */
+int pca9685SchedAdd(pca9685Producer func, void *arg)
+{
+	if (!func)
+		return -1;
+
+	struct producer *p = calloc(1, sizeof(struct producer));
+	if (!p)
+		return -1;
+
+	p->func = func;
+	p->arg = arg;
+
+	pthread_mutex_lock(&sched.lock);
+
+	// Keep the order in which they were added
+	struct producer **last = &sched.producers;
+	while (*last)
+		last = &(*last)->next;
+	*last = p;
+
+	pthread_mutex_unlock(&sched.lock);
+	return 0;
+}
+
+/**
+ * Removes a producer that was added with the same func and arg.
+ * Don't call it from inside a producer. Returns 0 on success or -1 if there is no such producer.
+ */
+int pca9685SchedRemove(pca9685Producer func, void *arg)
+{
+	struct producer **p, *found = 0;
+
+	pthread_mutex_lock(&sched.lock);
+
+	for (p = &sched.producers; *p; p = &(*p)->next)
+	{
+		if ((*p)->func == func && (*p)->arg == arg)
+		{
+			found = *p;
+			*p = found->next;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&sched.lock);
+
+	free(found);
+	return found ? 0 : -1;
+}
+
+/**
+ * Runs frames at hz on the calling thread until pca9685SchedStop is called (from a producer or
+ * another thread) or, if frames > 0, that many frames have passed (skipped ones included).
+ * Returns 0 when done or -1 on error.
+ */
+int pca9685SchedRun(float hz, unsigned long frames)
+{
+	if (prepare(hz, frames) < 0)
+		return -1;
+
+	runFrames();
+	return 0;
+}
+
+/**
+ * Runs frames at hz in a thread until pca9685SchedStop.
+ * The buses are locked as in thread-safe mode until the thread is joined.
+ * Returns 0 on success or -1 on error.
+ */
+int pca9685SchedStart(float hz)
+{
+	if (prepare(hz, 0) < 0)
+		return -1;
+
+	pca9685LockRequire(1);
+
+	atomic_store(&sched.threaded, 1);
+	if (pthread_create(&sched.thread, 0, schedThread, 0) != 0)
+	{
+		atomic_store(&sched.threaded, 0);
+		atomic_store(&sched.running, 0);
+		pca9685LockRequire(0);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Stops the scheduler after the current frame. A thread of pca9685SchedStart is joined,
+ * unless this is called from one of its producers.
+ */
+void pca9685SchedStop(void)
+{
+	atomic_store(&sched.running, 0);
+
+	// Only one of several stops joins. A producer leaves it to the next start.
+	if (!pthread_equal(pthread_self(), sched.thread) && atomic_exchange(&sched.threaded, 0))
+	{
+		pthread_join(sched.thread, 0);
+		pca9685LockRequire(0);
+	}
+}
+
+/**
+ * Copies the statistics of the scheduler: planned and achieved frame rate, frames run, skipped
+ * and overrun, wake-up jitter and the time the frames took. If reset is set, they start over.
+ */
+void pca9685SchedStats(struct pca9685SchedStats *stats, int reset)
+{
+	pthread_mutex_lock(&sched.lock);
+
+	unsigned long long now = pca9685Now();
+
+	if (stats)
+	{
+		*stats = sched.stats;
+		stats->achievedHz = now > sched.start ? sched.stats.frames * 1e9 / (now - sched.start) : 0;
+	}
+
+	if (reset)
+	{
+		float hz = sched.stats.plannedHz;
+		struct pca9685SchedStats zero = { 0 };
+
+		sched.stats = zero;
+		sched.stats.plannedHz = hz;
+		sched.start = now;
+	}
+
+	pthread_mutex_unlock(&sched.lock);
+}
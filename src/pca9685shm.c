@@ -0,0 +1,364 @@
+/*************************************************************************
+ * pca9685shm.c
+ *
+ * Shared memory of pca9685d. The daemon owns the buses and publishes the
+ * channels of its chips in shared memory. Clients store pwmWrite values
+ * there under a robust lock per chip, the daemon reads them through a
+ * sequence counter without locking and flushes them in batches.
+ *
+ * This software is a devLib extension to wiringPi <http://wiringpi.com/>
+ * and enables it to control the Adafruit PCA9685 16-Channel 12-bit
+ * PWM/Servo Driver <http://www.adafruit.com/products/815> via I2C interface.
+ *
+ * Copyright (c) 2014 Reinhard Sprung
+ *
+ * If you have questions or improvements email me at
+ * reinhard.sprung[at]gmail.com
+ *
+ * This software is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * The given code is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You can view the contents of the licence at <http://www.gnu.org/licenses/>.
+ **************************************************************************
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "pca9685.h"
+#include "pca9685dev.h"
+
+
+/**
+ * The mapping of this process
+ */
+static struct pca9685ShmHeader *shm;
+static size_t shmSize;
+
+
+/**
+ * Returns a chip of the mapping or 0
+ */
+static struct pca9685ShmChip *getChip(int chip)
+{
+	return shm && chip >= 0 && chip < shm->chips ? &shm->chip[chip] : 0;
+}
+
+/**
+ * Takes the writer lock of a chip and makes its seq odd, so the daemon doesn't copy half a write.
+ * If the last owner died while writing, seq is still odd: its values are kept as they are.
+ * Returns 0 on success or -1 if the lock can't be used any more.
+ */
+static int beginWrite(struct pca9685ShmChip *c)
+{
+	int ret = pthread_mutex_lock(&c->lock);
+
+	if (ret == EOWNERDEAD)
+	{
+		unsigned int seq = atomic_load_explicit(&c->seq, memory_order_relaxed);
+		if (seq & 1)
+			atomic_store_explicit(&c->seq, seq + 1, memory_order_release);
+
+		pthread_mutex_consistent(&c->lock);
+	}
+	else if (ret != 0)
+		return -1;
+
+	atomic_fetch_add_explicit(&c->seq, 1, memory_order_relaxed);
+
+	// The values must not get visible before seq is odd
+	atomic_thread_fence(memory_order_release);
+
+	return 0;
+}
+
+/**
+ * Makes seq even again and releases the writer lock, the daemon picks the values up with the next round
+ */
+static void endWrite(struct pca9685ShmChip *c)
+{
+	atomic_fetch_add_explicit(&c->seq, 1, memory_order_release);
+	pthread_mutex_unlock(&c->lock);
+}
+
+/**
+ * Clamps a value like pwmWrite does
+ */
+static unsigned short clampValue(int value)
+{
+	return value <= 0 ? 0 : (value >= 4096 ? 4096 : value);
+}
+
+/**
+ * Maps the shared memory of a running pca9685d (name 0: "/pca9685").
+ * Returns the number of chips or -1 if there is no daemon or its layout doesn't match.
+ */
+int pca9685ShmOpen(const char *name)
+{
+	struct stat st;
+
+	pca9685ShmClose();
+
+	int fd = shm_open(name ? name : PCA9685_SHM_NAME, O_RDWR, 0);
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(struct pca9685ShmHeader))
+	{
+		close(fd);
+		return -1;
+	}
+
+	void *map = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED)
+		return -1;
+
+	struct pca9685ShmHeader *h = map;
+	if (h->magic != PCA9685_SHM_MAGIC || h->version != PCA9685_SHM_VERSION
+		|| sizeof(struct pca9685ShmHeader) + h->chips * sizeof(struct pca9685ShmChip) > (size_t)st.st_size)
+	{
+		munmap(map, st.st_size);
+		return -1;
+	}
+
+	shm = h;
+	shmSize = st.st_size;
+
+	return h->chips;
+}
+
+/**
+ * Unmaps the shared memory
+ */
+void pca9685ShmClose(void)
+{
+	if (!shm)
+		return;
+
+	munmap(shm, shmSize);
+	shm = 0;
+	shmSize = 0;
+}
+
+/**
+ * Returns the number of the chip at an address of a bus or -1.
+ * Buses are numbered in the order they first appear on the command line of the daemon.
+ */
+int pca9685ShmFind(int bus, int i2cAddress)
+{
+	int i;
+
+	for (i = 0; shm && i < shm->chips; i++)
+		if (shm->chip[i].bus == bus && shm->chip[i].address == i2cAddress)
+			return i;
+
+	return -1;
+}
+
+/**
+ * Sets a pin of a chip like pwmWrite (pin 16: all pins).
+ * Only stores to shared memory, the daemon writes it with its next round.
+ * Returns 0 on success or -1 on error.
+ */
+int pca9685ShmWrite(int chip, int pin, int value)
+{
+	struct pca9685ShmChip *c = getChip(chip);
+	int i;
+
+	if (!c || pin < 0 || pin > PIN_ALL)
+		return -1;
+
+	unsigned short v = clampValue(value);
+	if (beginWrite(c) < 0)
+		return -1;
+
+	for (i = pin == PIN_ALL ? 0 : pin; i < (pin == PIN_ALL ? PIN_ALL : pin + 1); i++)
+		atomic_store_explicit(&c->value[i], v, memory_order_relaxed);
+
+	endWrite(c);
+	return 0;
+}
+
+/**
+ * Sets count consecutive pins of a chip, starting at first, like pwmWrite.
+ * The daemon sees either all or none of them. Returns 0 on success or -1 on error.
+ */
+int pca9685ShmFrame(int chip, int first, int count, const int *values)
+{
+	struct pca9685ShmChip *c = getChip(chip);
+	int i;
+
+	if (!c || !values || first < 0 || count < 0 || first + count > PIN_ALL)
+		return -1;
+
+	if (beginWrite(c) < 0)
+		return -1;
+
+	for (i = 0; i < count; i++)
+		atomic_store_explicit(&c->value[first + i], clampValue(values[i]), memory_order_relaxed);
+
+	endWrite(c);
+	return 0;
+}
+
+/**
+ * Returns the value last stored for a pin, or -1 if there's none or on error
+ */
+int pca9685ShmRead(int chip, int pin)
+{
+	struct pca9685ShmChip *c = getChip(chip);
+
+	if (!c || pin < 0 || pin >= PIN_ALL)
+		return -1;
+
+	unsigned short v = atomic_load_explicit(&c->value[pin], memory_order_relaxed);
+
+	return v == PCA9685_SHM_KEEP ? -1 : v;
+}
+
+/**
+ * Returns 1 if the shared memory of that name belongs to a daemon which still runs
+ */
+static int ownerRuns(const char *name)
+{
+	struct stat st;
+	int pid = 0;
+
+	int fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0)
+		return 0;
+
+	if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(struct pca9685ShmHeader))
+	{
+		struct pca9685ShmHeader *h = mmap(0, sizeof(*h), PROT_READ, MAP_SHARED, fd, 0);
+		if (h != MAP_FAILED)
+		{
+			pid = h->pid;
+			munmap(h, sizeof(*h));
+		}
+	}
+
+	close(fd);
+
+	// EPERM: it runs, but as another user
+	return pid > 0 && (kill(pid, 0) == 0 || errno == EPERM);
+}
+
+/**
+ * Daemon side. Creates the shared memory with count chips (the devices fds on the buses of
+ * the daemon), values untouched. Fails with EEXIST if another daemon runs with the same name,
+ * replaces what a dead one left behind. Returns the mapping of size bytes or 0 on error.
+ */
+struct pca9685ShmHeader *pca9685ShmCreate(const char *name, const int *fds, const int *buses, int count, size_t *size)
+{
+	pthread_mutexattr_t attr;
+	int i, pin;
+
+	*size = sizeof(struct pca9685ShmHeader) + count * sizeof(struct pca9685ShmChip);
+
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0666);
+	if (fd < 0 && errno == EEXIST)
+	{
+		if (ownerRuns(name))
+		{
+			errno = EEXIST;
+			return 0;
+		}
+
+		shm_unlink(name);
+		fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0666);
+	}
+
+	if (fd < 0)
+		return 0;
+
+	if (ftruncate(fd, *size) < 0)
+	{
+		close(fd);
+		shm_unlink(name);
+		return 0;
+	}
+
+	struct pca9685ShmHeader *h = mmap(0, *size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (h == MAP_FAILED)
+	{
+		shm_unlink(name);
+		return 0;
+	}
+
+	// Clients share the writer locks, one that dies holding a lock doesn't block the others
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+
+	for (i = 0; i < count; i++)
+	{
+		struct pca9685Dev *dev = pca9685DevGet(fds[i]);
+
+		pthread_mutex_init(&h->chip[i].lock, &attr);
+		h->chip[i].bus = buses[i];
+		h->chip[i].address = dev ? dev->address : -1;
+
+		for (pin = 0; pin < PIN_ALL; pin++)
+			atomic_store(&h->chip[i].value[pin], PCA9685_SHM_KEEP);
+	}
+
+	pthread_mutexattr_destroy(&attr);
+
+	h->chips = count;
+	h->pid = getpid();
+	h->version = PCA9685_SHM_VERSION;
+
+	// Clients check the magic last
+	atomic_thread_fence(memory_order_release);
+	h->magic = PCA9685_SHM_MAGIC;
+
+	return h;
+}
+
+/**
+ * Daemon side. Stages the values of a chip on the device fd if a client changed them since
+ * the values of seq last. Returns 1 if they got staged (seq receives what they belong to, to be
+ * remembered once they are flushed) or 0 if nothing changed or a client is still writing.
+ */
+int pca9685ShmCollect(struct pca9685ShmChip *c, int fd, unsigned int last, unsigned int *seq)
+{
+	unsigned short values[PIN_ALL];
+	int pin;
+
+	unsigned int now = atomic_load_explicit(&c->seq, memory_order_acquire);
+	if ((now & 1) || now == last)
+		return 0;
+
+	for (pin = 0; pin < PIN_ALL; pin++)
+		values[pin] = atomic_load_explicit(&c->value[pin], memory_order_relaxed);
+
+	// Torn copy: try again next round
+	atomic_thread_fence(memory_order_acquire);
+	if (atomic_load_explicit(&c->seq, memory_order_relaxed) != now)
+		return 0;
+
+	for (pin = 0; pin < PIN_ALL; pin++)
+		if (values[pin] != PCA9685_SHM_KEEP)
+			pca9685FramePWM(fd, pin, values[pin]);
+
+	*seq = now;
+	return 1;
+}
@@ -0,0 +1,560 @@
+/*************************************************************************
+ * pca9685show.c
+ *
+ * Show files: timestamped pin changes of any number of chips. The recorder
+ * captures what the library sends, the player maps a file and replays it
+ * at absolute deadlines without parsing or allocating anything per frame.
+ *
+ * This software is a devLib extension to wiringPi <http://wiringpi.com/>
+ * and enables it to control the Adafruit PCA9685 16-Channel 12-bit
+ * PWM/Servo Driver <http://www.adafruit.com/products/815> via I2C interface.
+ *
+ * Copyright (c) 2014 Reinhard Sprung
+ *
+ * If you have questions or improvements email me at
+ * reinhard.sprung[at]gmail.com
+ *
+ * This software is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * The given code is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You can view the contents of the licence at <http://www.gnu.org/licenses/>.
+ **************************************************************************
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "pca9685.h"
+#include "pca9685dev.h"
+
+// Tick of the event times if none is given. 32 bit times then cover 119 hours.
+#define DEFAULT_TICK_US 100
+
+// The player drops pages it's done with in steps of this size, so memory stays constant
+#define DROP_BYTES (1 << 20)
+
+// The largest chip number fitting into an event channel
+#define MAX_CHIPS 4096
+
+
+atomic_int pca9685Recording;
+
+/**
+ * A chip seen by the recorder
+ */
+struct recChip
+{
+	struct pca9685Dev *dev;
+	int bus;
+	unsigned short value[PIN_ALL];	// Last recorded values
+};
+
+/**
+ * The recorder. All fields are guarded by lock.
+ */
+static struct
+{
+	pthread_mutex_t lock;
+	FILE *file;
+	unsigned long long start;
+	unsigned int tickUs;
+	unsigned long long events;
+	unsigned int last;				// Time of the last event
+	int error;
+	struct recChip *chips;
+	int nchips;
+	struct pca9685Bus **buses;		// One per chip at most
+	int nbuses;
+} recorder = { PTHREAD_MUTEX_INITIALIZER };
+
+/**
+ * The player. The arrays are allocated when a show is opened.
+ */
+static struct
+{
+	pthread_mutex_t lock;			// Guards the show. While it plays, it stays as it is.
+	unsigned char *map;
+	size_t size;
+	const struct pca9685ShowHeader *header;
+	const struct pca9685ShowEvent *events;
+	const struct pca9685ShowChip *chips;
+	struct pca9685Dev **devs;		// Assigned device of each chip, 0 if none
+	int *bus;						// Index of its bus in buses
+	struct pca9685Bus **buses;
+	int *touched;					// Buses with staged pins in the current frame
+	int nbuses;
+	int playing;					// The show is in use by ShowPlay, guarded by lock
+	atomic_int running;				// Cleared by ShowStop
+} player = { PTHREAD_MUTEX_INITIALIZER };
+
+
+/**
+ * Returns the pwmWrite value the cache holds for a pin
+ */
+static unsigned short pinValue(const struct pca9685Dev *dev, int pin)
+{
+	const unsigned char *led = dev->led + 4 * pin;
+	int on = led[0] | led[1] << 8;
+	int off = led[2] | led[3] << 8;
+
+	if (off & 0x1000)
+		return 0;
+
+	if (on & 0x1000)
+		return 4096;
+
+	return (off - on) & 0x0FFF;
+}
+
+/**
+ * Appends an event to the file
+ */
+static void recordEvent(int chip, int pin, unsigned short value)
+{
+	unsigned long long ticks = (pca9685Now() - recorder.start) / (recorder.tickUs * 1000ull);
+	struct pca9685ShowEvent event = { ticks > 0xFFFFFFFF ? 0xFFFFFFFF : ticks, chip * PIN_ALL + pin, value };
+
+	if (fwrite(&event, sizeof(event), 1, recorder.file) != 1)
+		recorder.error = 1;
+
+	recorder.chips[chip].value[pin] = value;
+	recorder.last = event.time;
+	recorder.events++;
+}
+
+/**
+ * Returns the recorder's number of a device. A new one gets all its pins recorded
+ * as they are, so the show starts from a known state. Returns -1 if there's no room.
+ */
+static int recordChip(struct pca9685Dev *dev)
+{
+	int i, pin;
+
+	for (i = 0; i < recorder.nchips; i++)
+		if (recorder.chips[i].dev == dev)
+			return i;
+
+	if (recorder.nchips == MAX_CHIPS)
+		return -1;
+
+	struct recChip *chips = realloc(recorder.chips, (i + 1) * sizeof(struct recChip));
+	struct pca9685Bus **buses = realloc(recorder.buses, (i + 1) * sizeof(struct pca9685Bus *));
+	if (chips)
+		recorder.chips = chips;
+	if (buses)
+		recorder.buses = buses;
+	if (!chips || !buses)
+		return -1;
+
+	// Buses are numbered in the order they show up
+	int bus;
+	for (bus = 0; bus < recorder.nbuses && recorder.buses[bus] != dev->bus; bus++)
+		;
+	if (bus == recorder.nbuses)
+		recorder.buses[recorder.nbuses++] = dev->bus;
+
+	recorder.chips[i].dev = dev;
+	recorder.chips[i].bus = bus;
+	recorder.nchips++;
+
+	for (pin = 0; pin < PIN_ALL; pin++)
+		recordEvent(i, pin, pinValue(dev, pin));
+
+	return i;
+}
+
+/**
+ * Records the pins of a mask which changed since they were last recorded
+ */
+void pca9685RecordCapture(struct pca9685Dev *dev, int mask)
+{
+	int pin;
+
+	pthread_mutex_lock(&recorder.lock);
+
+	if (recorder.file)
+	{
+		int known = recorder.nchips;
+		int chip = recordChip(dev);
+
+		for (pin = 0; chip >= 0 && chip < known && pin < PIN_ALL; pin++)
+		{
+			unsigned short value = pinValue(dev, pin);
+
+			if ((mask & (1 << pin)) && value != recorder.chips[chip].value[pin])
+				recordEvent(chip, pin, value);
+		}
+	}
+
+	pthread_mutex_unlock(&recorder.lock);
+}
+
+/**
+ * Starts recording everything written to any chip into a show file. Event times count in
+ * ticks of tickUs microseconds (0: 100). All chips known so far are recorded as they are first.
+ * Returns 0 on success or -1 on error.
+ */
+int pca9685RecordStart(const char *path, int tickUs)
+{
+	struct pca9685ShowHeader header = { 0 };
+	struct pca9685Dev *dev;
+
+	if (!path || tickUs < 0)
+		return -1;
+
+	pthread_mutex_lock(&recorder.lock);
+
+	if (recorder.file)
+	{
+		pthread_mutex_unlock(&recorder.lock);
+		return -1;
+	}
+
+	recorder.file = fopen(path, "wb");
+	if (!recorder.file)
+	{
+		pthread_mutex_unlock(&recorder.lock);
+		return -1;
+	}
+
+	// The header is written again with the totals when recording stops
+	recorder.error = fwrite(&header, sizeof(header), 1, recorder.file) != 1;
+	recorder.tickUs = tickUs ? tickUs : DEFAULT_TICK_US;
+	recorder.start = pca9685Now();
+	recorder.events = 0;
+	recorder.last = 0;
+
+	for (dev = pca9685Devices; dev; dev = dev->next)
+		recordChip(dev);
+
+	atomic_store(&pca9685Recording, 1);
+
+	pthread_mutex_unlock(&recorder.lock);
+	return 0;
+}
+
+/**
+ * Stops recording and completes the file. Returns the number of events or -1 on error.
+ */
+long long pca9685RecordStop(void)
+{
+	struct pca9685ShowHeader header = { PCA9685_SHOW_MAGIC, PCA9685_SHOW_VERSION, sizeof(header) };
+	int i;
+
+	atomic_store(&pca9685Recording, 0);
+
+	pthread_mutex_lock(&recorder.lock);
+
+	if (!recorder.file)
+	{
+		pthread_mutex_unlock(&recorder.lock);
+		return -1;
+	}
+
+	for (i = 0; i < recorder.nchips; i++)
+	{
+		struct pca9685ShowChip chip = { recorder.chips[i].bus, recorder.chips[i].dev->address };
+
+		if (fwrite(&chip, sizeof(chip), 1, recorder.file) != 1)
+			recorder.error = 1;
+	}
+
+	header.tickUs = recorder.tickUs;
+	header.chips = recorder.nchips;
+	header.events = recorder.events;
+	header.duration = recorder.last;
+
+	if (fseek(recorder.file, 0, SEEK_SET) < 0 || fwrite(&header, sizeof(header), 1, recorder.file) != 1)
+		recorder.error = 1;
+
+	if (fclose(recorder.file) != 0)
+		recorder.error = 1;
+
+	long long ret = recorder.error ? -1 : (long long)recorder.events;
+
+	free(recorder.chips);
+	free(recorder.buses);
+	recorder.chips = 0;
+	recorder.buses = 0;
+	recorder.nchips = 0;
+	recorder.nbuses = 0;
+	recorder.file = 0;
+
+	pthread_mutex_unlock(&recorder.lock);
+	return ret;
+}
+
+/**
+ * Closes the show of the player, with its lock held
+ */
+static void closeShow(void)
+{
+	if (!player.map)
+		return;
+
+	munmap(player.map, player.size);
+	free(player.devs);
+	free(player.bus);
+	free(player.buses);
+	free(player.touched);
+
+	player.map = 0;
+	player.devs = 0;
+	player.bus = 0;
+	player.buses = 0;
+	player.touched = 0;
+}
+
+/**
+ * Maps a show file for the player. Nothing is read ahead, so even long shows open at once.
+ * Returns the number of chips in it or -1 on error (also while a show plays).
+ */
+int pca9685ShowOpen(const char *path)
+{
+	struct stat st;
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(struct pca9685ShowHeader))
+	{
+		close(fd);
+		return -1;
+	}
+
+	void *map = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED)
+		return -1;
+
+	// The number of events is checked by division, a product could wrap
+	const struct pca9685ShowHeader *h = map;
+	unsigned long long fixed = h->headerSize + h->chips * sizeof(struct pca9685ShowChip);
+
+	if (h->magic != PCA9685_SHOW_MAGIC || h->version != PCA9685_SHOW_VERSION || h->headerSize < sizeof(*h)
+		|| (h->headerSize & 3) || !h->tickUs || h->chips > MAX_CHIPS || fixed > (unsigned long long)st.st_size
+		|| h->events > (st.st_size - fixed) / sizeof(struct pca9685ShowEvent))
+	{
+		munmap(map, st.st_size);
+		return -1;
+	}
+
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	pthread_mutex_lock(&player.lock);
+
+	if (player.playing)
+	{
+		pthread_mutex_unlock(&player.lock);
+		munmap(map, st.st_size);
+		return -1;
+	}
+
+	closeShow();
+
+	player.map = map;
+	player.size = st.st_size;
+	player.header = h;
+	player.events = (const void *)(player.map + h->headerSize);
+	player.chips = (const void *)(player.events + h->events);
+	player.devs = calloc(h->chips + 1, sizeof(struct pca9685Dev *));
+	player.bus = calloc(h->chips + 1, sizeof(int));
+	player.buses = calloc(h->chips + 1, sizeof(struct pca9685Bus *));
+	player.touched = calloc(h->chips + 1, sizeof(int));
+	player.nbuses = 0;
+
+	if (!player.devs || !player.bus || !player.buses || !player.touched)
+	{
+		closeShow();
+		pthread_mutex_unlock(&player.lock);
+		return -1;
+	}
+
+	int chips = h->chips;
+
+	pthread_mutex_unlock(&player.lock);
+	return chips;
+}
+
+/**
+ * Tells where a chip of the show was recorded: the number of its bus (in the order
+ * the buses showed up) and its address. Returns 0 on success or -1 on error.
+ */
+int pca9685ShowChip(int chip, int *bus, int *i2cAddress)
+{
+	pthread_mutex_lock(&player.lock);
+
+	int ok = player.map && chip >= 0 && chip < player.header->chips;
+	if (ok && bus)
+		*bus = player.chips[chip].bus;
+	if (ok && i2cAddress)
+		*i2cAddress = player.chips[chip].address;
+
+	pthread_mutex_unlock(&player.lock);
+	return ok ? 0 : -1;
+}
+
+/**
+ * Plays a chip of the show on a device. Chips without one are left out.
+ * Returns 0 on success or -1 on error.
+ */
+int pca9685ShowAssign(int chip, int fd)
+{
+	struct pca9685Dev *dev = pca9685DevGet(fd);
+	int i;
+
+	if (!dev)
+		return -1;
+
+	pthread_mutex_lock(&player.lock);
+
+	if (!player.map || player.playing || chip < 0 || chip >= player.header->chips)
+	{
+		pthread_mutex_unlock(&player.lock);
+		return -1;
+	}
+
+	player.devs[chip] = dev;
+
+	// Renumber the buses of the assigned chips
+	player.nbuses = 0;
+	for (chip = 0; chip < player.header->chips; chip++)
+	{
+		if (!player.devs[chip])
+			continue;
+
+		for (i = 0; i < player.nbuses && player.buses[i] != player.devs[chip]->bus; i++)
+			;
+		if (i == player.nbuses)
+			player.buses[player.nbuses++] = player.devs[chip]->bus;
+
+		player.bus[chip] = i;
+	}
+
+	pthread_mutex_unlock(&player.lock);
+	return 0;
+}
+
+/**
+ * Plays the show on the calling thread until it ends or ShowStop is called. Each frame is staged
+ * at its deadline, counted from the start, and every bus it touched is flushed in one transfer.
+ * Frames that are due at the same time because the bus fell behind are merged, so the show
+ * catches up instead of drifting. Returns the number of frames played or -1 on error.
+ */
+long pca9685ShowPlay(void)
+{
+	unsigned long long i, dropped = 0;
+	long frames = 0;
+	int b, ret = 0;
+
+	pthread_mutex_lock(&player.lock);
+
+	if (!player.map || player.playing)
+	{
+		pthread_mutex_unlock(&player.lock);
+		return -1;
+	}
+
+	player.playing = 1;
+	atomic_store(&player.running, 1);
+
+	// Open, Assign and Close leave a playing show alone, so it's played without the lock
+	pthread_mutex_unlock(&player.lock);
+
+	const struct pca9685ShowEvent *events = player.events;
+	unsigned long long count = player.header->events;
+	unsigned long long tick = player.header->tickUs * 1000ull;
+	unsigned long long start = pca9685Now();
+
+	for (i = 0; i < count && atomic_load(&player.running); )
+	{
+		unsigned long long deadline = start + events[i].time * tick;
+		struct timespec ts = { deadline / 1000000000ull, deadline % 1000000000ull };
+
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0) == EINTR && atomic_load(&player.running))
+			;
+
+		// Everything that's due by now goes into this frame
+		unsigned long long due = (pca9685Now() - start) / tick;
+
+		for (; i < count && events[i].time <= due; i++)
+		{
+			int chip = events[i].channel / PIN_ALL;
+			struct pca9685Dev *dev = chip < player.header->chips ? player.devs[chip] : 0;
+
+			if (!dev)
+				continue;
+
+			pca9685BusLock(dev->bus);
+			pca9685DevStage(dev, events[i].channel % PIN_ALL, events[i].value);
+			pca9685BusUnlock(dev->bus);
+
+			player.touched[player.bus[chip]] = 1;
+		}
+
+		for (b = 0; b < player.nbuses; b++)
+		{
+			if (!player.touched[b])
+				continue;
+
+			player.touched[b] = 0;
+			if (pca9685BusFlush(player.buses[b]->fd, 0) < 0)
+				ret = -1;
+		}
+
+		frames++;
+
+		// Pages behind us are read again from the file if the show is played once more
+		unsigned long long offset = player.header->headerSize + i * sizeof(struct pca9685ShowEvent);
+		if (offset - dropped >= DROP_BYTES)
+		{
+			madvise(player.map + dropped, DROP_BYTES, MADV_DONTNEED);
+			dropped += DROP_BYTES;
+		}
+	}
+
+	pthread_mutex_lock(&player.lock);
+	player.playing = 0;
+	atomic_store(&player.running, 0);
+	pthread_mutex_unlock(&player.lock);
+
+	return ret < 0 ? -1 : frames;
+}
+
+/**
+ * Stops a playing show after its current frame. Can be called from a signal handler.
+ */
+void pca9685ShowStop(void)
+{
+	atomic_store(&player.running, 0);
+}
+
+/**
+ * Unmaps the show of the player. Does nothing while it plays, stop it first.
+ */
+void pca9685ShowClose(void)
+{
+	pthread_mutex_lock(&player.lock);
+
+	if (!player.playing)
+		closeShow();
+
+	pthread_mutex_unlock(&player.lock);
+}
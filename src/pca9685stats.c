@@ -0,0 +1,375 @@
+/*************************************************************************
+ * pca9685stats.c
+ *
+ * Counters of every transaction per bus and per device, and latency
+ * histograms of the public operations. Everything is a plain increment
+ * under the lock the operation holds anyway, so it can stay on.
+ *
+ * This software is a devLib extension to wiringPi <http://wiringpi.com/>
+ * and enables it to control the Adafruit PCA9685 16-Channel 12-bit
+ * PWM/Servo Driver <http://www.adafruit.com/products/815> via I2C interface.
+ *
+ * Copyright (c) 2014 Reinhard Sprung
+ *
+ * If you have questions or improvements email me at
+ * reinhard.sprung[at]gmail.com
+ *
+ * This software is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * The given code is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You can view the contents of the licence at <http://www.gnu.org/licenses/>.
+ **************************************************************************
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <linux/i2c.h>
+
+#include "pca9685.h"
+#include "pca9685dev.h"
+
+
+static const char *opNames[PCA9685_OPS] = { "pwmwrite", "pwmfreq", "fullon", "fulloff", "reset", "commit" };
+
+
+/**
+ * Finds the device at an address of a bus, 0 for group addresses
+ */
+static struct pca9685Dev *findDevice(struct pca9685Bus *bus, int address)
+{
+	struct pca9685Dev *dev;
+
+	if (address < 0)
+		address = bus->slave;
+
+	for (dev = pca9685Devices; dev; dev = dev->next)
+		if (dev->bus == bus && (dev->address < 0 ? bus->slave : dev->address) == address)
+			return dev;
+
+	return 0;
+}
+
+/**
+ * Counts a transaction
+ */
+static void tally(struct pca9685Counters *c, int read, int in, int out, int retries, int failed)
+{
+	if (read)
+		c->reads++;
+	else
+		c->writes++;
+
+	c->bytesRead += in;
+	c->bytesWritten += out;
+	c->retries += retries;
+	c->errors += failed;
+}
+
+/**
+ * Counts a transaction of a device. If it failed for good, the cache can't be trusted anymore.
+ */
+static void tallyDevice(struct pca9685Dev *dev, int read, int in, int out, int retries, int failed)
+{
+	if (!dev)
+		return;
+
+	tally(&dev->counters, read, in, out, retries, failed);
+
+	if (failed)
+		dev->degraded = 1;
+}
+
+/**
+ * Sends messages in one combined transfer, with retries, and counts it for the bus and each device on it
+ */
+int pca9685Transfer(struct pca9685Bus *bus, struct i2c_msg *msgs, int count)
+{
+	unsigned long long start = pca9685Now();
+	int ret, attempt = 0;
+
+	while ((ret = bus->ops->transfer(bus, msgs, count)) < 0 && pca9685BusRetry(bus, ++attempt, start))
+		;
+
+	int failed = ret < 0;
+	int retries = failed ? attempt - 1 : attempt;
+
+	struct pca9685Dev *dev = 0;
+	int i, read = 0, in = 0, out = 0;
+	int devRead = 0, devIn = 0, devOut = 0;
+
+	for (i = 0; i < count; i++)
+	{
+		// Messages of a chip are next to each other
+		struct pca9685Dev *owner = (i && msgs[i].addr == msgs[i - 1].addr) ? dev : findDevice(bus, msgs[i].addr);
+
+		if (owner != dev)
+		{
+			tallyDevice(dev, devRead, devIn, devOut, retries, failed);
+
+			dev = owner;
+			devRead = devIn = devOut = 0;
+		}
+
+		if (msgs[i].flags & I2C_M_RD)
+		{
+			read = devRead = 1;
+			in += msgs[i].len;
+			devIn += msgs[i].len;
+		}
+		else
+		{
+			out += msgs[i].len;
+			devOut += msgs[i].len;
+		}
+	}
+
+	tallyDevice(dev, devRead, devIn, devOut, retries, failed);
+	tally(&bus->counters, read, in, out, retries, failed);
+
+	return ret;
+}
+
+/**
+ * Reads consecutive registers through the transport, with retries, and counts it
+ */
+int pca9685Read(struct pca9685Bus *bus, int address, int reg, unsigned char *data, int len)
+{
+	unsigned long long start = pca9685Now();
+	int failed, attempt = 0;
+
+	while ((failed = bus->ops->read(bus, address, reg, data, len) < 0) && pca9685BusRetry(bus, ++attempt, start))
+		;
+
+	int retries = failed ? attempt - 1 : attempt;
+
+	tallyDevice(findDevice(bus, address), 1, len, 1, retries, failed);
+	tally(&bus->counters, 1, len, 1, retries, failed);
+
+	return failed ? -1 : 0;
+}
+
+/**
+ * Writes consecutive registers through the transport, with retries, and counts it
+ */
+int pca9685Write(struct pca9685Bus *bus, int address, int reg, const unsigned char *data, int len)
+{
+	unsigned long long start = pca9685Now();
+	int failed, attempt = 0;
+
+	while ((failed = bus->ops->write(bus, address, reg, data, len) < 0) && pca9685BusRetry(bus, ++attempt, start))
+		;
+
+	int retries = failed ? attempt - 1 : attempt;
+
+	tallyDevice(findDevice(bus, address), 0, 0, len + 1, retries, failed);
+	tally(&bus->counters, 0, 0, len + 1, retries, failed);
+
+	return failed ? -1 : 0;
+}
+
+/**
+ * Adds the time since start to the histogram of an operation.
+ * Bucket 0 holds everything below 1 us, bucket n from 2^(n-1) up to 2^n us.
+ */
+void pca9685DevTime(struct pca9685Dev *dev, int op, unsigned long long start)
+{
+	struct pca9685Histogram *h = &dev->hist[op];
+	unsigned long long ns = pca9685Now() - start;
+	unsigned long long us = ns / 1000;
+	int bucket = 0;
+
+	while (us && bucket < PCA9685_BUCKETS - 1)
+	{
+		us >>= 1;
+		bucket++;
+	}
+
+	h->count++;
+	h->totalNs += ns;
+	h->maxNs = ns > h->maxNs ? ns : h->maxNs;
+	h->bucket[bucket]++;
+}
+
+/**
+ * Appends formatted text at len, as far as it fits into size.
+ * Returns the new length, which keeps growing when the buffer is full.
+ */
+static int append(char *buf, int size, int len, const char *format, ...)
+{
+	va_list args;
+	int fits = buf && len < size;
+
+	va_start(args, format);
+	int n = vsnprintf(fits ? buf + len : 0, fits ? size - len : 0, format, args);
+	va_end(args);
+
+	return n < 0 ? len : len + n;
+}
+
+/**
+ * Copies the counters of a bus, everything else of stats is zero. If reset is set, they start over.
+ */
+static void busStats(struct pca9685Bus *bus, struct pca9685Stats *stats, int reset)
+{
+	struct pca9685Counters zero = { 0 };
+
+	pca9685BusLock(bus);
+
+	if (stats)
+	{
+		struct pca9685Stats empty = { { 0 } };
+		*stats = empty;
+		stats->bus = bus->counters;
+	}
+
+	if (reset)
+		bus->counters = zero;
+
+	pca9685BusUnlock(bus);
+}
+
+/**
+ * Copies the counters of a device and its bus and the latency histograms of the device's operations.
+ * If reset is set, those of the device start over. The bus counters are shared by all its devices,
+ * they only start over if fd is the bus (which has no device counters or histograms).
+ * Returns 0 on success or -1 on error.
+ */
+int pca9685Stats(int fd, struct pca9685Stats *stats, int reset)
+{
+	struct pca9685Bus *bus = pca9685BusGet(fd);
+	if (bus)
+	{
+		busStats(bus, stats, reset);
+		return 0;
+	}
+
+	struct pca9685Dev *dev = pca9685DevLock(fd);
+	if (!dev)
+		return -1;
+
+	if (stats)
+	{
+		stats->dev = dev->counters;
+		stats->bus = dev->bus->counters;
+
+		int op;
+		for (op = 0; op < PCA9685_OPS; op++)
+			stats->op[op] = dev->hist[op];
+
+		stats->degraded = dev->degraded;
+	}
+
+	if (reset)
+	{
+		struct pca9685Counters zero = { 0 };
+		struct pca9685Histogram empty = { 0 };
+		int op;
+
+		dev->counters = zero;
+
+		for (op = 0; op < PCA9685_OPS; op++)
+			dev->hist[op] = empty;
+	}
+
+	pca9685DevUnlock(dev);
+	return 0;
+}
+
+/**
+ * Appends the HELP and TYPE lines of a metric family
+ */
+static int family(char *buf, int size, int len, const char *name, const char *type, const char *help)
+{
+	return append(buf, size, len, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/**
+ * Appends a counter family with the value of the device and the bus, or only the bus if first is 1
+ */
+static int counter(char *buf, int size, int len, int fd, int first, const char *name, const char *help,
+				   unsigned long long dev, unsigned long long bus)
+{
+	const char *scope[2] = { "device", "bus" };
+	unsigned long long value[2] = { dev, bus };
+	int i;
+
+	len = family(buf, size, len, name, "counter", help);
+
+	for (i = first; i < 2; i++)
+		len = append(buf, size, len, "%s{fd=\"%d\",scope=\"%s\"} %llu\n", name, fd, scope[i], value[i]);
+
+	return len;
+}
+
+/**
+ * Writes the statistics of a device (or only the counters of a bus) as text in the Prometheus
+ * exposition format, with HELP and TYPE once per metric family.
+ * Histogram buckets are cumulative, le is the upper bound in microseconds.
+ * Returns the length of the whole text (like snprintf, it may be longer than size) or -1 on error.
+ */
+int pca9685StatsDump(int fd, char *buf, int size)
+{
+	struct pca9685Stats stats;
+
+	if (pca9685Stats(fd, &stats, 0) < 0)
+		return -1;
+
+	const struct pca9685Counters *d = &stats.dev, *b = &stats.bus;
+	int first = pca9685BusGet(fd) != 0;
+	int len = 0, timed = 0, op, n;
+
+	len = counter(buf, size, len, fd, first, "pca9685_reads_total", "Transactions that read registers", d->reads, b->reads);
+	len = counter(buf, size, len, fd, first, "pca9685_writes_total", "Transactions that only wrote", d->writes, b->writes);
+	len = counter(buf, size, len, fd, first, "pca9685_read_bytes_total", "Bytes read", d->bytesRead, b->bytesRead);
+	len = counter(buf, size, len, fd, first, "pca9685_written_bytes_total", "Bytes written, including register bytes", d->bytesWritten, b->bytesWritten);
+	len = counter(buf, size, len, fd, first, "pca9685_errors_total", "Transactions that failed", d->errors, b->errors);
+	len = counter(buf, size, len, fd, first, "pca9685_retries_total", "Transactions that were repeated after an error", d->retries, b->retries);
+
+	if (first)
+		return len;
+
+	len = family(buf, size, len, "pca9685_degraded", "gauge", "1 if the cache of the device may be wrong until it resyncs");
+	len = append(buf, size, len, "pca9685_degraded{fd=\"%d\"} %d\n", fd, stats.degraded);
+
+	for (op = 0; op < PCA9685_OPS; op++)
+		timed += stats.op[op].count != 0;
+
+	if (!timed)
+		return len;
+
+	len = family(buf, size, len, "pca9685_latency_us", "histogram", "Latency of the operations in microseconds");
+
+	for (op = 0; op < PCA9685_OPS; op++)
+	{
+		const struct pca9685Histogram *h = &stats.op[op];
+		unsigned long sum = 0;
+
+		if (!h->count)
+			continue;
+
+		for (n = 0; n < PCA9685_BUCKETS - 1; n++)
+		{
+			sum += h->bucket[n];
+			len = append(buf, size, len, "pca9685_latency_us_bucket{fd=\"%d\",op=\"%s\",le=\"%lu\"} %lu\n", fd, opNames[op], 1ul << n, sum);
+		}
+
+		len = append(buf, size, len, "pca9685_latency_us_bucket{fd=\"%d\",op=\"%s\",le=\"+Inf\"} %lu\n", fd, opNames[op], h->count);
+		len = append(buf, size, len, "pca9685_latency_us_sum{fd=\"%d\",op=\"%s\"} %.3f\n", fd, opNames[op], h->totalNs / 1e3);
+		len = append(buf, size, len, "pca9685_latency_us_count{fd=\"%d\",op=\"%s\"} %lu\n", fd, opNames[op], h->count);
+	}
+
+	len = family(buf, size, len, "pca9685_latency_us_max", "gauge", "Longest call of the operations in microseconds");
+
+	for (op = 0; op < PCA9685_OPS; op++)
+		if (stats.op[op].count)
+			len = append(buf, size, len, "pca9685_latency_us_max{fd=\"%d\",op=\"%s\"} %.3f\n", fd, opNames[op], stats.op[op].maxNs / 1e3);
+
+	return len;
+}
@@ -0,0 +1,786 @@
+/*************************************************************************
+ * pca9685test.c
+ *
+ * Regression tests against fake buses, no hardware needed.
+ * Build and run with "make test".
+ *
+ * This software is a devLib extension to wiringPi <http://wiringpi.com/>
+ * and enables it to control the Adafruit PCA9685 16-Channel 12-bit
+ * PWM/Servo Driver <http://www.adafruit.com/products/815> via I2C interface.
+ *
+ * Copyright (c) 2014 Reinhard Sprung
+ *
+ * If you have questions or improvements email me at
+ * reinhard.sprung[at]gmail.com
+ *
+ * This software is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * The given code is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You can view the contents of the licence at <http://www.gnu.org/licenses/>.
+ **************************************************************************
+ */
+
+#include "pca9685.h"
+#include "pca9685dev.h"
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#define ADDRESS 0x40
+#define HERTZ 50
+#define SHM_NAME "/pca9685test"
+#define NOTE_MAX 127
+
+#define CHECK(cond)		do { if (!(cond)) { printf("    %s:%d: %s\n", __FILE__, __LINE__, #cond); return 1; } } while (0)
+
+
+static int bus, fd;
+
+
+/**
+ * Every test gets a new fake bus with a single chip
+ */
+static int setup(void)
+{
+	bus = pca9685BusOpen(0, PCA9685_FAKE);
+	fd = pca9685BusAdd(bus, ADDRESS, HERTZ);
+
+	return fd < 0 ? -1 : 0;
+}
+
+/**
+ * Committing some pins keeps the others staged
+ */
+static int commitSubset(void)
+{
+	struct pca9685Dev *dev = pca9685DevGet(fd);
+
+	CHECK(pca9685FramePWM(fd, 3, 1000) == 0);
+	CHECK(pca9685FramePWM(fd, 5, 2000) == 0);
+	CHECK(pca9685DevCommit(dev, 1 << 5) == 1);
+	CHECK(pca9685FakeOutput(bus, ADDRESS, 3) == 0);
+	CHECK(pca9685FakeOutput(bus, ADDRESS, 5) == 2000);
+
+	CHECK(pca9685FrameCommit(fd) == 1);
+	CHECK(pca9685FakeOutput(bus, ADDRESS, 3) == 1000);
+	CHECK(pca9685Verify(fd) == 0);
+	return 0;
+}
+
+/**
+ * A pin written with WriteMicros doesn't take the staged pins along or drop them
+ */
+static int microsKeepsFrame(void)
+{
+	CHECK(pca9685FramePWM(fd, 3, 1000) == 0);
+	CHECK(pca9685WriteMicros(fd, 5, 1500) == 0);
+	CHECK(pca9685FakeOutput(bus, ADDRESS, 3) == 0);
+	CHECK(pca9685FakeOutput(bus, ADDRESS, 5) > 0);
+
+	CHECK(pca9685FrameCommit(fd) == 1);
+	CHECK(pca9685FakeOutput(bus, ADDRESS, 3) == 1000);
+	return 0;
+}
+
+/**
+ * With outputs changing on ACK, FullOn and FullOff go through the frame path without taking
+ * the staged pins along
+ */
+static int fullOnAckKeepsFrame(void)
+{
+	struct pca9685Mode2 mode;
+
+	CHECK(pca9685Mode2Get(fd, &mode) == 0);
+	mode.onAck = 1;
+	CHECK(pca9685Mode2Set(fd, &mode) == 0);
+
+	CHECK(pca9685FramePWM(fd, 7, 1234) == 0);
+	CHECK(pca9685FullOn(fd, 9, 1) == 0);
+	CHECK(pca9685FullOff(fd, 10, 1) == 0);
+	CHECK(pca9685FakeOutput(bus, ADDRESS, 7) == 0);
+	CHECK(pca9685FakeOutput(bus, ADDRESS, 9) == 4096);
+
+	CHECK(pca9685FrameCommit(fd) == 1);
+	CHECK(pca9685FakeOutput(bus, ADDRESS, 7) == 1234);
+	CHECK(pca9685Verify(fd) == 0);
+	return 0;
+}
+
+/**
+ * pwmWrite of the wiringPi pins (pca9685DevPWM underneath) doesn't drop the staged pins
+ */
+static int pwmWriteKeepsFrame(void)
+{
+	struct pca9685Dev *dev = pca9685DevGet(fd);
+
+	CHECK(pca9685FramePWM(fd, 3, 1000) == 0);
+	CHECK(pca9685DevPWM(dev, 5, 2000) == 0);
+	CHECK(pca9685DevPWM(dev, 6, 4096) == 0);
+	CHECK(pca9685FakeOutput(bus, ADDRESS, 3) == 0);
+	CHECK(pca9685FakeOutput(bus, ADDRESS, 5) == 2000);
+	CHECK(pca9685FakeOutput(bus, ADDRESS, 6) == 4096);
+
+	CHECK(pca9685FrameCommit(fd) == 1);
+	CHECK(pca9685FakeOutput(bus, ADDRESS, 3) == 1000);
+	return 0;
+}
+
+/**
+ * A synchronous write drops what was posted for its pin before, the writer doesn't overwrite it
+ */
+static int fullOffDropsPosted(void)
+{
+	struct pca9685LockStats stats;
+
+	CHECK(pca9685AsyncStart(fd) == 0);
+
+	// Async mode locks the bus without thread-safe mode, so the writer waits for the batch
+	CHECK(pca9685BatchBegin(fd) == 0);
+	CHECK(pca9685AsyncPWM(fd, 3, 1000) == 0);
+	CHECK(pca9685AsyncPWM(fd, 4, 2000) == 0);
+	CHECK(pca9685FullOff(fd, 3, 1) == 0);
+	pca9685BatchEnd(fd);
+
+	CHECK(pca9685AsyncFlush(fd) == 0);
+	CHECK(pca9685FakeOutput(bus, ADDRESS, 3) == 0);
+	CHECK(pca9685FakeOutput(bus, ADDRESS, 4) == 2000);
+	CHECK(pca9685LockStats(fd, &stats, 0) == 0 && stats.locks > 0);
+
+	pca9685AsyncStop(fd);
+	CHECK(pca9685AsyncPWM(fd, 3, 1000) < 0);
+	CHECK(pca9685Verify(fd) == 0);
+	return 0;
+}
+
+/**
+ * Manual motion steps don't make up an update rate
+ */
+static int manualStepNoRate(void)
+{
+	struct pca9685MotionStats stats;
+
+	CHECK(pca9685MotionMove(fd, 0, 1500, 1000, 10000, 0) == 0);
+	CHECK(pca9685MotionStep(0.02) >= 0);
+	pca9685MotionStats(&stats, 0);
+	CHECK(stats.steps > 0);
+	CHECK(stats.achievedHz == 0);
+	return 0;
+}
+
+static atomic_int statsFrames;
+
+/**
+ * Producer which reads the scheduler statistics
+ */
+static int statsProducer(unsigned long frame, void *arg)
+{
+	struct pca9685SchedStats stats;
+
+	pca9685SchedStats(&stats, 0);
+	statsFrames++;
+
+	return pca9685FramePWM(fd, 1, 100 + frame);
+}
+
+/**
+ * Producers can read the statistics, the scheduler thread locks the bus
+ */
+static int producerStats(void)
+{
+	struct pca9685LockStats stats;
+
+	statsFrames = 0;
+	CHECK(pca9685SchedAdd(statsProducer, 0) == 0);
+	CHECK(pca9685SchedRun(1000, 3) == 0);
+	CHECK(statsFrames > 0);
+
+	CHECK(pca9685LockStats(fd, &stats, 1) == 0);
+	CHECK(pca9685SchedStart(1000) == 0);
+	while (statsFrames < 6)
+		sched_yield();
+	pca9685SchedStop();
+
+	CHECK(pca9685LockStats(fd, &stats, 0) == 0 && stats.locks > 0);
+	CHECK(pca9685SchedRemove(statsProducer, 0) == 0);
+	return 0;
+}
+
+/**
+ * A show whose event count makes the size wrap around is refused
+ */
+static int showSizeWraps(void)
+{
+	struct pca9685ShowHeader h = { PCA9685_SHOW_MAGIC, PCA9685_SHOW_VERSION, sizeof(h), 100, 1 };
+	unsigned char tail[32] = { 0 };
+	char path[] = "/tmp/pca9685testXXXXXX";
+
+	// 32 + events * 8 + 4 wraps to 12
+	h.events = 0x1FFFFFFFFFFFFFFDull;
+
+	int file = mkstemp(path);
+	CHECK(file >= 0);
+	CHECK(write(file, &h, sizeof(h)) == sizeof(h) && write(file, tail, sizeof(tail)) == sizeof(tail));
+	close(file);
+
+	int ret = pca9685ShowOpen(path);
+	unlink(path);
+	CHECK(ret < 0);
+	return 0;
+}
+
+/**
+ * ShowPlay returns the number of frames, also for chips that aren't played anywhere
+ */
+static int showPlayFrames(void)
+{
+	char path[] = "/tmp/pca9685testXXXXXX";
+	struct timespec ts = { 0, 20000000 };
+
+	int file = mkstemp(path);
+	CHECK(file >= 0);
+	close(file);
+
+	// The chips as they are, then a second frame
+	CHECK(pca9685RecordStart(path, 100) == 0);
+	nanosleep(&ts, 0);
+	CHECK(pca9685PWMWrite(fd, 2, 0, 1000) == 0);
+	CHECK(pca9685RecordStop() > 0);
+
+	int chips = pca9685ShowOpen(path);
+	unlink(path);
+	CHECK(chips > 0);
+
+	CHECK(pca9685ShowPlay() == 2);
+	pca9685ShowClose();
+	return 0;
+}
+
+/**
+ * A transaction that fails less often than the policy allows goes through on a retry
+ */
+static int retryRecovers(void)
+{
+	struct pca9685Stats stats;
+
+	CHECK(pca9685RetryPolicy(fd, 3, 0, 100) == 0);
+	CHECK(pca9685Stats(fd, 0, 1) == 0);
+	CHECK(pca9685FakeFail(bus, ADDRESS, 2) == 0);
+
+	CHECK(pca9685PWMWrite(fd, 2, 0, 1000) == 0);
+	CHECK(pca9685FakeOutput(bus, ADDRESS, 2) == 1000);
+	CHECK(pca9685Stats(fd, &stats, 0) == 0);
+	CHECK(stats.dev.retries == 2 && stats.dev.errors == 0);
+	CHECK(stats.degraded == 0);
+	return 0;
+}
+
+/**
+ * A flush that runs out of retries leaves the cache alone and the chip degraded,
+ * the next flush resyncs it
+ */
+static int flushExhausted(void)
+{
+	int on, off;
+
+	CHECK(pca9685RetryPolicy(fd, 2, 0, 0) == 0);
+	CHECK(pca9685FakeFail(bus, ADDRESS, 2) == 0);
+
+	CHECK(pca9685FramePWM(fd, 4, 1500) == 0);
+	CHECK(pca9685BusFlush(bus, 0) < 0);
+	CHECK(pca9685Degraded(fd) == 1);
+	CHECK(pca9685PWMRead(fd, 4, &on, &off) == 0 && off == 0x1000);
+
+	// The pin stayed staged, the next flush sends it
+	CHECK(pca9685BusFlush(bus, 0) == 1);
+	CHECK(pca9685Degraded(fd) == 0);
+	CHECK(pca9685FakeOutput(bus, ADDRESS, 4) == 1500);
+	CHECK(pca9685Verify(fd) == 0);
+	return 0;
+}
+
+/**
+ * A chip that is gone costs no more than the deadline, once it's back the next write resyncs it
+ */
+static int retryDeadline(void)
+{
+	struct pca9685Stats stats;
+	struct timespec t0, t1;
+
+	CHECK(pca9685RetryPolicy(fd, 1000, 2000, 100) == 0);
+	CHECK(pca9685Stats(fd, 0, 1) == 0);
+	CHECK(pca9685FakeFail(bus, ADDRESS, -1) == 0);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	CHECK(pca9685PWMWrite(fd, 6, 0, 500) < 0);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	long us = (t1.tv_sec - t0.tv_sec) * 1000000 + (t1.tv_nsec - t0.tv_nsec) / 1000;
+	CHECK(us < 50000);
+	CHECK(pca9685Stats(fd, &stats, 0) == 0);
+	CHECK(stats.dev.retries > 0 && stats.dev.retries < 999 && stats.dev.errors == 1);
+	CHECK(pca9685Degraded(fd) == 1);
+
+	CHECK(pca9685FakeFail(bus, ADDRESS, 0) == 0);
+	CHECK(pca9685PWMWrite(fd, 6, 0, 500) == 0);
+	CHECK(pca9685Degraded(fd) == 0);
+	CHECK(pca9685FakeOutput(bus, ADDRESS, 6) == 500);
+	CHECK(pca9685Verify(fd) == 0);
+	return 0;
+}
+
+/**
+ * A motion step only sends the pins of its servos, pins staged by someone else stay staged
+ */
+static int motionKeepsFrame(void)
+{
+	CHECK(pca9685FramePWM(fd, 3, 1000) == 0);
+	CHECK(pca9685MotionMove(fd, 0, 1500, 10000, 100000, 0) == 0);
+	CHECK(pca9685MotionStep(0.01) == 1);
+	CHECK(pca9685FakeOutput(bus, ADDRESS, 0) > 0);
+	CHECK(pca9685FakeOutput(bus, ADDRESS, 3) == 0);
+
+	CHECK(pca9685FrameCommit(fd) == 1);
+	CHECK(pca9685FakeOutput(bus, ADDRESS, 3) == 1000);
+	return 0;
+}
+
+static unsigned long early;
+
+/**
+ * Returns the transfers on the test bus since the last call and adds up restarts that came too early
+ */
+static unsigned long transfers(void)
+{
+	struct pca9685FakeStats stats;
+
+	pca9685FakeStats(bus, &stats, 1);
+	early += stats.early;
+	return stats.transfers;
+}
+
+/**
+ * Tones cost what they promise: one retune per new pitch, none for the same prescale, a single
+ * write after a rest. Sequences keep their deadlines.
+ */
+static int toneTransfers(void)
+{
+	struct pca9685Note song[3] = { { 69, 1 }, { -1, 1 }, { 72, 1 } };
+	struct pca9685Tone tone, next;
+	int a;
+
+	CHECK(pca9685ToneSetup(fd, 0, NAN) < 0);
+	CHECK(pca9685ToneSetup(fd, 0, -1) < 0);
+	CHECK(pca9685ToneSetup(fd, 0, 0) > 0);
+	CHECK(pca9685ToneInfo(fd, 69, &tone) == 0 && tone.freq == 440);
+
+	// Two notes out of reach share the highest frequency
+	for (a = NOTE_MAX - 1; a > 0; a--)
+	{
+		pca9685ToneInfo(fd, a, &tone);
+		pca9685ToneInfo(fd, a + 1, &next);
+		if (tone.prescale == next.prescale)
+			break;
+	}
+	CHECK(a > 0);
+
+	transfers();
+	early = 0;
+	CHECK(pca9685ToneNote(fd, a) == 0);
+	CHECK(transfers() == 2);
+	CHECK(pca9685FakeOutput(bus, ADDRESS, 0) == 2048);
+
+	CHECK(pca9685ToneNote(fd, a + 1) == 0);
+	CHECK(transfers() == 0);
+
+	CHECK(pca9685ToneNote(fd, -1) == 0);
+	CHECK(transfers() == 1);
+	CHECK(pca9685FakeOutput(bus, ADDRESS, 0) == 0);
+
+	CHECK(pca9685ToneNote(fd, a) == 0);
+	CHECK(transfers() == 1);
+
+	// A new pitch while sounding restarts after the oscillator settled
+	CHECK(pca9685ToneNote(fd, 69) == 0);
+	CHECK(transfers() == 2);
+	CHECK(pca9685ToneNote(fd, -1) == 0);
+
+	unsigned long long start = pca9685Now();
+	CHECK(pca9685TonePlay(fd, song, 3, 6000) == 3);
+	unsigned long long ms = (pca9685Now() - start) / 1000000;
+
+	CHECK(ms >= 30 && ms < 200);
+	CHECK(pca9685FakeOutput(bus, ADDRESS, 0) == 0);
+	transfers();
+	CHECK(early == 0);
+	return 0;
+}
+
+/**
+ * Only added chips answer on a fake bus, a write to any other address gets a NACK
+ */
+static int fakeNoPhantoms(void)
+{
+	int addresses[2] = { 0x41, 0x42 }, handles[2];
+
+	CHECK(pca9685GroupWrite(bus, 0x71, 0, 0, 1000) < 0);
+	CHECK(pca9685FakeOutput(bus, 0x71, 0) < 0);
+
+	CHECK(pca9685FakeAdd(bus, 0x41) == 0);
+	CHECK(pca9685FakeOutput(bus, 0x41, 0) == 0);
+	CHECK(pca9685BusInit(bus, addresses, 2, HERTZ, handles) == 1);
+	CHECK(handles[0] >= 0 && handles[1] < 0);
+	return 0;
+}
+
+/**
+ * A group write drops the values members staged for the pin, a later commit can't undo it
+ */
+static int groupWriteDropsFrame(void)
+{
+	CHECK(pca9685GroupJoin(fd, 1, 0x71) == 0);
+	CHECK(pca9685FramePWM(fd, 3, 1000) == 0);
+	CHECK(pca9685FramePWM(fd, 4, 1000) == 0);
+
+	CHECK(pca9685GroupWrite(bus, 0x71, 3, 0, 2000) == 1);
+	CHECK(pca9685FrameCommit(fd) == 1);
+	CHECK(pca9685FakeOutput(bus, ADDRESS, 3) == 2000);
+	CHECK(pca9685FakeOutput(bus, ADDRESS, 4) == 1000);
+
+	CHECK(pca9685GroupWrite(bus, 0x80, 3, 0, 2000) < 0);
+	return 0;
+}
+
+/**
+ * Resetting the statistics of a device leaves the counters of its bus alone, resetting the bus clears them
+ */
+static int statsResetScope(void)
+{
+	struct pca9685Stats stats;
+	char text[16384];
+
+	CHECK(pca9685PWMWrite(fd, 1, 0, 1000) == 0);
+	CHECK(pca9685StatsDump(fd, text, sizeof(text)) < (int)sizeof(text));
+	CHECK(strstr(text, "# TYPE pca9685_writes_total counter\n"));
+	CHECK(strstr(text, "# TYPE pca9685_latency_us histogram\n"));
+
+	CHECK(pca9685Stats(fd, &stats, 1) == 0 && stats.dev.writes > 0);
+	CHECK(pca9685Stats(fd, &stats, 0) == 0);
+	CHECK(stats.dev.writes == 0 && stats.bus.writes > 0);
+
+	CHECK(pca9685Stats(bus, &stats, 1) == 0 && stats.bus.writes > 0 && stats.dev.writes == 0);
+	CHECK(pca9685Stats(fd, &stats, 0) == 0 && stats.bus.writes == 0);
+	return 0;
+}
+
+/**
+ * AsyncFlush tells when the round it waited for failed on the wire
+ */
+static int asyncFlushFails(void)
+{
+	CHECK(pca9685AsyncStart(fd) == 0);
+	CHECK(pca9685RetryPolicy(fd, 1, 0, 0) == 0);
+
+	CHECK(pca9685FakeFail(bus, ADDRESS, -1) == 0);
+	CHECK(pca9685AsyncPWM(fd, 8, 1000) == 0);
+	CHECK(pca9685AsyncFlush(fd) < 0);
+
+	CHECK(pca9685FakeFail(bus, ADDRESS, 0) == 0);
+	CHECK(pca9685AsyncPWM(fd, 8, 1000) == 0);
+	CHECK(pca9685AsyncFlush(fd) == 0);
+	CHECK(pca9685FakeOutput(bus, ADDRESS, 8) == 1000);
+
+	pca9685AsyncStop(fd);
+	return 0;
+}
+
+static atomic_int racing;
+
+/**
+ * Posts and reads async state until racing is cleared
+ */
+static void *racePoster(void *arg)
+{
+	int i = 0;
+
+	while (atomic_load(&racing))
+	{
+		pca9685AsyncPWM(fd, i & 15, i & 4095);
+		i++;
+		pca9685AsyncCoalesced(fd);
+		pca9685AsyncLatency(fd, 0, 0);
+	}
+
+	return 0;
+}
+
+/**
+ * Another thread keeps using async mode while it is started and stopped
+ */
+static int stopRacesPost(void)
+{
+	pthread_t thread;
+	int i;
+
+	atomic_store(&racing, 1);
+	CHECK(pthread_create(&thread, 0, racePoster, 0) == 0);
+
+	for (i = 0; i < 200; i++)
+	{
+		pca9685AsyncStart(fd);
+		pca9685AsyncStop(fd);
+	}
+
+	atomic_store(&racing, 0);
+	pthread_join(thread, 0);
+
+	CHECK(pca9685AsyncActive(fd) == 0);
+	return 0;
+}
+
+/**
+ * Shared memory with the chip of the test, what an earlier run left behind is gone
+ */
+static struct pca9685ShmHeader *shmCreate(size_t *size)
+{
+	int zero = 0;
+
+	shm_unlink(SHM_NAME);
+	return pca9685ShmCreate(SHM_NAME, &fd, &zero, 1, size);
+}
+
+static void shmDestroy(struct pca9685ShmHeader *h, size_t size)
+{
+	pca9685ShmClose();
+	munmap(h, size);
+	shm_unlink(SHM_NAME);
+}
+
+/**
+ * A frame of a client reaches the chip, the daemon copies it only once
+ */
+static int shmFrameReaches(void)
+{
+	int values[3] = { 100, 2000, 4096 };
+	unsigned int seq = 0;
+	size_t size;
+
+	struct pca9685ShmHeader *h = shmCreate(&size);
+	CHECK(h);
+	CHECK(pca9685ShmOpen(SHM_NAME) == 1);
+	CHECK(pca9685ShmFind(0, ADDRESS) == 0);
+
+	CHECK(pca9685ShmFrame(0, 2, 3, values) == 0);
+	CHECK(pca9685ShmCollect(&h->chip[0], fd, seq, &seq) == 1);
+	CHECK(pca9685BusFlush(bus, 0) == 3);
+	CHECK(pca9685FakeOutput(bus, ADDRESS, 2) == 100);
+	CHECK(pca9685FakeOutput(bus, ADDRESS, 3) == 2000);
+	CHECK(pca9685FakeOutput(bus, ADDRESS, 4) == 4096);
+	CHECK(pca9685ShmCollect(&h->chip[0], fd, seq, &seq) == 0);
+
+	shmDestroy(h, size);
+	return 0;
+}
+
+static atomic_int writing;
+
+/**
+ * Stores the same value on all pins of the test chip until writing is cleared
+ */
+static void *shmWriter(void *arg)
+{
+	int v = 0;
+
+	while (atomic_load(&writing))
+		pca9685ShmWrite(0, PIN_ALL, v++ & 4095);
+
+	return 0;
+}
+
+/**
+ * The daemon doesn't copy half a write: not while seq is odd, nor when seq changed while copying
+ */
+static int shmTornRetried(void)
+{
+	unsigned int seq = 0;
+	pthread_t thread;
+	size_t size;
+	int i, pin;
+
+	struct pca9685Dev *dev = pca9685DevGet(fd);
+	struct pca9685ShmHeader *h = shmCreate(&size);
+	struct pca9685ShmChip *c = &h->chip[0];
+	CHECK(h);
+	CHECK(pca9685ShmOpen(SHM_NAME) == 1);
+
+	// A client in the middle of a write
+	atomic_fetch_add(&c->seq, 1);
+	atomic_store(&c->value[5], 1000);
+	CHECK(pca9685ShmCollect(c, fd, seq, &seq) == 0);
+	atomic_fetch_add(&c->seq, 1);
+	CHECK(pca9685ShmCollect(c, fd, seq, &seq) == 1);
+	CHECK(pca9685BusFlush(bus, 0) == 1);
+	CHECK(pca9685FakeOutput(bus, ADDRESS, 5) == 1000);
+
+	// Every copy that made it holds a single write
+	atomic_store(&writing, 1);
+	CHECK(pthread_create(&thread, 0, shmWriter, 0) == 0);
+
+	for (i = 0; i < 100000; i++)
+	{
+		if (!pca9685ShmCollect(c, fd, seq, &seq))
+			continue;
+
+		for (pin = 1; pin < PIN_ALL; pin++)
+			if (memcmp(dev->frame + 4 * pin, dev->frame, 4))
+				break;
+
+		if (pin < PIN_ALL)
+			break;
+	}
+
+	atomic_store(&writing, 0);
+	pthread_join(thread, 0);
+	CHECK(i == 100000);
+
+	shmDestroy(h, size);
+	return 0;
+}
+
+/**
+ * A client that dies holding the lock of a chip doesn't block the others, its half write is kept
+ */
+static int shmDeadOwner(void)
+{
+	unsigned int seq = 0;
+	size_t size;
+	int status;
+
+	struct pca9685ShmHeader *h = shmCreate(&size);
+	struct pca9685ShmChip *c = &h->chip[0];
+	CHECK(h);
+	CHECK(pca9685ShmOpen(SHM_NAME) == 1);
+
+	pid_t pid = fork();
+	if (!pid)
+	{
+		pthread_mutex_lock(&c->lock);
+		atomic_fetch_add(&c->seq, 1);
+		atomic_store(&c->value[0], 777);
+		_exit(0);
+	}
+
+	CHECK(pid > 0 && waitpid(pid, &status, 0) == pid);
+	CHECK(pca9685ShmCollect(c, fd, seq, &seq) == 0);
+
+	CHECK(pca9685ShmWrite(0, 1, 100) == 0);
+	CHECK((atomic_load(&c->seq) & 1) == 0);
+	CHECK(pca9685ShmCollect(c, fd, seq, &seq) == 1);
+	CHECK(pca9685BusFlush(bus, 0) == 2);
+	CHECK(pca9685FakeOutput(bus, ADDRESS, 0) == 777);
+	CHECK(pca9685FakeOutput(bus, ADDRESS, 1) == 100);
+
+	// The lock works as before
+	CHECK(pca9685ShmWrite(0, 1, 200) == 0);
+
+	shmDestroy(h, size);
+	return 0;
+}
+
+/**
+ * A second daemon can't take the shared memory of a running one, but of one that died
+ */
+static int shmTakeover(void)
+{
+	size_t size, again;
+	int status;
+
+	struct pca9685ShmHeader *h = shmCreate(&size);
+	CHECK(h);
+
+	int zero = 0;
+	errno = 0;
+	CHECK(!pca9685ShmCreate(SHM_NAME, &fd, &zero, 1, &again) && errno == EEXIST);
+
+	pid_t pid = fork();
+	if (!pid)
+		_exit(0);
+
+	CHECK(pid > 0 && waitpid(pid, &status, 0) == pid);
+	h->pid = pid;
+	munmap(h, size);
+
+	h = pca9685ShmCreate(SHM_NAME, &fd, &zero, 1, &size);
+	CHECK(h && h->pid == getpid());
+
+	shmDestroy(h, size);
+	return 0;
+}
+
+
+struct test
+{
+	const char *name;
+	int (*run)(void);
+};
+
+static const struct test tests[] =
+{
+	{ "commit of a subset",		commitSubset },
+	{ "WriteMicros keeps the frame",	microsKeepsFrame },
+	{ "FullOn on ACK keeps the frame",	fullOnAckKeepsFrame },
+	{ "pwmWrite keeps the frame",		pwmWriteKeepsFrame },
+	{ "FullOff drops posted values",	fullOffDropsPosted },
+	{ "manual steps have no rate",		manualStepNoRate },
+	{ "producers read the statistics",	producerStats },
+	{ "show size can't wrap",			showSizeWraps },
+	{ "ShowPlay counts frames",		showPlayFrames },
+	{ "retry recovers",					retryRecovers },
+	{ "flush runs out of retries",		flushExhausted },
+	{ "retries stop at the deadline",	retryDeadline },
+	{ "motion steps keep the frame",	motionKeepsFrame },
+	{ "tones cost what they promise",	toneTransfers },
+	{ "fake buses have no phantom chips",	fakeNoPhantoms },
+	{ "group writes drop the frame",	groupWriteDropsFrame },
+	{ "stats reset their own scope",	statsResetScope },
+	{ "AsyncFlush reports failures",	asyncFlushFails },
+	{ "AsyncStop races posts",			stopRacesPost },
+	{ "shm frames reach the chip",		shmFrameReaches },
+	{ "shm torn copies are retried",	shmTornRetried },
+	{ "shm survives a dead writer",		shmDeadOwner },
+	{ "shm taken over from dead daemons",	shmTakeover },
+};
+
+
+int main(void)
+{
+	int i, failed = 0;
+
+	for (i = 0; i < sizeof(tests) / sizeof(tests[0]); i++)
+	{
+		int ret = setup() < 0 ? -1 : tests[i].run();
+
+		printf("%-40s %s\n", tests[i].name, ret ? "FAILED" : "ok");
+		failed += ret != 0;
+	}
+
+	printf("\n%d of %d failed\n", failed, i);
+
+	return failed != 0;
+}
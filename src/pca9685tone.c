@@ -0,0 +1,265 @@
+/*************************************************************************
+ * pca9685tone.c
+ *
+ * Tones for piezo discs and buzzers. A chip plays one voice: the pitch is
+ * its PWM frequency, the pin runs at 50% duty. The prescale of every note
+ * is worked out once, sequences play at absolute deadlines.
+ *
+ * This software is a devLib extension to wiringPi <http://wiringpi.com/>
+ * and enables it to control the Adafruit PCA9685 16-Channel 12-bit
+ * PWM/Servo Driver <http://www.adafruit.com/products/815> via I2C interface.
+ *
+ * Copyright (c) 2014 Reinhard Sprung
+ *
+ * If you have questions or improvements email me at
+ * reinhard.sprung[at]gmail.com
+ *
+ * This software is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * The given code is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You can view the contents of the licence at <http://www.gnu.org/licenses/>.
+ **************************************************************************
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "pca9685.h"
+#include "pca9685dev.h"
+
+// MIDI note numbers
+#define NOTES 128
+#define NOTE_A4 69
+
+// Half the distance to the next semitone. Notes further off are out of reach of the prescale.
+#define MAX_CENTS 50
+
+
+/**
+ * A chip playing tones
+ */
+struct voice
+{
+	int fd;
+	int pin;
+	int note;						// Note that's sounding, -1 if none
+	struct pca9685Tone table[NOTES];
+	struct voice *next;
+};
+
+/**
+ * All voices. The list is guarded by lock.
+ */
+static struct
+{
+	pthread_mutex_t lock;
+	struct voice *voices;
+	atomic_int playing;
+} tones = { PTHREAD_MUTEX_INITIALIZER };
+
+
+/**
+ * Finds the voice of a chip
+ */
+static struct voice *findVoice(int fd)
+{
+	struct voice *v;
+
+	for (v = tones.voices; v; v = v->next)
+		if (v->fd == fd)
+			return v;
+
+	return 0;
+}
+
+/**
+ * Lets a chip play tones on a pin (16: all pins), tuned to a4 (0: 440 Hz). Works out the prescale
+ * of every MIDI note and its error for the oscillator of the chip, call it again after changing that.
+ * Returns the number of notes within 50 cents or -1 on error.
+ */
+int pca9685ToneSetup(int fd, int pin, float a4)
+{
+	struct pca9685Dev *dev = pca9685DevGet(fd);
+	int note, playable = 0;
+
+	if (!dev || pin < 0 || pin > PIN_ALL || !isfinite(a4) || a4 < 0)
+		return -1;
+
+	pthread_mutex_lock(&tones.lock);
+
+	struct voice *v = findVoice(fd);
+	if (!v)
+	{
+		v = calloc(1, sizeof(struct voice));
+		if (!v)
+		{
+			pthread_mutex_unlock(&tones.lock);
+			return -1;
+		}
+
+		v->fd = fd;
+		v->note = -1;
+		v->next = tones.voices;
+		tones.voices = v;
+	}
+
+	v->pin = pin;
+
+	for (note = 0; note < NOTES; note++)
+	{
+		struct pca9685Tone *t = &v->table[note];
+
+		t->freq = (a4 ? a4 : 440) * pow(2, (note - NOTE_A4) / 12.0);
+		t->prescale = pca9685DevPrescale(dev, t->freq);
+		t->achieved = dev->osc / (4096.0 * (t->prescale + 1));
+		t->cents = 1200 * log2(t->achieved / t->freq);
+
+		playable += fabs(t->cents) <= MAX_CENTS;
+	}
+
+	pthread_mutex_unlock(&tones.lock);
+	return playable;
+}
+
+/**
+ * Copies the frequency, prescale and error of a note.
+ * Returns 0 if it's within 50 cents, 1 if it's further off or -1 on error.
+ */
+int pca9685ToneInfo(int fd, int note, struct pca9685Tone *tone)
+{
+	if (note < 0 || note >= NOTES)
+		return -1;
+
+	pthread_mutex_lock(&tones.lock);
+
+	struct voice *v = findVoice(fd);
+	if (v && tone)
+		*tone = v->table[note];
+
+	int ret = !v ? -1 : fabs(v->table[note].cents) > MAX_CENTS;
+
+	pthread_mutex_unlock(&tones.lock);
+	return ret;
+}
+
+/**
+ * Sounds a note right away, -1 silences the voice. A new pitch only costs the sleep, prescale and wake
+ * transaction (nothing if the prescale stays the same), a note after a rest only the write of its pin.
+ * Returns 0 on success or -1 on error.
+ */
+int pca9685ToneNote(int fd, int note)
+{
+	int ret = 0;
+
+	if (note >= NOTES)
+		return -1;
+
+	pthread_mutex_lock(&tones.lock);
+
+	struct voice *v = findVoice(fd);
+	if (!v)
+	{
+		pthread_mutex_unlock(&tones.lock);
+		return -1;
+	}
+
+	if (note < 0)
+	{
+		if (v->note >= 0)
+			ret = pca9685FullOff(fd, v->pin, 1);
+
+		v->note = -1;
+		pthread_mutex_unlock(&tones.lock);
+		return ret;
+	}
+
+	struct pca9685Dev *dev = pca9685DevLock(fd);
+	if (dev && pca9685DevRecover(dev) < 0)
+	{
+		pca9685DevUnlock(dev);
+		dev = 0;
+	}
+
+	if (!dev)
+	{
+		pthread_mutex_unlock(&tones.lock);
+		return -1;
+	}
+
+	// While it sounds, the outputs have to restart after the oscillator settled. After a rest,
+	// writing the pin starts them, so there's no need to wait.
+	ret = pca9685DevRetune(dev, v->table[note].prescale, v->note >= 0 ? PCA9685_RETUNE_RESTART : 0);
+
+	// Half of the period high, a single write of the pin
+	if (ret == 0 && v->note < 0)
+		ret = pca9685PWMWrite(fd, v->pin, 0, 2048);
+
+	pca9685DevUnlock(dev);
+
+	v->note = ret < 0 ? -1 : note;
+
+	pthread_mutex_unlock(&tones.lock);
+	return ret;
+}
+
+/**
+ * Plays a sequence of notes at tempo beats per minute on the calling thread. Every note starts at
+ * its deadline, counted from the start of the sequence, so the time a note change takes on the bus
+ * doesn't add up. The voice is silenced at the end. Returns the number of notes played or -1 on error.
+ */
+int pca9685TonePlay(int fd, const struct pca9685Note *notes, int count, float tempo)
+{
+	double beats = 0;
+	int i;
+
+	if (!notes || count < 0 || tempo <= 0 || atomic_exchange(&tones.playing, 1))
+		return -1;
+
+	double beatNs = 60e9 / tempo;
+	unsigned long long start = pca9685Now();
+
+	for (i = 0; i <= count && atomic_load(&tones.playing); i++)
+	{
+		unsigned long long deadline = start + (unsigned long long)(beats * beatNs);
+		struct timespec ts = { deadline / 1000000000ull, deadline % 1000000000ull };
+
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0) == EINTR && atomic_load(&tones.playing))
+			;
+
+		// The end of the last note
+		if (i == count)
+			break;
+
+		if (pca9685ToneNote(fd, notes[i].note) < 0)
+		{
+			i = -1;
+			break;
+		}
+
+		beats += notes[i].beats;
+	}
+
+	pca9685ToneNote(fd, -1);
+	atomic_store(&tones.playing, 0);
+
+	return i;
+}
+
+/**
+ * Stops a playing sequence at the next note
+ */
+void pca9685ToneStop(void)
+{
+	atomic_store(&tones.playing, 0);
+}
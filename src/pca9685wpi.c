@@ -0,0 +1,265 @@
+/*************************************************************************
+ * pca9685wpi.c
+ *
+ * WiringPi glue: pins of a wiringPi node and a transport which uses the
+ * wiringPiI2C functions. Build with WIRINGPI=0 to leave it out.
+ *
+ * This software is a devLib extension to wiringPi <http://wiringpi.com/>
+ * and enables it to control the Adafruit PCA9685 16-Channel 12-bit
+ * PWM/Servo Driver <http://www.adafruit.com/products/815> via I2C interface.
+ *
+ * Copyright (c) 2014 Reinhard Sprung
+ *
+ * If you have questions or improvements email me at
+ * reinhard.sprung[at]gmail.com
+ *
+ * This software is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * The given code is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You can view the contents of the licence at <http://www.gnu.org/licenses/>.
+ **************************************************************************
+ */
+
+#include <wiringPi.h>
+#include <wiringPiI2C.h>
+
+#include "pca9685.h"
+#include "pca9685dev.h"
+
+
+// Declare
+static void myPwmWrite(struct wiringPiNodeStruct *node, int pin, int value);
+static void myOnOffWrite(struct wiringPiNodeStruct *node, int pin, int value);
+static int myOffRead(struct wiringPiNodeStruct *node, int pin);
+static int myOnRead(struct wiringPiNodeStruct *node, int pin);
+static int setupNode(const int pinBase, const int i2cAddress, float freq, int warm);
+
+
+/**
+ * Setup a PCA9685 device with wiringPi.
+ *  
+ * pinBase: 	Use a pinBase > 64, eg. 300
+ * i2cAddress:	The default address is 0x40
+ * freq:		Frequency is limited to about [24..1526] Hertz. Try 50 for servos
+ */
+int pca9685Setup(const int pinBase, const int i2cAddress, float freq)
+{
+	return setupNode(pinBase, i2cAddress, freq, 0);
+}
+
+/**
+ * Setup a PCA9685 device with wiringPi, keeping the state of the chip.
+ * MODE1, MODE2, PRESCALE and all pins are read from the chip and adopted unchanged,
+ * so restarting your program doesn't glitch the outputs.
+ */
+int pca9685SetupWarm(const int pinBase, const int i2cAddress)
+{
+	return setupNode(pinBase, i2cAddress, 0, 1);
+}
+
+/**
+ * Creates the wiringPi node of a chip and initializes it, or adopts its state if warm is set
+ */
+static int setupNode(const int pinBase, const int i2cAddress, float freq, int warm)
+{
+	// Create a node with 16 pins [0..15] + [16] for all
+	struct wiringPiNodeStruct *node = wiringPiNewNode(pinBase, PIN_ALL + 1);
+
+	// Check if pinBase is available
+	if (!node)
+		return -1;
+
+	// Check i2c address
+	int fd = wiringPiI2CSetup(i2cAddress);
+	if (fd < 0)
+		return fd;
+
+	// The file descriptor is a bus of its own, already talking to our address.
+	// It's a plain i2c-dev file descriptor, so we don't need wiringPi to talk to it.
+	struct pca9685Bus *bus = pca9685BusAttach(fd, &pca9685I2cOps);
+	if (!bus)
+		return -1;
+
+	bus->slave = i2cAddress;
+
+	// Setup the chip and set frequency of PWM signals
+	struct pca9685Dev *dev = pca9685DevAdd(fd, bus, i2cAddress);
+	if (!dev || (warm ? pca9685DevAdopt(dev) : pca9685DevInit(dev, freq)) < 0)
+		return -1;
+
+	node->fd			= fd;
+	node->pwmWrite		= myPwmWrite;
+	node->digitalWrite	= myOnOffWrite;
+	node->digitalRead	= myOffRead;
+	node->analogRead	= myOnRead;
+
+	return fd;
+}
+
+
+
+
+//------------------------------------------------------------------------------------------------------------------
+//
+//	WiringPi transport
+//
+//------------------------------------------------------------------------------------------------------------------
+
+
+
+
+/**
+ * WiringPi only offers 8 and 16 bit register access, no block or combined transfers
+ */
+static unsigned long wpiFuncs(struct pca9685Bus *bus)
+{
+	return 0;
+}
+
+/**
+ * Reads consecutive registers with 16 and 8 bit reads
+ */
+static int wpiRead(struct pca9685Bus *bus, int address, int reg, unsigned char *data, int len)
+{
+	int i, value;
+
+	if (pca9685BusSelect(bus, address) < 0)
+		return -1;
+
+	for (i = 0; i + 1 < len; i += 2)
+	{
+		if ((value = wiringPiI2CReadReg16(bus->fd, reg + i)) < 0)
+			return -1;
+
+		data[i]		= value & 0xFF;
+		data[i + 1] = (value >> 8) & 0xFF;
+	}
+
+	if (i < len)
+	{
+		if ((value = wiringPiI2CReadReg8(bus->fd, reg + i)) < 0)
+			return -1;
+
+		data[i] = value;
+	}
+
+	return 0;
+}
+
+/**
+ * Writes consecutive registers with 16 and 8 bit writes
+ */
+static int wpiWrite(struct pca9685Bus *bus, int address, int reg, const unsigned char *data, int len)
+{
+	int i;
+
+	if (pca9685BusSelect(bus, address) < 0)
+		return -1;
+
+	for (i = 0; i + 1 < len; i += 2)
+		if (wiringPiI2CWriteReg16(bus->fd, reg + i, data[i] | (data[i + 1] << 8)) < 0)
+			return -1;
+	if (i < len && wiringPiI2CWriteReg8(bus->fd, reg + i, data[i]) < 0)
+		return -1;
+
+	return 0;
+}
+
+
+const struct pca9685Ops pca9685WiringPiOps =
+{
+	"wiringPi",
+	wpiFuncs,
+	0,
+	wpiRead,
+	wpiWrite
+};
+
+
+
+
+//------------------------------------------------------------------------------------------------------------------
+//
+//	WiringPi functions
+//
+//------------------------------------------------------------------------------------------------------------------
+
+
+
+
+/**
+ * Simple PWM control which sets on-tick to 0 and off-tick to value.
+ * If value is <= 0, full-off will be enabled
+ * If value is >= 4096, full-on will be enabled
+ * Every value in between enables PWM output
+ * Only registers that actually change are written.
+ * In async mode, the value is posted to the writer thread.
+ */
+static void myPwmWrite(struct wiringPiNodeStruct *node, int pin, int value)
+{
+	int fd   = node->fd;
+	int ipin = pin - node->pinBase;
+
+	// Don't wait for the bus in async mode
+	if (pca9685AsyncPWM(fd, ipin, value) == 0)
+		return;
+
+	struct pca9685Dev *dev = pca9685DevLock(fd);
+	if (!dev)
+		return;
+
+	pca9685DevPWM(dev, ipin, value);
+	pca9685DevUnlock(dev);
+}
+
+/**
+ * Simple full-on and full-off control
+ * If value is 0, full-off will be enabled
+ * If value is not 0, full-on will be enabled
+ * Only registers that actually change are written.
+ */
+static void myOnOffWrite(struct wiringPiNodeStruct *node, int pin, int value)
+{
+	myPwmWrite(node, pin, value ? 4096 : 0);
+}
+
+/**
+ * Reads off registers as 16 bit of data (from the register cache)
+ * To get PWM: mask with 0xFFF
+ * To get full-off bit: mask with 0x1000
+ * Note: ALL_LED pin will always return 0
+ */
+static int myOffRead(struct wiringPiNodeStruct *node, int pin)
+{
+	int fd   = node->fd;
+	int ipin = pin - node->pinBase;
+
+	int off;
+	pca9685PWMRead(fd, ipin, 0, &off);
+
+	return off;
+}
+
+/**
+ * Reads on registers as 16 bit of data (from the register cache)
+ * To get PWM: mask with 0xFFF
+ * To get full-on bit: mask with 0x1000
+ * Note: ALL_LED pin will always return 0
+ */
+static int myOnRead(struct wiringPiNodeStruct *node, int pin)
+{
+	int fd   = node->fd;
+	int ipin = pin - node->pinBase;
+
+	int on;
+	pca9685PWMRead(fd, ipin, &on, 0);
+
+	return on;
+}